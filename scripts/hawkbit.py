@@ -2,9 +2,11 @@ from __future__ import print_function
 
 import argparse
 from datetime import datetime
+import hashlib
 import pprint
 import requests
 import json
+import struct
 import sys
 import time
 
@@ -13,9 +15,232 @@ password = 'admin'
 DS_URL_DEFAULT = '/rest/v1/distributionsets'
 SM_URL_DEFAULT = '/rest/v1/softwaremodules'
 RO_URL_DEFAULT = '/rest/v1/rollouts'
+SMT_URL_DEFAULT = '/rest/v1/softwaremoduletypes'
+DST_URL_DEFAULT = '/rest/v1/distributionsettypes'
+
+# Software module and distribution set type for delta patches. This
+# must match HAWKBIT_PART_OS_DELTA in src/lib/hawkbit.c.
+DELTA_TYPE = 'os-delta'
+# Delta patch format; see src/lib/delta_patch.h.
+DELTA_MAGIC = 0x31504446
+DELTA_OP_COPY = 0x01
+DELTA_OP_INSERT = 0x02
+# Shortest match worth a copy operation, which takes 9 bytes.
+DELTA_MIN_MATCH = 16
+# Compressed artifact format; see src/lib/lzss_stream.h. Devices
+# recognize compressed artifacts by the filename suffix.
+LZSS_MAGIC = 0x315a4c46
+LZSS_WINDOW_BITS = 11
+LZSS_MIN_MATCH = 3
+LZSS_MAX_MATCH = 0x7f + LZSS_MIN_MATCH
+LZSS_MAX_LITERAL = 0x80
+LZSS_MAX_CHAIN = 32
+LZSS_SUFFIX = '.lzss'
 
 ROLLOUT_START_DELAY = 5
 
+def make_delta(base, artifact, delta):
+    # Write a patch to "delta" which rebuilds "artifact" from "base".
+    #
+    # This greedily matches the artifact against the base, emitting
+    # copy operations for matches and insert operations for the rest.
+    # Firmware changes often leave long runs at the same offset with
+    # a few bytes changed, so the copy after the last match is tried
+    # before looking anything up.
+    with open(base, 'rb') as f:
+        src = f.read()
+    with open(artifact, 'rb') as f:
+        dst = f.read()
+
+    # Index every 4th offset: any match of DELTA_MIN_MATCH + 3 bytes
+    # or more is still found.
+    index = {}
+    for i in range(0, len(src) - DELTA_MIN_MATCH + 1, 4):
+        index.setdefault(src[i:i + DELTA_MIN_MATCH], i)
+
+    ops = []
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            ops.append(struct.pack('<BI', DELTA_OP_INSERT, len(literal)) +
+                       bytes(literal))
+            del literal[:]
+
+    t = 0
+    last = None
+    while t < len(dst):
+        key = dst[t:t + DELTA_MIN_MATCH]
+        if (last is not None and len(key) == DELTA_MIN_MATCH and
+                src[last:last + DELTA_MIN_MATCH] == key):
+            s = last
+        else:
+            s = index.get(key)
+
+        if s is None:
+            literal.append(dst[t])
+            t += 1
+            if last is not None:
+                last += 1
+            continue
+
+        # Extend the match backwards into the pending literal...
+        back = 0
+        while (back < len(literal) and back < s and
+               src[s - back - 1] == literal[-back - 1]):
+            back += 1
+        if back:
+            del literal[-back:]
+        # ... and forwards as far as it goes.
+        n = DELTA_MIN_MATCH
+        while (t + n < len(dst) and s + n < len(src) and
+               dst[t + n] == src[s + n]):
+            n += 1
+
+        flush_literal()
+        ops.append(struct.pack('<BII', DELTA_OP_COPY, s - back, n + back))
+        t += n
+        last = s + n
+    flush_literal()
+
+    with open(delta, 'wb') as f:
+        f.write(struct.pack('<III', DELTA_MAGIC, len(src), len(dst)))
+        f.write(hashlib.sha256(src).digest())
+        for op in ops:
+            f.write(op)
+        size = f.tell()
+
+    print('Delta patch: {} ({} bytes, {:.1f}% of {} bytes)'.format(
+          delta, size, 100.0 * size / max(len(dst), 1), len(dst)))
+
+def compress(artifact, compressed):
+    # Write an LZSS-compressed copy of "artifact" to "compressed",
+    # greedily taking the longest match found in a short hash chain.
+    with open(artifact, 'rb') as f:
+        data = f.read()
+
+    window = 1 << LZSS_WINDOW_BITS
+    heads = {}
+    chain = [None] * len(data)
+    out = bytearray(struct.pack('<IIB', LZSS_MAGIC, len(data),
+                                LZSS_WINDOW_BITS))
+    literal = bytearray()
+
+    def flush_literal():
+        while literal:
+            run = literal[:LZSS_MAX_LITERAL]
+            out.append(len(run) - 1)
+            out.extend(run)
+            del literal[:LZSS_MAX_LITERAL]
+
+    def insert(i):
+        key = data[i:i + LZSS_MIN_MATCH]
+        chain[i] = heads.get(key)
+        heads[key] = i
+
+    i = 0
+    while i < len(data):
+        best_len, best_pos = 0, None
+        cand = heads.get(data[i:i + LZSS_MIN_MATCH])
+        depth = 0
+        while (cand is not None and i - cand <= window and
+               depth < LZSS_MAX_CHAIN):
+            n = 0
+            while (n < LZSS_MAX_MATCH and i + n < len(data) and
+                   data[cand + n] == data[i + n]):
+                n += 1
+            if n > best_len:
+                best_len, best_pos = n, cand
+            cand = chain[cand]
+            depth += 1
+
+        if best_len < LZSS_MIN_MATCH:
+            literal.append(data[i])
+            insert(i)
+            i += 1
+            continue
+
+        flush_literal()
+        out.append(0x80 | (best_len - LZSS_MIN_MATCH))
+        out.extend(struct.pack('<H', i - best_pos))
+        for j in range(i, i + best_len):
+            insert(j)
+        i += best_len
+    flush_literal()
+
+    with open(compressed, 'wb') as f:
+        f.write(out)
+
+    print('Compressed: {} ({} bytes, {:.1f}% of {} bytes)'.format(
+          compressed, len(out), 100.0 * len(out) / max(len(data), 1),
+          len(data)))
+
+def find_type(url, key):
+    # Return the ID of the type with the given key at "url", or -1.
+    headers = {'Accept': 'application/json'}
+    response = requests.get(url, params={'q': 'key==' + key},
+                            auth=(user, password), headers=headers)
+
+    if response.status_code != 200:
+        return -response.status_code
+
+    for item in response.json().get('content', []):
+        if item.get('key') == key:
+            return int(item.get('id', -1))
+
+    return -1
+
+def create_type(url, body, verbose):
+    headers = {'Content-Type': 'application/json',
+               'Accept': 'application/json'}
+    response = requests.post(url, data=json.dumps([body]),
+                             auth=(user, password), headers=headers)
+
+    if response.status_code != 201:
+        return -response.status_code
+
+    response = response.json()
+
+    if verbose:
+        print('Got response from server when creating type:')
+        pprint.pprint(response)
+
+    type_id = -1
+    for item in response:
+        type_id = int(item.get('id', -1))
+
+    return type_id
+
+def ensure_delta_types(smt_url, dst_url, verbose):
+    # Make sure the software module and distribution set types for
+    # delta patches exist.
+    smt_id = find_type(smt_url, DELTA_TYPE)
+    if smt_id == -1:
+        print('Creating Software Module Type: ' + DELTA_TYPE)
+        smt_id = create_type(smt_url,
+                             {'key': DELTA_TYPE,
+                              'name': 'OS delta patch',
+                              'description': 'Delta patch against the ' +
+                                             'running OS image',
+                              'maxAssignments': 1},
+                             verbose)
+    if smt_id < 0:
+        return smt_id
+
+    dst_id = find_type(dst_url, DELTA_TYPE)
+    if dst_id == -1:
+        print('Creating Distribution Set Type: ' + DELTA_TYPE)
+        dst_id = create_type(dst_url,
+                             {'key': DELTA_TYPE,
+                              'name': 'OS delta patch',
+                              'description': 'OS delta patch only',
+                              'mandatorymodules': [{'id': smt_id}]},
+                             verbose)
+    if dst_id < 0:
+        return dst_id
+
+    return 0
+
 def start_rollout(ro_id, start_url):
     sys.stdout.write('Starting rollout in ' + str(ROLLOUT_START_DELAY) +
                      ' seconds ... ')
@@ -262,12 +487,26 @@ def main():
                         default='Foundries.io dm-hawkbit-mqtt reference app',
                         help='SW Module description')
     parser.add_argument('-f', '--file', help='Artifact to upload', required=True)
+    parser.add_argument('-db', '--delta-base',
+                        help='''Signed image the devices are running. If
+                        given, a delta patch from it to the artifact is
+                        generated and uploaded instead, with SW Module
+                        type ''' + DELTA_TYPE + '.')
+    parser.add_argument('-z', '--compress', action='store_true',
+                        help='''Compress the artifact (or delta patch)
+                        before uploading it.''')
     parser.add_argument('-ds', '--distribution-sets',
                         help='Distribution Sets URL', default=DS_URL_DEFAULT)
     parser.add_argument('-sm', '--software-modules',
                         help='Software Modules URL', default=SM_URL_DEFAULT)
     parser.add_argument('-ro', '--rollouts',
                         help='Rollouts URL', default=RO_URL_DEFAULT)
+    parser.add_argument('-smt', '--software-module-types',
+                        help='Software Module Types URL',
+                        default=SMT_URL_DEFAULT)
+    parser.add_argument('-dst', '--distribution-set-types',
+                        help='Distribution Set Types URL',
+                        default=DST_URL_DEFAULT)
     parser.add_argument('-rf', '--rollout-filter', help='Rollout name filter',
                         default=None)
     parser.add_argument('-rc', '--rollout-count', help='Rollout count',
@@ -285,6 +524,24 @@ def main():
     ds_url = "http://" + args.hostname + ":" + str(args.port) + args.distribution_sets
     sm_url = "http://" + args.hostname + ":" + str(args.port) + args.software_modules
     ro_url = "http://" + args.hostname + ":" + str(args.port) + args.rollouts
+    smt_url = ("http://" + args.hostname + ":" + str(args.port) +
+               args.software_module_types)
+    dst_url = ("http://" + args.hostname + ":" + str(args.port) +
+               args.distribution_set_types)
+
+    artifact = args.file
+    sm_type = args.type
+    if args.delta_base is not None:
+        artifact = args.file + '.delta'
+        sm_type = DELTA_TYPE
+        make_delta(args.delta_base, args.file, artifact)
+        ret = ensure_delta_types(smt_url, dst_url, args.verbose)
+        if ret < 0:
+            print('Error creating delta types: ' + str(ret))
+            return
+    if args.compress:
+        compress(artifact, artifact + LZSS_SUFFIX)
+        artifact += LZSS_SUFFIX
 
     swversion = args.swversion
     if swversion is None:
@@ -300,8 +557,8 @@ def main():
     ro_id = 1
 
     while existing_rollouts < args.rollout_count and ro_id > 0:
-        ro_id = publish_sm(args.provider, args.name, args.type, swversion,
-                           args.description, args.file, ds_url, sm_url, ro_url,
+        ro_id = publish_sm(args.provider, args.name, sm_type, swversion,
+                           args.description, artifact, ds_url, sm_url, ro_url,
                            args.rollout_filter, existing_rollouts, args.verbose)
 
         if args.rollout_count > 1 and ro_id > 0:
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2018 Foundries.io
+#
+# SPDX-License-Identifier: Apache-2.0
+
+# HTTP server for artifact download tests.
+#
+# It answers every GET, whatever the path, with one file, honoring
+# Range requests. Point a device at it with
+# CONFIG_FOTA_DOWNLOAD_MIRRORS="<address>:<port>", and compare the
+# "downloaded ... KiB/s" it logs with different
+# CONFIG_FOTA_DOWNLOAD_CONNECTIONS.
+#
+# The server adds no latency of its own. Add it on the link to the
+# device instead, so TCP sees it as it would a real one, e.g. on the
+# host's side of a qemu_x86 SLIP or TAP link:
+#
+#   tc qdisc add dev tap0 root netem delay 100ms
+
+from __future__ import print_function
+
+import argparse
+import http.server
+import re
+import socketserver
+
+RANGE_RE = re.compile(r'bytes=(\d+)-(\d*)$')
+
+
+class RangeHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        data = self.server.data
+        start, end = 0, len(data) - 1
+        status = 200
+        m = RANGE_RE.match(self.headers.get('Range', ''))
+        if m:
+            start = int(m.group(1))
+            if m.group(2):
+                end = min(int(m.group(2)), end)
+            if start > end:
+                self.send_error(416)
+                return
+            status = 206
+
+        self.send_response(status)
+        self.send_header('Content-Length', str(end - start + 1))
+        if status == 206:
+            self.send_header('Content-Range',
+                             'bytes %d-%d/%d' % (start, end, len(data)))
+        self.end_headers()
+        self.wfile.write(data[start:end + 1])
+
+
+class RangeServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, addr, data):
+        http.server.HTTPServer.__init__(self, addr, RangeHandler)
+        self.data = data
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Artifact download server with Range support')
+    parser.add_argument('file')
+    parser.add_argument('--port', type=int, default=8080)
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+    server = RangeServer(('', args.port), data)
+    print('Serving %s (%d bytes) on port %d' %
+          (args.file, len(data), args.port))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <misc/byteorder.h>
+#include <misc/util.h>
+
+#include "delta_patch.h"
+
+enum delta_patch_state {
+	DP_HEADER,		/* assembling the header */
+	DP_OPCODE,		/* expecting an opcode */
+	DP_COPY_ARGS,		/* assembling a copy's arguments */
+	DP_INSERT_ARGS,		/* assembling an insert's length */
+	DP_INSERT_DATA,		/* passing insert data through */
+};
+
+#define DP_COPY_ARGS_SIZE	(2 * sizeof(u32_t))
+#define DP_INSERT_ARGS_SIZE	sizeof(u32_t)
+
+/* Hash the source image and compare it with the header. */
+static int check_source(struct delta_patch *dp, const u8_t *sha256)
+{
+	u8_t digest[32];
+	size_t off, chunk;
+	int ret = 0;
+
+	mbedtls_sha256_init(&dp->sha256);
+	mbedtls_sha256_starts_ret(&dp->sha256, 0);
+	for (off = 0; off < dp->src_size; off += chunk) {
+		chunk = MIN(dp->src_size - off, sizeof(dp->buf));
+		ret = dp->read(off, dp->buf, chunk, dp->user_data);
+		if (ret) {
+			goto out;
+		}
+		mbedtls_sha256_update_ret(&dp->sha256, dp->buf, chunk);
+	}
+	mbedtls_sha256_finish_ret(&dp->sha256, digest);
+
+	if (memcmp(digest, sha256, sizeof(digest))) {
+		ret = -ESRCH;
+	}
+
+ out:
+	mbedtls_sha256_free(&dp->sha256);
+	return ret;
+}
+
+static int header_done(struct delta_patch *dp)
+{
+	if (sys_get_le32(dp->hdr) != DELTA_PATCH_MAGIC) {
+		return -EINVAL;
+	}
+
+	dp->src_size = sys_get_le32(dp->hdr + 4);
+	dp->dst_size = sys_get_le32(dp->hdr + 8);
+	if (dp->src_size > dp->src_max || dp->dst_size > dp->dst_max) {
+		return -EFBIG;
+	}
+
+	return check_source(dp, dp->hdr + 12);
+}
+
+static int copy(struct delta_patch *dp, u32_t src_off, u32_t len)
+{
+	size_t chunk;
+	int ret;
+
+	if (src_off > dp->src_size || len > dp->src_size - src_off ||
+	    len > dp->dst_size - dp->written) {
+		return -EINVAL;
+	}
+
+	while (len) {
+		chunk = MIN(len, sizeof(dp->buf));
+		ret = dp->read(src_off, dp->buf, chunk, dp->user_data);
+		if (ret) {
+			return ret;
+		}
+		ret = dp->write(dp->buf, chunk, dp->user_data);
+		if (ret) {
+			return ret;
+		}
+		src_off += chunk;
+		len -= chunk;
+		dp->written += chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Add up to "len" bytes to dp->hdr, until it holds "size" bytes.
+ * Returns the number of bytes used.
+ */
+static size_t assemble(struct delta_patch *dp, size_t size,
+		       const u8_t *data, size_t len)
+{
+	size_t n = MIN(size - dp->hdr_len, len);
+
+	memcpy(dp->hdr + dp->hdr_len, data, n);
+	dp->hdr_len += n;
+	return n;
+}
+
+/* Parse some of the patch; returns the number of bytes used. */
+static int parse(struct delta_patch *dp, const u8_t *data, size_t len)
+{
+	size_t n;
+	int ret;
+
+	switch (dp->state) {
+	case DP_HEADER:
+		n = assemble(dp, DELTA_PATCH_HDR_SIZE, data, len);
+		if (dp->hdr_len < DELTA_PATCH_HDR_SIZE) {
+			return n;
+		}
+		ret = header_done(dp);
+		break;
+	case DP_OPCODE:
+		n = 1;
+		dp->hdr_len = 0;
+		if (data[0] == DELTA_PATCH_OP_COPY) {
+			dp->state = DP_COPY_ARGS;
+		} else if (data[0] == DELTA_PATCH_OP_INSERT) {
+			dp->state = DP_INSERT_ARGS;
+		} else {
+			return -EINVAL;
+		}
+		return n;
+	case DP_COPY_ARGS:
+		n = assemble(dp, DP_COPY_ARGS_SIZE, data, len);
+		if (dp->hdr_len < DP_COPY_ARGS_SIZE) {
+			return n;
+		}
+		ret = copy(dp, sys_get_le32(dp->hdr),
+			   sys_get_le32(dp->hdr + 4));
+		break;
+	case DP_INSERT_ARGS:
+		n = assemble(dp, DP_INSERT_ARGS_SIZE, data, len);
+		if (dp->hdr_len < DP_INSERT_ARGS_SIZE) {
+			return n;
+		}
+		dp->insert_left = sys_get_le32(dp->hdr);
+		if (dp->insert_left > dp->dst_size - dp->written) {
+			return -EINVAL;
+		}
+		dp->state = dp->insert_left ? DP_INSERT_DATA : DP_OPCODE;
+		return n;
+	case DP_INSERT_DATA:
+		n = MIN(dp->insert_left, len);
+		ret = dp->write(data, n, dp->user_data);
+		if (ret) {
+			return ret;
+		}
+		dp->insert_left -= n;
+		dp->written += n;
+		if (dp->insert_left == 0) {
+			dp->state = DP_OPCODE;
+		}
+		return n;
+	default:
+		return -EINVAL;
+	}
+
+	if (ret) {
+		return ret;
+	}
+
+	dp->state = DP_OPCODE;
+	return n;
+}
+
+void delta_patch_init(struct delta_patch *dp, delta_patch_read_t read,
+		      delta_patch_write_t write, size_t src_max,
+		      size_t dst_max, void *user_data)
+{
+	memset(dp, 0, sizeof(*dp));
+	dp->read = read;
+	dp->write = write;
+	dp->src_max = src_max;
+	dp->dst_max = dst_max;
+	dp->user_data = user_data;
+	dp->state = DP_HEADER;
+}
+
+int delta_patch_feed(struct delta_patch *dp, const u8_t *data, size_t len)
+{
+	int ret;
+
+	while (len && !dp->err) {
+		ret = parse(dp, data, len);
+		if (ret < 0) {
+			dp->err = ret;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return dp->err;
+}
+
+int delta_patch_finish(struct delta_patch *dp)
+{
+	if (dp->err) {
+		return dp->err;
+	}
+
+	if (dp->state != DP_OPCODE || dp->written != dp->dst_size) {
+		dp->err = -EINVAL;
+	}
+
+	return dp->err;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_DELTA_PATCH_H__
+#define FOTA_DELTA_PATCH_H__
+
+/**
+ * @file
+ * @brief Streaming delta patch decoder.
+ *
+ * A delta patch rebuilds a new firmware image from the image that is
+ * currently installed (the "source") using a list of operations
+ * generated by scripts/hawkbit.py. The patch is applied as it
+ * arrives, in arbitrarily sized pieces, using a fixed amount of
+ * memory.
+ *
+ * All values are little endian. A patch starts with this header:
+ *
+ *     u32_t magic;            DELTA_PATCH_MAGIC
+ *     u32_t src_size;         size of the source image
+ *     u32_t dst_size;         size of the rebuilt image
+ *     u8_t src_sha256[32];    SHA-256 of the source image
+ *
+ * followed by operations, each starting with an opcode byte:
+ *
+ *     DELTA_PATCH_OP_COPY:    u32_t src_off, u32_t len
+ *         Copy len bytes from the source, starting at src_off.
+ *     DELTA_PATCH_OP_INSERT:  u32_t len, then len bytes of data
+ *         Insert the data which follows.
+ *
+ * The source image is checked against the header before any output
+ * is produced.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+
+#define DELTA_PATCH_MAGIC	0x31504446 /* "FDP1" */
+#define DELTA_PATCH_OP_COPY	0x01
+#define DELTA_PATCH_OP_INSERT	0x02
+
+#define DELTA_PATCH_HDR_SIZE	(3 * sizeof(u32_t) + 32)
+/* Size of the buffer used to copy from the source image. */
+#define DELTA_PATCH_BUF_SIZE	256
+
+/**
+ * @brief Read from the source image.
+ *
+ * @param off Offset into the source image
+ * @param buf Where to store the data
+ * @param len Number of bytes to read
+ * @param user_data User data passed to delta_patch_init()
+ * @return 0 on success, negative errno on error.
+ */
+typedef int (*delta_patch_read_t)(size_t off, u8_t *buf, size_t len,
+				  void *user_data);
+
+/**
+ * @brief Write the next piece of the rebuilt image.
+ *
+ * @param buf Data to write
+ * @param len Number of bytes in buf
+ * @param user_data User data passed to delta_patch_init()
+ * @return 0 on success, negative errno on error.
+ */
+typedef int (*delta_patch_write_t)(const u8_t *buf, size_t len,
+				   void *user_data);
+
+/* Everything in here is private. */
+struct delta_patch {
+	delta_patch_read_t	 read;
+	delta_patch_write_t	 write;
+	void			*user_data;
+	size_t			 src_max;
+	size_t			 dst_max;
+	int			 err;
+	u8_t			 state;
+	/* Header or opcode being assembled. */
+	u8_t			 hdr[DELTA_PATCH_HDR_SIZE];
+	size_t			 hdr_len;
+	u32_t			 src_size;
+	u32_t			 dst_size;
+	u32_t			 written;
+	u32_t			 insert_left;
+	mbedtls_sha256_context	 sha256;
+	u8_t			 buf[DELTA_PATCH_BUF_SIZE];
+};
+
+/**
+ * @brief Prepare to apply a new patch.
+ *
+ * @param dp Patch state to initialize
+ * @param read Callback for reading the source image
+ * @param write Callback for writing the rebuilt image
+ * @param src_max Size of the area holding the source image
+ * @param dst_max Size of the area the rebuilt image is written to
+ * @param user_data Passed along to the callbacks
+ */
+void delta_patch_init(struct delta_patch *dp, delta_patch_read_t read,
+		      delta_patch_write_t write, size_t src_max,
+		      size_t dst_max, void *user_data);
+
+/**
+ * @brief Apply the next piece of a patch.
+ *
+ * Errors are sticky: once this fails, it keeps returning the same
+ * error without doing anything else.
+ *
+ * @param dp Patch state
+ * @param data Next bytes of the patch
+ * @param len Number of bytes in data
+ * @return 0 on success; -EINVAL if the patch is malformed, -EFBIG if
+ *         an image doesn't fit, -ESRCH if the patch was made against
+ *         a different source image, or an error from a callback.
+ */
+int delta_patch_feed(struct delta_patch *dp, const u8_t *data, size_t len);
+
+/**
+ * @brief Finish applying a patch.
+ *
+ * @param dp Patch state
+ * @return 0 if the whole image was rebuilt, negative errno otherwise.
+ */
+int delta_patch_finish(struct delta_patch *dp);
+
+/**
+ * @brief Get the size of the rebuilt image given in a patch's header.
+ *
+ * @param dp Patch state
+ * @return Rebuilt image size, or 0 if the header hasn't been parsed.
+ */
+static inline size_t delta_patch_dst_size(const struct delta_patch *dp)
+{
+	return dp->dst_size;
+}
+
+#endif /* FOTA_DELTA_PATCH_H__ */
@@ -17,12 +17,12 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 #include <misc/byteorder.h>
 #include <flash.h>
 #include <zephyr.h>
 #include <dfu/mcuboot.h>
-#include <dfu/flash_img.h>
 #include <logging/log_ctrl.h>
 #include <misc/reboot.h>
 #include <net/http.h>
@@ -34,9 +34,34 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 
 #include <soc.h>
 
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+#include <mbedtls/sha256.h>
+#if !defined(MBEDTLS_SHA256_C)
+#error "CONFIG_FOTA_VERIFY_ARTIFACT requires mbedTLS SHA-256"
+#endif
+/* SHA-1 is only a fallback for artifacts without a SHA-256. */
+#if defined(MBEDTLS_SHA1_C)
+#include <mbedtls/sha1.h>
+#endif
+#endif
+
 #include "hawkbit.h"
 #include "hawkbit_priv.h"
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+#include "delta_patch.h"
+#endif
+#include "json_stream.h"
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+#include "lzss_stream.h"
+#endif
+#if defined(CONFIG_FOTA_CHECK_IMAGE)
+#include "mcuboot_img.h"
+#endif
 #include "product_id.h"
+#include "state_store.h"
+#if defined(CONFIG_FOTA_TLS)
+#include "tls_conf.h"
+#endif
 #ifdef CONFIG_NET_L2_BT
 #include "../bluetooth.h"
 #endif
@@ -44,11 +69,15 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 /*
  * Uncomment for extra debug printing.
  *
- * Currently, this dumps JSON responses received from the server.
+ * Currently, this dumps JSON responses received from the server, and
+ * the results of decoding them.
  */
 /* #define HAWKBIT_EXTRA_DEBUG */
 
-#define HAWKBIT_MAX_SERVER_FAIL	5
+/* Longest Retry-After we honor, in seconds. */
+#define HAWKBIT_RETRY_AFTER_MAX	(24 * 60 * 60)
+
+#define HAWKBIT_SECS_PER_DAY	(24 * 60 * 60)
 
 /* Network configuration checks */
 #if defined(CONFIG_NET_IPV6)
@@ -80,21 +109,209 @@ BUILD_ASSERT_MSG(sizeof(CONFIG_NET_CONFIG_PEER_IPV4_ADDR) > 1,
  * adding a "safe" cushion (or round up to a nice big number).
  */
 /* TODO: optimize these values */
-#define TCP_RECV_BUFFER_SIZE	2048
+/*
+ * JSON responses are parsed as they arrive, so this only needs to
+ * hold the HTTP headers plus the first part of the body.
+ */
+#define TCP_RECV_BUFFER_SIZE	1024
+/*
+ * Storage for the strings we keep from a decoded JSON response. A
+ * deployment needs roughly 400 bytes per artifact, for its download
+ * link and hashes, and 256 for itself and its chunks; this has room
+ * for HAWKBIT_DEP_MAX_ARTIFACTS.
+ */
+#define JSON_STRINGS_SIZE	2688
+#define JSON_STRINGS_PER_ARTIFACT	400
+#define JSON_STRINGS_PER_DEPLOYMENT	256
 #define URL_BUFFER_SIZE		128
 #define STATUS_BUFFER_SIZE	200
 #define HTTP_HEADER_BUFFER_SIZE	512
 
+/* Room for the validators of the base resource, for conditional polls. */
+#define HAWKBIT_ETAG_SIZE	48
+#define HAWKBIT_DATE_SIZE	32	/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HAWKBIT_POLL_HEADER_SIZE	160
+#define DEPLOYMENT_BASE_SIZE	40	/* TODO: Find a better value */
+
+#define HAWKBIT_SHA1_SIZE	20
+#define HAWKBIT_SHA256_SIZE	32
+
+/* Hosts artifacts are downloaded from, other than the hawkBit server. */
+#define HAWKBIT_HOST_SIZE	48
+#define HAWKBIT_MIRRORS_MAX	4
+/* Consecutive failures after which a mirror is skipped. */
+#define HAWKBIT_MIRROR_FAILURES_MAX	3
+/* Bytes the expected transfer time of a mirror is estimated for. */
+#define HAWKBIT_MIRROR_COST_BYTES	65536
+/* Redirects followed while downloading an artifact. */
+#define HAWKBIT_REDIRECTS_MAX	3
+#define HAWKBIT_HTTP_SCHEME	"http://"
+
+/* Maximum number of artifacts in a deployment. */
+#define HAWKBIT_DEP_MAX_ARTIFACTS	(HAWKBIT_DEP_MAX_CHUNKS * \
+					 HAWKBIT_DEP_MAX_CHUNK_ARTS)
+
+BUILD_ASSERT_MSG(JSON_STRINGS_SIZE >= JSON_STRINGS_PER_DEPLOYMENT +
+		 HAWKBIT_DEP_MAX_ARTIFACTS * JSON_STRINGS_PER_ARTIFACT,
+		 "JSON_STRINGS_SIZE is too small for the largest deployment");
+
+/* An HTTP server, by address (or name, with DNS) and port. */
+struct hawkbit_host {
+	char addr[HAWKBIT_HOST_SIZE];
+	u16_t port;
+};
+
+/*
+ * A download mirror, with smoothed measurements of how it did: the
+ * time from sending a request until the response body started, which
+ * includes connecting if needed, and the rate the body arrived at.
+ */
+struct hawkbit_mirror {
+	struct hawkbit_host host;
+	u32_t latency_ms;
+	u32_t rate;		/* bytes per second; 0 if not measured */
+	u8_t failures;		/* consecutive */
+};
+
 struct hawkbit_download {
 	size_t http_content_size;
 	size_t downloaded_size;
 	int download_progress;
+	int reported_progress;	/* in the last progress feedback */
+	u32_t reported_ms;	/* uptime of the last progress feedback */
 	int download_status;
+	size_t resume_offset;	/* where this transfer's Range starts */
+	size_t segment_end;	/* ... and where it ends */
+	bool ranged;		/* this transfer has a Range header */
+	bool segment_done;	/* ... and it is over, but more remains */
+	size_t file_size;	/* of the whole artifact */
+	size_t journal_offset;	/* last offset recorded in the journal */
+	unsigned int flags;	/* HAWKBIT_ARTIFACT_* */
+	size_t written_size;	/* bytes handled by the writer thread */
+	bool pending;		/* a transfer is in flight */
+	bool lanes;		/* over several connections */
+	bool writer_wait;	/* ... waiting for a free writer buffer */
+	size_t next_offset;	/* ... up to which segments were requested */
+	size_t last_progress;	/* at the last HAWKBIT_DOWNLOAD_TIMEOUT */
+	/* Where the artifact comes from; host is NULL for the server. */
+	const struct hawkbit_host *host;
+	const char *path;
+	struct hawkbit_mirror *mirror;	/* if host is one */
+	int redirects;
+	bool redirected;	/* this transfer was: follow hbc->content_url */
+	u32_t request_ms;	/* uptime when this transfer was sent */
+	u32_t first_byte_ms;	/* ... when its body started, or 0 */
+	u32_t done_ms;		/* ... and when it was over */
+};
+
+/*
+ * Buffer for handing downloaded data from the receive callback to the
+ * writer thread.
+ */
+struct hawkbit_wbuf {
+	void *fifo_reserved;
+	size_t len;
+	bool final;		/* last piece of the artifact */
+	u8_t data[CONFIG_FOTA_FLASH_WRITER_BUFFER_SIZE] __aligned(4);
+};
+
+/* Artifact hashes from the deployment; all zeroes if unknown. */
+struct hawkbit_artifact_hashes {
+	u8_t sha1[HAWKBIT_SHA1_SIZE];
+	u8_t sha256[HAWKBIT_SHA256_SIZE];
+};
+
+/* A flash partition which deployment chunks can be written to. */
+struct hawkbit_part {
+	const char *name;	/* chunk "part" */
+	off_t offset;
+	size_t size;
+	unsigned int flags;	/* HAWKBIT_ARTIFACT_* */
+};
+
+/* An artifact queued for download by hawkbit_parse_deployment(). */
+struct hawkbit_artifact {
+	const struct hawkbit_part *part;
+	off_t offset;		/* where it is written to in flash */
+	s32_t size;
+	unsigned int flags;	/* HAWKBIT_ARTIFACT_* */
+	struct hawkbit_artifact_hashes hashes;
+	const char *url;	/* in hbc->json_strings */
+};
+
+/* Running hash of the artifact being written to flash. */
+struct hawkbit_hash {
+	enum {
+		HAWKBIT_HASH_NONE,
+		HAWKBIT_HASH_SHA1,
+		HAWKBIT_HASH_SHA256,
+	} type;
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+	union {
+#if defined(MBEDTLS_SHA1_C)
+		mbedtls_sha1_context sha1;
+#endif
+		mbedtls_sha256_context sha256;
+	};
+#endif
+	size_t len;		/* bytes hashed so far */
+	u64_t cycles;		/* hardware cycles spent hashing */
+};
+
+/*
+ * Steps of a poll cycle. Each runs from the work queue, which gets to
+ * do other work in between; see hawkbit_work_fn().
+ */
+enum hawkbit_step {
+	HAWKBIT_STEP_FEEDBACK,		/* deliver the outbox */
+	HAWKBIT_STEP_POLL,		/* the base resource */
+	HAWKBIT_STEP_DEPLOYMENT,	/* deploymentBase, and what to do */
+	HAWKBIT_STEP_DOWNLOAD,		/* an artifact, as data arrives */
+	HAWKBIT_STEP_VERIFY,		/* ... once it is all written */
+	HAWKBIT_STEP_INSTALL,		/* stage, close or reboot */
+};
+
+/* hawkbit_step_*() results, besides 0 when the poll cycle is done. */
+#define HAWKBIT_STEP_NEXT	1	/* run hbc->step right away */
+#define HAWKBIT_STEP_WAIT	2	/* ... once the download moves on */
+
+/* The deployment being installed, between steps. */
+struct hawkbit_deployment {
+	s32_t href_acid;	/* per the deployment base href */
+	bool install;		/* or just stage the image */
+	bool image;		/* a firmware image was downloaded */
+	int artifact;		/* index of the one being downloaded */
+	int attempt;		/* ... and of its download attempt */
+	size_t offset;		/* where this attempt started */
+	size_t start_offset;	/* ... and the first one */
+	u32_t start_ms;
+	int result;		/* how the download ended */
+};
+
+/* Per-poll HTTP round-trip accounting. */
+struct hawkbit_conn_stats {
+	int requests;
+	int connects;
+	int handshakes;		/* TLS */
+	u32_t handshake_ms;	/* in requests which waited for one */
 };
 
 struct hawkbit_context {
-	int failures;
+	int failures;		/* consecutive failed polls */
+	s32_t retry_after;	/* minimum delay the server asked for */
+	s32_t window_wait;	/* until the window we wait for opens */
+	bool poll_trigger;	/* polls are triggered over MQTT */
+	bool poll_requested;	/* ... and one was, during a poll cycle */
+	atomic_t triggers;	/* HAWKBIT_TRIGGER_*, for trigger_work */
 	struct http_ctx http_ctx;
+	bool http_open;		/* http_ctx is initialized */
+	bool http_closed;	/* ... but the server closed the connection */
+	struct hawkbit_host conn_host;	/* ... to this; empty: the server */
+	u32_t idle_ms;		/* uptime when the last poll left it */
+#if defined(CONFIG_FOTA_TLS)
+	u8_t tls_buffer[TLS_CONF_REQUEST_BUF_SIZE];
+#endif
+	struct hawkbit_conn_stats stats;
 	struct http_request http_req;
 	u8_t tcp_buffer[TCP_RECV_BUFFER_SIZE];
 	size_t tcp_buffer_size;
@@ -102,13 +319,75 @@ struct hawkbit_context {
 	size_t url_buffer_size;
 	u8_t status_buffer[STATUS_BUFFER_SIZE];
 	size_t status_buffer_size;
+	struct json_stream json;
+	void *json_res;		/* structure being decoded */
+	bool json_body;		/* HTTP headers have been skipped */
+	char json_strings[JSON_STRINGS_SIZE];
+	size_t json_strings_used;
 	struct hawkbit_download dl;
+	/* The current deployment's artifacts, downloaded in order. */
+	struct hawkbit_artifact artifacts[HAWKBIT_DEP_MAX_ARTIFACTS];
+	size_t num_artifacts;
+	const struct hawkbit_artifact *art;	/* being downloaded */
+	/*
+	 * Bytes of the artifact's image or data passed to flash. The
+	 * last partial write block is held in write_tail until it's
+	 * complete or flushed.
+	 */
+	size_t data_written;
+	u8_t write_tail[FLASH_WRITE_BLOCK_SIZE];
+	struct hawkbit_wbuf *wbuf;	/* being filled by install_update_cb */
+	struct hawkbit_hash hash;
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+	struct delta_patch delta;
+#endif
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+	struct lzss_stream lzss;
+#endif
+#if defined(CONFIG_FOTA_CHECK_IMAGE)
+	struct mcuboot_img_check img_check;	/* of the image in slot1 */
+#endif
+	char range_header[64];
+	/* Host named by an artifact URL or a redirect, and its URL. */
+	struct hawkbit_host content_host;
+	char content_url[URL_BUFFER_SIZE];
+	enum hawkbit_step step;
+	struct hawkbit_deployment dep;
+	s32_t action_id;	/* being installed */
+	s32_t cancel_acid;	/* from the last cancelation check */
+	u32_t base_poll_ms;	/* uptime of the last base resource poll */
+	/*
+	 * Time of day, in seconds since midnight UTC, from the Date
+	 * header of the last JSON response (-1 if none yet), and the
+	 * uptime it came at. That's all the update windows need.
+	 */
+	s32_t date_sod;
+	u32_t date_ms;
+	/*
+	 * Base resource caching: the validators of the last base
+	 * resource received, what it said, and the last action whose
+	 * closing feedback the server got, which needs no more work.
+	 */
+	bool json_validators;	/* save the response's validators */
+	char etag[HAWKBIT_ETAG_SIZE];
+	char last_modified[HAWKBIT_DATE_SIZE];
+	char poll_header[HAWKBIT_POLL_HEADER_SIZE];
+	char deployment_base[DEPLOYMENT_BASE_SIZE];
+	s32_t handled_acid;	/* -1 if none */
 	struct k_work_q *work_q;
 	struct k_delayed_work work;
+	struct k_work trigger_work;	/* handles triggers on work_q */
 	struct k_sem *sem;
-#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
-	int last_offset;
-#endif
+	/*
+	 * Erase scheduler state, protected by erase_lock, as is art.
+	 * Flash is known to be erased from erase_base up to
+	 * erase_offset; erase_end is as far as it may go.
+	 */
+	bool erase_active;	/* erase ahead when the writer is idle */
+	bool erase_clean;	/* nothing was written since erase_base */
+	off_t erase_base;
+	off_t erase_offset;
+	off_t erase_end;
 };
 
 struct hawkbit_device_acid {
@@ -116,28 +395,86 @@ struct hawkbit_device_acid {
 	u32_t update;
 };
 
-struct json_data_t {
-	char *data;
-	size_t len;
-};
-
 typedef enum {
 	HAWKBIT_ACID_CURRENT = 0,
 	HAWKBIT_ACID_UPDATE,
 } hawkbit_dev_acid_t;
 
 #define HAWKBIT_RX_TIMEOUT	K_SECONDS(10)
+/* hawkbit_query() result for a 304 Not Modified response. */
+#define HAWKBIT_NOT_MODIFIED	1
 
 static int poll_sleep = K_SECONDS(30);
+static struct hawkbit_mirror mirrors[HAWKBIT_MIRRORS_MAX];
+static size_t num_mirrors;
 #if defined(CONFIG_NET_MGMT_EVENT)
 static struct net_mgmt_event_callback cb;
 #endif
 
+/*
+ * Chunk "part" values we understand. hawkBit takes these from the
+ * software module type; see scripts/hawkbit.py.
+ */
+#define HAWKBIT_PART_OS			"os"
+#define HAWKBIT_PART_OS_DELTA		"os-delta"
+/* Artifact filename suffix marking compressed artifacts. */
+#define HAWKBIT_COMPRESSED_SUFFIX	".lzss"
+
+/*
+ * Artifact flags. Artifacts with any of these set are either
+ * transformed on the way to slot1 or not written there at all, so
+ * their downloads can't be resumed.
+ */
+#define HAWKBIT_ARTIFACT_DELTA		BIT(0)	/* a delta patch */
+#define HAWKBIT_ARTIFACT_COMPRESSED	BIT(1)	/* LZSS compressed */
+#define HAWKBIT_ARTIFACT_DATA		BIT(2)	/* not the firmware image */
+
 #define HAWKBIT_DOWNLOAD_TIMEOUT	K_SECONDS(10)
+/* Number of times a stalled download is resumed before giving up. */
+#define HAWKBIT_DOWNLOAD_ATTEMPTS	3
 
 #define HTTP_HEADER_CONTENT_TYPE_JSON		"application/json"
 #define HTTP_HEADER_CONNECTION_CLOSE_CRLF	"Connection: close\r\n"
 
+/*
+ * With CONFIG_FOTA_HTTP_KEEPALIVE, a single HTTP/1.1 connection is
+ * reused for every request made during a poll cycle, so we don't ask
+ * the server to close it.
+ */
+#define HTTP_HEADER_RANGE_FMT_CRLF		"Range: bytes=%zu-%zu\r\n"
+#define HTTP_HEADER_IF_NONE_MATCH_FMT_CRLF	"If-None-Match: %s\r\n"
+#define HTTP_HEADER_IF_MODIFIED_SINCE_FMT_CRLF	"If-Modified-Since: %s\r\n"
+#if defined(CONFIG_FOTA_HTTP_KEEPALIVE)
+#define HAWKBIT_HEADER_FIELDS			NULL
+#define HAWKBIT_RANGE_HEADER_FIELDS_FMT		HTTP_HEADER_RANGE_FMT_CRLF
+#else
+#define HAWKBIT_HEADER_FIELDS			HTTP_HEADER_CONNECTION_CLOSE_CRLF
+#define HAWKBIT_RANGE_HEADER_FIELDS_FMT		HTTP_HEADER_RANGE_FMT_CRLF \
+						HTTP_HEADER_CONNECTION_CLOSE_CRLF
+#endif
+
+/* How long the server connection may be kept between polls. */
+#if defined(CONFIG_FOTA_HTTP_IDLE_TIMEOUT)
+#define HAWKBIT_IDLE_TIMEOUT	K_SECONDS(CONFIG_FOTA_HTTP_IDLE_TIMEOUT)
+#else
+#define HAWKBIT_IDLE_TIMEOUT	0
+#endif
+
+/* Poll scheduling while polls are triggered over MQTT. */
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+#define HAWKBIT_TRIGGER_POLL_INTERVAL \
+	K_SECONDS(CONFIG_FOTA_MQTT_POLL_INTERVAL)
+#define HAWKBIT_TRIGGER_POLL_SPREAD \
+	K_SECONDS(CONFIG_FOTA_MQTT_POLL_SPREAD)
+#else
+#define HAWKBIT_TRIGGER_POLL_INTERVAL	0
+#define HAWKBIT_TRIGGER_POLL_SPREAD	0
+#endif
+
+/* Bits in hbc->triggers. */
+#define HAWKBIT_TRIGGER_POLL	0	/* hawkbit_poll_now() was called */
+#define HAWKBIT_TRIGGER_ACTIVE	1	/* last hawkbit_set_poll_trigger() */
+
 static struct hawkbit_context hb_context;
 static struct k_sem hb_sem;
 
@@ -164,19 +501,148 @@ static struct net_buf_pool *data_pool(void)
 #define data_pool NULL
 #endif /* CONFIG_NET_CONTEXT_NET_PKT_POOL */
 
+#if defined(CONFIG_FOTA_TLS)
+NET_APP_TLS_POOL_DEFINE(hawkbit_tls_pool, 10);
+K_THREAD_STACK_DEFINE(hawkbit_tls_stack, CONFIG_FOTA_TLS_STACK_SIZE);
+#endif
+
 static struct device *flash_dev;
-static struct flash_img_context dfu_ctx;
 
-#define FLASH_BANK_SIZE FLASH_AREA_IMAGE_1_SIZE
+/*
+ * Image slots. The application runs from slot0 and downloads new
+ * images to slot1, except with direct-XIP, where MCUboot runs images
+ * in place from either slot: an application linked for slot1 (see
+ * CONFIG_FOTA_UPGRADE_DIRECT_XIP) runs from there, and downloads to
+ * slot0. Elsewhere in this file, "slot1" means the download slot.
+ */
+#if defined(CONFIG_FOTA_UPGRADE_DIRECT_XIP) && \
+	CONFIG_FLASH_LOAD_OFFSET == FLASH_AREA_IMAGE_1_OFFSET
+#define RUN_SLOT_OFFSET		FLASH_AREA_IMAGE_1_OFFSET
+#define DL_SLOT_OFFSET		FLASH_AREA_IMAGE_0_OFFSET
+#define FLASH_BANK_SIZE		FLASH_AREA_IMAGE_0_SIZE
+#define HAWKBIT_PART_OS_SLOT	"os-slot0"
+#define HAWKBIT_PART_OS_OTHER	"os-slot1"
+#else
+#define RUN_SLOT_OFFSET		FLASH_AREA_IMAGE_0_OFFSET
+#define DL_SLOT_OFFSET		FLASH_AREA_IMAGE_1_OFFSET
+#define FLASH_BANK_SIZE		FLASH_AREA_IMAGE_1_SIZE
+#define HAWKBIT_PART_OS_SLOT	"os-slot1"
+#define HAWKBIT_PART_OS_OTHER	"os-slot0"
+#endif
+#define SLOT1_END		(DL_SLOT_OFFSET + FLASH_BANK_SIZE)
+
+/* Where new images run from: slot0, unless MCUboot runs them in place. */
+#if defined(CONFIG_FOTA_UPGRADE_DIRECT_XIP)
+#define EXEC_SLOT_OFFSET	DL_SLOT_OFFSET
+#define EXEC_SLOT_SIZE		FLASH_BANK_SIZE
+#else
+#define EXEC_SLOT_OFFSET	FLASH_AREA_IMAGE_0_OFFSET
+#define EXEC_SLOT_SIZE		FLASH_AREA_IMAGE_0_SIZE
+#endif
+
+/*
+ * Offset in slot1 from which the old image, left there after a new
+ * one is confirmed, remains to be erased; see hawkbit_cleanup_fn().
+ * Protected by erase_lock.
+ */
+static off_t cleanup_offset = SLOT1_END;
+static struct k_work cleanup_work;
 
 /*
- * Descriptors for mapping between JSON and structure representations.
+ * Where each chunk "part" is written. The firmware image goes to
+ * slot1. Secondary payloads are written as they are to a partition of
+ * their own, which boards provide by adding a partition with the
+ * matching label to their DT overlay. The artifacts in such a chunk
+ * are written one after the other, each starting on an erase block.
+ * Parts of size 0 are for other devices, and are skipped.
  */
+static const struct hawkbit_part hawkbit_parts[] = {
+#if defined(CONFIG_FOTA_UPGRADE_DIRECT_XIP)
+	/* Images are linked for the slot they run from. */
+	{
+		.name = HAWKBIT_PART_OS_SLOT,
+		.offset = DL_SLOT_OFFSET,
+		.size = FLASH_BANK_SIZE,
+	},
+	{
+		.name = HAWKBIT_PART_OS_OTHER,
+	},
+#else
+	{
+		.name = HAWKBIT_PART_OS,
+		.offset = DL_SLOT_OFFSET,
+		.size = FLASH_BANK_SIZE,
+	},
+#endif
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+	{
+		.name = HAWKBIT_PART_OS_DELTA,
+		.offset = DL_SLOT_OFFSET,
+		.size = FLASH_BANK_SIZE,
+		.flags = HAWKBIT_ARTIFACT_DELTA,
+	},
+#endif
+#if defined(FLASH_AREA_CALIBRATION_OFFSET)
+	{
+		.name = "calibration",
+		.offset = FLASH_AREA_CALIBRATION_OFFSET,
+		.size = FLASH_AREA_CALIBRATION_SIZE,
+		.flags = HAWKBIT_ARTIFACT_DATA,
+	},
+#endif
+#if defined(FLASH_AREA_COPROCESSOR_OFFSET)
+	{
+		.name = "coprocessor",
+		.offset = FLASH_AREA_COPROCESSOR_OFFSET,
+		.size = FLASH_AREA_COPROCESSOR_SIZE,
+		.flags = HAWKBIT_ARTIFACT_DATA,
+	},
+#endif
+};
 
-static const struct json_obj_descr json_href_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_href, href, JSON_TOK_STRING),
+/*
+ * Persistent state.
+ *
+ * The first two erase blocks of the application state partition hold
+ * a state_store, so that updating any of these values appends to a
+ * log instead of erasing flash; see state_store.h.
+ */
+enum hawkbit_state_id {
+	HAWKBIT_STATE_ACID = 0,		/* struct hawkbit_device_acid */
+	HAWKBIT_STATE_JOURNAL,		/* struct hawkbit_journal_hdr */
+	HAWKBIT_STATE_JOURNAL_OFFSET,	/* u32_t */
+	HAWKBIT_STATE_OUTBOX,		/* struct hawkbit_outbox */
+	HAWKBIT_STATE_POLL_SLEEP,	/* s32_t poll_sleep */
+	HAWKBIT_STATE_UPDATE_SLOT,	/* u32_t, for direct-XIP */
+	HAWKBIT_STATE_STAGED,		/* struct hawkbit_journal_hdr */
 };
 
+BUILD_ASSERT_MSG(FLASH_AREA_APPLICATION_STATE_SIZE >=
+		 2 * FLASH_ERASE_BLOCK_SIZE,
+		 "application-state partition too small for state store");
+
+static struct state_store state_store;
+
+/*
+ * Download journal.
+ *
+ * This records the progress of the current artifact download, so it
+ * can be resumed with an HTTP Range request after a stall or a
+ * reboot: which artifact it is, and the slot1 offset up to which it
+ * has been committed to flash. Offsets are multiples of
+ * FLASH_ERASE_BLOCK_SIZE, so a resumed download starts at the
+ * beginning of an erase block.
+ */
+struct hawkbit_journal_hdr {
+	s32_t action_id;
+	u32_t size;
+	u8_t sha1[HAWKBIT_SHA1_SIZE];
+} __packed;
+
+/*
+ * Descriptors for encoding structures we send as JSON.
+ */
+
 static const struct json_obj_descr json_status_result_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct hawkbit_status_result, finished,
 			    JSON_TOK_STRING),
@@ -188,32 +654,6 @@ static const struct json_obj_descr json_status_descr[] = {
 			      json_status_result_descr),
 };
 
-static const struct json_obj_descr json_ctl_res_sleep_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_ctl_res_sleep, sleep,
-			    JSON_TOK_STRING),
-};
-
-static const struct json_obj_descr json_ctl_res_polling_descr[] = {
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res_polling, polling,
-			      json_ctl_res_sleep_descr),
-};
-
-static const struct json_obj_descr json_ctl_res_links_descr[] = {
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res_links, deploymentBase,
-			      json_href_descr),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res_links, cancelAction,
-			      json_href_descr),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res_links, configData,
-			      json_href_descr),
-};
-
-static const struct json_obj_descr json_ctl_res_descr[] = {
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res, config,
-			      json_ctl_res_polling_descr),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_ctl_res, _links,
-			      json_ctl_res_links_descr),
-};
-
 static const struct json_obj_descr json_cfg_data_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct hawkbit_cfg_data, board, JSON_TOK_STRING),
 	JSON_OBJ_DESCR_PRIM(struct hawkbit_cfg_data, serial, JSON_TOK_STRING),
@@ -225,71 +665,122 @@ static const struct json_obj_descr json_cfg_descr[] = {
 	JSON_OBJ_DESCR_OBJECT(struct hawkbit_cfg, data, json_cfg_data_descr),
 };
 
-static const struct json_obj_descr json_dep_res_hashes_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_hashes, sha1,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_hashes, md5,
-			    JSON_TOK_STRING),
+static const struct json_obj_descr json_dep_fbk_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_fbk, id, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_fbk, status,
+			      json_status_descr),
 };
 
-static const struct json_obj_descr json_dep_res_links_descr[] = {
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_res_links, download,
-			      json_href_descr),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_res_links, md5sum,
-			      json_href_descr),
-	JSON_OBJ_DESCR_OBJECT_NAMED(struct hawkbit_dep_res_links,
-				    "download-http", download_http,
-				    json_href_descr),
-	JSON_OBJ_DESCR_OBJECT_NAMED(struct hawkbit_dep_res_links,
-				    "md5sum-http", md5sum_http,
-				    json_href_descr),
+/* The same, with the progress the descriptors above leave out. */
+static const struct json_obj_descr json_status_progress_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_status_progress, cnt,
+			    JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_status_progress, of,
+			    JSON_TOK_NUMBER),
 };
 
-static const struct json_obj_descr json_dep_res_arts_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_arts, filename,
+static const struct json_obj_descr json_status_result_progress_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_status_result, finished,
 			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_arts, size,
-			    JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_res_arts, hashes,
-			      json_dep_res_hashes_descr),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_res_arts, _links,
-			      json_dep_res_links_descr),
+	JSON_OBJ_DESCR_OBJECT(struct hawkbit_status_result, progress,
+			      json_status_progress_descr),
 };
 
-static const struct json_obj_descr json_dep_res_chunk_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_chunk, part,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_chunk, name,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_chunk, version,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_OBJ_ARRAY(struct hawkbit_dep_res_chunk, artifacts,
-				 HAWKBIT_DEP_MAX_CHUNK_ARTS, num_artifacts,
-				 json_dep_res_arts_descr,
-				 ARRAY_SIZE(json_dep_res_arts_descr)),
+static const struct json_obj_descr json_status_with_progress_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_status, execution, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_OBJECT(struct hawkbit_status, result,
+			      json_status_result_progress_descr),
 };
 
-static const struct json_obj_descr json_dep_res_deploy_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_deploy, download,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res_deploy, update,
-			    JSON_TOK_STRING),
-	JSON_OBJ_DESCR_OBJ_ARRAY(struct hawkbit_dep_res_deploy, chunks,
-				 HAWKBIT_DEP_MAX_CHUNKS, num_chunks,
-				 json_dep_res_chunk_descr,
-				 ARRAY_SIZE(json_dep_res_chunk_descr)),
+static const struct json_obj_descr json_dep_fbk_progress_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_fbk, id, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_fbk, status,
+			      json_status_with_progress_descr),
 };
 
-static const struct json_obj_descr json_dep_res_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_res, id, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_res, deployment,
-			      json_dep_res_deploy_descr),
+/*
+ * Field tables for decoding the JSON we receive.
+ *
+ * Responses are decoded incrementally by json_stream, which reports
+ * each value along with its path in the document. These tables map
+ * the paths we care about to structure fields; anything else is
+ * ignored. Array elements are handled by hawkbit_dep_res_cb(), which
+ * matches paths within chunks and artifacts against their own tables.
+ */
+
+struct hawkbit_json_field {
+	const char		*path;
+	size_t			 offset;
+	enum json_tokens	 type;
 };
 
-static const struct json_obj_descr json_dep_fbk_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct hawkbit_dep_fbk, id, JSON_TOK_STRING),
-	JSON_OBJ_DESCR_OBJECT(struct hawkbit_dep_fbk, status,
-			      json_status_descr),
+#define HAWKBIT_JSON_FIELD(struct_, path_, field_, type_)	\
+	{							\
+		.path = path_,					\
+		.offset = offsetof(struct_, field_),		\
+		.type = type_,					\
+	}
+
+static const struct hawkbit_json_field json_ctl_res_fields[] = {
+	HAWKBIT_JSON_FIELD(struct hawkbit_ctl_res, "config.polling.sleep",
+			   config.polling.sleep, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_ctl_res,
+			   "_links.deploymentBase.href",
+			   _links.deploymentBase.href, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_ctl_res, "_links.cancelAction.href",
+			   _links.cancelAction.href, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_ctl_res, "_links.configData.href",
+			   _links.configData.href, JSON_TOK_STRING),
+};
+
+static const struct hawkbit_json_field json_dep_res_fields[] = {
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res, "id", id, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res, "deployment.download",
+			   deployment.download, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res, "deployment.update",
+			   deployment.update, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res,
+			   "deployment.maintenanceWindow",
+			   deployment.maintenanceWindow, JSON_TOK_STRING),
+};
+
+#define JSON_DEP_RES_CHUNK_PATH "deployment.chunks[]."
+
+static const struct hawkbit_json_field json_dep_res_chunk_fields[] = {
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_chunk, "part", part,
+			   JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_chunk, "name", name,
+			   JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_chunk, "version", version,
+			   JSON_TOK_STRING),
+};
+
+#define JSON_DEP_RES_ARTS_PATH JSON_DEP_RES_CHUNK_PATH "artifacts[]."
+
+/*
+ * The https "download" and the "md5sum" links are not used, so they
+ * are not decoded, to save space in hbc->json_strings.
+ */
+static const struct hawkbit_json_field json_dep_res_arts_fields[] = {
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts, "filename", filename,
+			   JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts, "size", size,
+			   JSON_TOK_NUMBER),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts, "hashes.sha1",
+			   hashes.sha1, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts, "hashes.md5",
+			   hashes.md5, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts, "hashes.sha256",
+			   hashes.sha256, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_dep_res_arts,
+			   "_links.download-http.href",
+			   _links.download_http.href, JSON_TOK_STRING),
+};
+
+static const struct hawkbit_json_field json_cancel_fields[] = {
+	HAWKBIT_JSON_FIELD(struct hawkbit_cancel, "id", id, JSON_TOK_STRING),
+	HAWKBIT_JSON_FIELD(struct hawkbit_cancel, "cancelAction.stopId",
+			   cancelAction.stopId, JSON_TOK_STRING),
 };
 
 /*
@@ -325,46 +816,76 @@ __unused
 static void hawkbit_dump_deployment(struct hawkbit_dep_res *d,
 				    const char *comment)
 {
-	struct hawkbit_dep_res_chunk *c = &d->deployment.chunks[0];
-	struct hawkbit_dep_res_arts *a = &c->artifacts[0];
-	struct hawkbit_dep_res_links *l = &a->_links;
+	struct hawkbit_dep_res_chunk *c;
+	struct hawkbit_dep_res_arts *a;
+	struct hawkbit_dep_res_links *l;
+	int i, j;
 
-	/* Max # of params for a LOG_* statement is 9.  Breaking up */
 	LOG_DBG("Deployment base results %s:\n\t"
 		"id=%s\n\t"
 		"deployment =\n\t\t"
 		"download=%s\n\t\t"
 		"update=%s\n\t\t"
-		"chunks[0].part=%s\n\t\t"
-		"         .name=%s\n\t\t"
-		"         .version=%s\n\t\t"
-		"         .artifacts[0].filename=%s\n\t\t",
+		"maintenanceWindow=%s\n\t\t",
 		comment,
 		str_or_null(d->id),
 		str_or_null(d->deployment.download),
 		str_or_null(d->deployment.update),
-		str_or_null(c->part),
-		str_or_null(c->name),
-		str_or_null(c->version),
-		str_or_null(a->filename));
-
-	LOG_DBG("                      .size=%d\n\t\t"
-		"                      .hashes = sha1=%s,md5=%s\n\t\t"
-		"                      ._links =\n\t\t\t"
-		"                                 download=%s\n\t\t\t"
-		"                                 md5sum=%s\n\t\t\t"
-		"                                 download_http=%s\n\t\t\t"
-		"                                 md5sum_http=%s\n\t\t\t",
-		a->size,
-		str_or_null(a->hashes.sha1),
-		str_or_null(a->hashes.md5),
-		str_or_null(l->download.href),
-		str_or_null(l->md5sum.href),
-		str_or_null(l->download_http.href),
-		str_or_null(l->md5sum_http.href));
+		str_or_null(d->deployment.maintenanceWindow));
+
+	for (i = 0; i < MIN(d->deployment.num_chunks,
+			    HAWKBIT_DEP_MAX_CHUNKS); i++) {
+		c = &d->deployment.chunks[i];
+		LOG_DBG("chunks[%d].part=%s\n\t\t"
+			"         .name=%s\n\t\t"
+			"         .version=%s\n\t\t",
+			i,
+			str_or_null(c->part),
+			str_or_null(c->name),
+			str_or_null(c->version));
+
+		for (j = 0; j < MIN(c->num_artifacts,
+				    HAWKBIT_DEP_MAX_CHUNK_ARTS); j++) {
+			a = &c->artifacts[j];
+			l = &a->_links;
+			/* Max # of params for a LOG_* statement is 9. */
+			LOG_DBG("         .artifacts[%d].filename=%s\n\t\t"
+				"                      .size=%d\n\t\t"
+				"                      .hashes = sha1=%s,md5=%s,"
+				"sha256=%s\n\t\t",
+				j,
+				str_or_null(a->filename),
+				a->size,
+				str_or_null(a->hashes.sha1),
+				str_or_null(a->hashes.md5),
+				str_or_null(a->hashes.sha256));
+			LOG_DBG("                      ._links =\n\t\t\t"
+				"                                 download=%s\n\t\t\t"
+				"                                 md5sum=%s\n\t\t\t"
+				"                                 download_http=%s\n\t\t\t"
+				"                                 md5sum_http=%s\n\t\t\t",
+				str_or_null(l->download.href),
+				str_or_null(l->md5sum.href),
+				str_or_null(l->download_http.href),
+				str_or_null(l->md5sum_http.href));
+		}
+	}
 }
 
 /* Utils */
+static int char2hex_n(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -EINVAL;
+}
+
 static int atoi_n(const char *s, int len)
 {
         int i, val = 0;
@@ -395,6 +916,105 @@ static int hawkbit_time2sec(const char *s)
 	}
 }
 
+static int hex2bin_n(const char *hex, u8_t *buf, size_t buf_len)
+{
+	size_t i;
+	int hi, lo;
+
+	if (strlen(hex) != 2 * buf_len) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < buf_len; i++) {
+		hi = char2hex_n(hex[2 * i]);
+		lo = char2hex_n(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0) {
+			return -EINVAL;
+		}
+		buf[i] = (hi << 4) | lo;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the "len" bytes at "s" as "address[:port]", with IPv6
+ * addresses in brackets, into "host". The port defaults to 80.
+ */
+static int hawkbit_parse_host(const char *s, size_t len,
+			      struct hawkbit_host *host)
+{
+	const char *end = s + len;
+	const char *addr_end;
+	const char *p;
+	u32_t port = 80;
+
+	if (len && *s == '[') {
+		s++;
+		addr_end = memchr(s, ']', end - s);
+		if (!addr_end) {
+			return -EINVAL;
+		}
+		p = addr_end + 1;
+	} else {
+		addr_end = memchr(s, ':', len);
+		if (!addr_end) {
+			addr_end = end;
+		}
+		p = addr_end;
+	}
+
+	if (p < end) {
+		if (*p++ != ':' || p == end) {
+			return -EINVAL;
+		}
+		for (port = 0; p < end; p++) {
+			if (*p < '0' || *p > '9' || port > 0xffff / 10) {
+				return -EINVAL;
+			}
+			port = port * 10 + *p - '0';
+		}
+		if (!port || port > 0xffff) {
+			return -EINVAL;
+		}
+	}
+
+	if (addr_end == s || (size_t)(addr_end - s) >= sizeof(host->addr)) {
+		return -EINVAL;
+	}
+	memcpy(host->addr, s, addr_end - s);
+	host->addr[addr_end - s] = '\0';
+	host->port = port;
+	return 0;
+}
+
+/*
+ * Split "url" into the host it names, if it's an absolute http URL,
+ * and the path, which is returned. For a bare path, "host->addr" is
+ * left empty. Returns NULL if the URL isn't either.
+ */
+static const char *hawkbit_parse_url(const char *url,
+				     struct hawkbit_host *host)
+{
+	const char *path;
+
+	memset(host, 0, sizeof(*host));
+	if (url[0] == '/') {
+		return url;
+	}
+
+	if (strncmp(url, HAWKBIT_HTTP_SCHEME, strlen(HAWKBIT_HTTP_SCHEME))) {
+		return NULL;
+	}
+	url += strlen(HAWKBIT_HTTP_SCHEME);
+	path = strchr(url, '/');
+	if (!path || hawkbit_parse_host(url, path - url, host)) {
+		return NULL;
+	}
+
+	return path;
+}
+
 static const char *hawkbit_status_finished(enum hawkbit_status_fini f)
 {
 	switch (f) {
@@ -425,6 +1045,8 @@ static const char *hawkbit_status_execution(enum hawkbit_status_exec e)
 		return "rejected";
 	case HAWKBIT_STATUS_EXEC_RESUMED:
 		return "resumed";
+	case HAWKBIT_STATUS_EXEC_DOWNLOADED:
+		return "downloaded";
 	default:
 		LOG_ERR("%d is invalid", (int)e);
 		return NULL;
@@ -433,8 +1055,12 @@ static const char *hawkbit_status_execution(enum hawkbit_status_exec e)
 
 static void hawkbit_device_acid_read(struct hawkbit_device_acid *device_acid)
 {
-	flash_read(flash_dev, FLASH_AREA_APPLICATION_STATE_OFFSET, device_acid,
-		   sizeof(*device_acid));
+	if (state_store_read(&state_store, HAWKBIT_STATE_ACID, device_acid,
+			     sizeof(*device_acid)) != sizeof(*device_acid)) {
+		/* Nothing was ever installed from hawkBit. */
+		device_acid->current = -1;
+		device_acid->update = -1;
+	}
 }
 
 /**
@@ -448,93 +1074,424 @@ static int hawkbit_device_acid_update(hawkbit_dev_acid_t type,
 				      u32_t new_value)
 {
 	struct hawkbit_device_acid device_acid;
-	int ret;
 
-	flash_read(flash_dev, FLASH_AREA_APPLICATION_STATE_OFFSET, &device_acid,
-		   sizeof(device_acid));
+	hawkbit_device_acid_read(&device_acid);
 	if (type == HAWKBIT_ACID_UPDATE) {
 		device_acid.update = new_value;
 	} else {
 		device_acid.current = new_value;
 	}
 
-	flash_write_protection_set(flash_dev, false);
-	ret = flash_erase(flash_dev, FLASH_AREA_APPLICATION_STATE_OFFSET,
-			  FLASH_AREA_APPLICATION_STATE_SIZE);
-	flash_write_protection_set(flash_dev, true);
+	return state_store_write(&state_store, HAWKBIT_STATE_ACID,
+				 &device_acid, sizeof(device_acid));
+}
+
+static int hawkbit_journal_clear(void)
+{
+	int ret;
+
+	ret = state_store_delete(&state_store, HAWKBIT_STATE_JOURNAL_OFFSET);
 	if (ret) {
 		return ret;
 	}
 
-	flash_write_protection_set(flash_dev, false);
-	ret = flash_write(flash_dev, FLASH_AREA_APPLICATION_STATE_OFFSET,
-			  &device_acid, sizeof(device_acid));
-	flash_write_protection_set(flash_dev, true);
-	return ret;
+	return state_store_delete(&state_store, HAWKBIT_STATE_JOURNAL);
 }
 
-/* Log the semantic version number of the current image. */
-static void log_img_ver(void)
+/**
+ * @brief Start a new download journal for an artifact.
+ *
+ * @param action_id hawkBit action ID the artifact belongs to
+ * @param size Artifact size in bytes
+ * @param sha1 Artifact SHA-1 hash, or all zeroes if unknown
+ * @return 0 on success, negative on error.
+ */
+static int hawkbit_journal_start(s32_t action_id, u32_t size,
+				 const u8_t *sha1)
 {
-	struct mcuboot_img_header header;
-	struct mcuboot_img_sem_ver *ver;
+	struct hawkbit_journal_hdr hdr;
 	int ret;
 
-	ret = boot_read_bank_header(FLASH_AREA_IMAGE_0_OFFSET,
-				    &header, sizeof(header));
+	ret = hawkbit_journal_clear();
 	if (ret) {
-		LOG_ERR("can't read header: %d", ret);
-		return;
-	} else if (header.mcuboot_version != 1) {
-		LOG_ERR("unsupported MCUboot version %u",
-			header.mcuboot_version);
-		return;
+		return ret;
 	}
 
-	ver = &header.h.v1.sem_ver;
-	LOG_INF("image version %u.%u.%u build #%u",
-		ver->major, ver->minor, ver->revision, ver->build_num);
+	hdr.action_id = action_id;
+	hdr.size = size;
+	memcpy(hdr.sha1, sha1, sizeof(hdr.sha1));
+	return state_store_write(&state_store, HAWKBIT_STATE_JOURNAL, &hdr,
+				 sizeof(hdr));
 }
 
-static int hawkbit_init_flash(void)
+/**
+ * @brief Find where to resume downloading an artifact.
+ *
+ * @param action_id hawkBit action ID the artifact belongs to
+ * @param size Artifact size in bytes
+ * @param sha1 Artifact SHA-1 hash, or all zeroes if unknown
+ * @return Offset to resume the download from, or 0 if the journal
+ *         doesn't match the artifact (or there is nothing to resume).
+ */
+static u32_t hawkbit_journal_resume(s32_t action_id, u32_t size,
+				    const u8_t *sha1)
 {
-	int ret = 0;
-	struct hawkbit_device_acid init_acid;
-	bool image_ok;
+	struct hawkbit_journal_hdr hdr;
+	u32_t offset;
 
-	/*
-	 * Initialize the DFU context.
-	 */
-	flash_dev = device_get_binding(DT_FLASH_DEV_NAME);
-	if (!flash_dev) {
-		LOG_ERR("missing flash device %s", DT_FLASH_DEV_NAME);
-		return -ENODEV;
+	if (state_store_read(&state_store, HAWKBIT_STATE_JOURNAL, &hdr,
+			     sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.action_id != action_id || hdr.size != size ||
+	    memcmp(hdr.sha1, sha1, sizeof(hdr.sha1))) {
+		return 0;
+	}
+
+	if (state_store_read(&state_store, HAWKBIT_STATE_JOURNAL_OFFSET,
+			     &offset, sizeof(offset)) != sizeof(offset) ||
+	    offset >= size || offset % FLASH_ERASE_BLOCK_SIZE) {
+		return 0;
+	}
+
+	return offset;
+}
+
+/* Record that the artifact is committed to flash up to "offset". */
+static int hawkbit_journal_checkpoint(u32_t offset)
+{
+	return state_store_write(&state_store, HAWKBIT_STATE_JOURNAL_OFFSET,
+				 &offset, sizeof(offset));
+}
+
+/* Forget how far the artifact got, so it's downloaded from the start. */
+static int hawkbit_journal_rewind(void)
+{
+	return state_store_delete(&state_store, HAWKBIT_STATE_JOURNAL_OFFSET);
+}
+
+/*
+ * Staged image.
+ *
+ * A firmware image which was downloaded and verified, but not yet
+ * installed, stays in slot1 until it is. It's recorded like a journal,
+ * so the install doesn't download it again. An image whose SHA-1 is
+ * known is recognized in a later action, too.
+ */
+static bool hawkbit_staged(s32_t action_id,
+			   const struct hawkbit_artifact *art)
+{
+	static const u8_t unknown[HAWKBIT_SHA1_SIZE];
+	struct hawkbit_journal_hdr hdr;
+
+	if (state_store_read(&state_store, HAWKBIT_STATE_STAGED, &hdr,
+			     sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.size != art->size ||
+	    memcmp(hdr.sha1, art->hashes.sha1, sizeof(hdr.sha1))) {
+		return false;
+	}
+
+	return hdr.action_id == action_id ||
+		memcmp(hdr.sha1, unknown, sizeof(hdr.sha1));
+}
+
+static int hawkbit_stage(s32_t action_id, const struct hawkbit_artifact *art)
+{
+	struct hawkbit_journal_hdr hdr;
+
+	hdr.action_id = action_id;
+	hdr.size = art->size;
+	memcpy(hdr.sha1, art->hashes.sha1, sizeof(hdr.sha1));
+	return state_store_write(&state_store, HAWKBIT_STATE_STAGED, &hdr,
+				 sizeof(hdr));
+}
+
+/* Forget the staged image, before slot1 is overwritten. */
+static void hawkbit_unstage(void)
+{
+	struct hawkbit_journal_hdr hdr;
+
+	if (state_store_read(&state_store, HAWKBIT_STATE_STAGED, &hdr,
+			     sizeof(hdr)) > 0) {
+		state_store_delete(&state_store, HAWKBIT_STATE_STAGED);
+	}
+}
+
+/*
+ * Feedback outbox.
+ *
+ * Feedback which closes an action, and the configData the server
+ * asks for, are queued here and sent by hawkbit_outbox_flush(), which
+ * keeps whatever couldn't be delivered for the start of the next
+ * poll. Newer feedback for an action replaces what is still queued
+ * for it. With CONFIG_FOTA_OUTBOX_FLASH, the outbox is saved in the
+ * state store, so it survives reboots.
+ */
+#define HAWKBIT_OUTBOX_RECORDS	4
+
+enum hawkbit_outbox_resource {
+	HAWKBIT_OUTBOX_DEPLOYMENT = 0,
+	HAWKBIT_OUTBOX_CANCEL,
+};
+
+static const char * const hawkbit_outbox_resources[] = {
+	[HAWKBIT_OUTBOX_DEPLOYMENT] = "deploymentBase",
+	[HAWKBIT_OUTBOX_CANCEL] = "cancelAction",
+};
+
+struct hawkbit_outbox_rec {
+	s32_t action_id;	/* -1 if the record is free */
+	u8_t resource;		/* enum hawkbit_outbox_resource */
+	u8_t finished;		/* enum hawkbit_status_fini */
+	u8_t execution;		/* enum hawkbit_status_exec */
+	u8_t reserved;
+} __packed;
+
+struct hawkbit_outbox {
+	/*
+	 * Nonzero if configData is pending. This isn't saved on its
+	 * own, since the server asks again after a reboot.
+	 */
+	u32_t config_data;
+	struct hawkbit_outbox_rec recs[HAWKBIT_OUTBOX_RECORDS];
+} __packed;
+
+BUILD_ASSERT_MSG(sizeof(struct hawkbit_outbox) <= STATE_STORE_VALUE_MAX,
+		 "feedback outbox too big for the state store");
+
+static struct hawkbit_outbox outbox;
+
+static void hawkbit_outbox_init(void)
+{
+	int i;
+
+	memset(&outbox, 0, sizeof(outbox));
+	for (i = 0; i < HAWKBIT_OUTBOX_RECORDS; i++) {
+		outbox.recs[i].action_id = -1;
+	}
+}
+
+static void hawkbit_outbox_save(void)
+{
+#if defined(CONFIG_FOTA_OUTBOX_FLASH)
+	int ret;
+
+	ret = state_store_write(&state_store, HAWKBIT_STATE_OUTBOX, &outbox,
+				sizeof(outbox));
+	if (ret) {
+		/* It's still in RAM, at least. */
+		LOG_ERR("Can't save feedback outbox: %d", ret);
+	}
+#endif
+}
+
+/* Restore the outbox from flash, if it is kept there. */
+static void hawkbit_outbox_load(void)
+{
+	hawkbit_outbox_init();
+#if defined(CONFIG_FOTA_OUTBOX_FLASH)
+	state_store_read(&state_store, HAWKBIT_STATE_OUTBOX, &outbox,
+			 sizeof(outbox));
+#endif
+}
+
+/* Queue feedback for an action, replacing any still queued for it. */
+static void hawkbit_outbox_put(enum hawkbit_outbox_resource resource,
+			       s32_t action_id,
+			       enum hawkbit_status_fini finished,
+			       enum hawkbit_status_exec execution)
+{
+	struct hawkbit_outbox_rec *rec = NULL;
+	int i;
+
+	for (i = 0; i < HAWKBIT_OUTBOX_RECORDS; i++) {
+		if (outbox.recs[i].action_id == action_id &&
+		    outbox.recs[i].resource == resource) {
+			rec = &outbox.recs[i];
+			break;
+		} else if (!rec && outbox.recs[i].action_id < 0) {
+			rec = &outbox.recs[i];
+		}
+	}
+
+	if (!rec) {
+		/* Make room by dropping the oldest record. */
+		LOG_WRN("Feedback outbox full, dropping action %d feedback",
+			outbox.recs[0].action_id);
+		memmove(&outbox.recs[0], &outbox.recs[1],
+			(HAWKBIT_OUTBOX_RECORDS - 1) * sizeof(*rec));
+		rec = &outbox.recs[HAWKBIT_OUTBOX_RECORDS - 1];
+	}
+
+	rec->action_id = action_id;
+	rec->resource = resource;
+	rec->finished = finished;
+	rec->execution = execution;
+	hawkbit_outbox_save();
+}
+
+/* Log the semantic version number of the current image. */
+static void log_img_ver(void)
+{
+	struct mcuboot_img_header header;
+	struct mcuboot_img_sem_ver *ver;
+	int ret;
+
+	ret = boot_read_bank_header(RUN_SLOT_OFFSET,
+				    &header, sizeof(header));
+	if (ret) {
+		LOG_ERR("can't read header: %d", ret);
+		return;
+	} else if (header.mcuboot_version != 1) {
+		LOG_ERR("unsupported MCUboot version %u",
+			header.mcuboot_version);
+		return;
+	}
+
+	ver = &header.h.v1.sem_ver;
+	LOG_INF("image version %u.%u.%u build #%u",
+		ver->major, ver->minor, ver->revision, ver->build_num);
+}
+
+/*
+ * Confirm the running image, so MCUboot keeps it. Returns 1 if this
+ * is the first boot of a new image, 0 if it isn't, or a negative
+ * errno.
+ */
+static int hawkbit_boot_confirm(void)
+{
+#if defined(CONFIG_FOTA_UPGRADE_DIRECT_XIP)
+	u32_t slot;
+	int ret;
+
+	/*
+	 * MCUboot runs the newest valid image, and there's no trailer
+	 * to confirm it in. Whether it's the one an update was written
+	 * to tells if the update took.
+	 */
+	if (state_store_read(&state_store, HAWKBIT_STATE_UPDATE_SLOT, &slot,
+			     sizeof(slot)) != sizeof(slot)) {
+		return 0;
+	}
+	ret = state_store_delete(&state_store, HAWKBIT_STATE_UPDATE_SLOT);
+	if (ret) {
+		LOG_ERR("Can't clear the update slot: %d", ret);
+		return ret;
+	}
+	if (slot != RUN_SLOT_OFFSET) {
+		LOG_ERR("MCUboot didn't boot the new image");
+		return 0;
+	}
+
+	LOG_INF("Running the new image in place");
+	return 1;
+#else
+	bool image_ok;
+	int ret;
+
+	/*
+	 * In overwrite-only mode, MCUboot erases slot0 before copying
+	 * an image into it, so this only marks the first boot.
+	 */
+	image_ok = boot_is_img_confirmed();
+	LOG_INF("Image is%s confirmed OK", image_ok ? "" : " not");
+	if (image_ok) {
+		return 0;
+	}
+
+	ret = boot_write_img_confirmed();
+	if (ret) {
+		LOG_ERR("Couldn't confirm this image: %d", ret);
+		return ret;
+	}
+
+	LOG_INF("Marked image as OK");
+	return 1;
+#endif
+}
+
+/* Have MCUboot boot the new image in slot1 after the next reboot. */
+static int hawkbit_request_upgrade(void)
+{
+#if defined(CONFIG_FOTA_UPGRADE_DIRECT_XIP)
+	u32_t slot = DL_SLOT_OFFSET;
+
+	/* MCUboot picks the newer image by itself; nothing is copied. */
+	LOG_INF("MCUboot will run the new image in place");
+	return state_store_write(&state_store, HAWKBIT_STATE_UPDATE_SLOT,
+				 &slot, sizeof(slot));
+#elif defined(CONFIG_FOTA_UPGRADE_OVERWRITE)
+	/* There's no going back once slot0 is overwritten. */
+	LOG_INF("MCUboot will copy the new image over slot0");
+	return boot_request_upgrade(true);
+#else
+	LOG_INF("MCUboot will swap the new image with slot0");
+	return boot_request_upgrade(false);
+#endif
+}
+
+static int hawkbit_init_flash(void)
+{
+	int ret = 0;
+	struct hawkbit_device_acid init_acid;
+	struct hawkbit_device_acid old_acid;
+	struct state_store_record migrate = {
+		.id = HAWKBIT_STATE_ACID,
+		.data = &old_acid,
+		.len = sizeof(old_acid),
+	};
+	size_t num_migrate;
+
+	/*
+	 * Initialize the DFU context.
+	 */
+	flash_dev = device_get_binding(DT_FLASH_DEV_NAME);
+	if (!flash_dev) {
+		LOG_ERR("missing flash device %s", DT_FLASH_DEV_NAME);
+		return -ENODEV;
 	}
 
 	log_img_ver();
 
+	/*
+	 * Older versions kept the ACID by itself at the start of the
+	 * partition; carry it over if the store has to be created. It
+	 * only becomes valid with the ACID in it, and leaves the old
+	 * one alone until then, so a reset can't lose it.
+	 */
+	flash_read(flash_dev, FLASH_AREA_APPLICATION_STATE_OFFSET, &old_acid,
+		   sizeof(old_acid));
+	num_migrate = old_acid.current != 0xffffffff ||
+		old_acid.update != 0xffffffff;
+	ret = state_store_init(&state_store, flash_dev,
+			       FLASH_AREA_APPLICATION_STATE_OFFSET,
+			       FLASH_ERASE_BLOCK_SIZE, FLASH_WRITE_BLOCK_SIZE,
+			       &migrate, num_migrate);
+	if (ret < 0) {
+		LOG_ERR("Can't open state store: %d", ret);
+		return ret;
+	} else if (ret > 0 && num_migrate) {
+		LOG_INF("Migrated ACID to the state store");
+	}
+	ret = 0;
+
+	state_store_read(&state_store, HAWKBIT_STATE_POLL_SLEEP, &poll_sleep,
+			 sizeof(poll_sleep));
+	hawkbit_outbox_load();
+
 	/* Update boot status and acid */
 	hawkbit_device_acid_read(&init_acid);
 	LOG_INF("ACID: current %d, update %d",
 		    init_acid.current, init_acid.update);
-	image_ok = boot_is_img_confirmed();
-	LOG_INF("Image is%s confirmed OK", image_ok ? "" : " not");
-	if (!image_ok) {
-		ret = boot_write_img_confirmed();
-		if (ret) {
-			LOG_ERR("Couldn't confirm this image: %d", ret);
-			return ret;
-		}
-		LOG_INF("Marked image as OK");
-		ret = boot_erase_img_bank(FLASH_AREA_IMAGE_1_OFFSET);
-		if (ret) {
-			LOG_ERR("Flash bank erase at offset %x: error %d",
-				FLASH_AREA_IMAGE_1_OFFSET, ret);
-			return ret;
-		} else {
-			LOG_DBG("Erased flash bank at offset %x",
-				FLASH_AREA_IMAGE_1_OFFSET);
-		}
+	ret = hawkbit_boot_confirm();
+	if (ret < 0) {
+		return ret;
+	} else if (ret) {
+		/*
+		 * The old image in slot1 is erased from the work queue
+		 * once hawkbit_start() returns, instead of here.
+		 */
+		cleanup_offset = DL_SLOT_OFFSET;
+		hawkbit_unstage();
+		ret = 0;
 		if (init_acid.update != -1) {
 			ret = hawkbit_device_acid_update(HAWKBIT_ACID_CURRENT,
 						  init_acid.update);
@@ -550,174 +1507,1989 @@ static int hawkbit_init_flash(void)
 	return ret;
 }
 
-/* http_client doesn't callback until the HTTP body has started */
-static void install_update_cb(struct http_ctx *ctx,
-			      u8_t *data, size_t data_size,
-			      size_t data_len,
-			      enum http_final_call final_data,
-			      void *user_data)
+/*
+ * Artifact verification.
+ *
+ * The artifact is hashed as it is written to slot1, using SHA-256 if
+ * the server provided it and SHA-1 otherwise, so a corrupted download
+ * is caught before requesting an upgrade rather than by MCUboot after
+ * a reboot.
+ */
+
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+static bool hawkbit_hash_known(const u8_t *hash, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (hash[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+#endif
+
+static void hawkbit_hash_start(struct hawkbit_hash *hash,
+			       const struct hawkbit_artifact_hashes *hashes)
+{
+	memset(hash, 0, sizeof(*hash));
+
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+	if (hawkbit_hash_known(hashes->sha256, sizeof(hashes->sha256))) {
+		hash->type = HAWKBIT_HASH_SHA256;
+		mbedtls_sha256_init(&hash->sha256);
+		mbedtls_sha256_starts_ret(&hash->sha256, 0);
+#if defined(MBEDTLS_SHA1_C)
+	} else if (hawkbit_hash_known(hashes->sha1, sizeof(hashes->sha1))) {
+		hash->type = HAWKBIT_HASH_SHA1;
+		mbedtls_sha1_init(&hash->sha1);
+		mbedtls_sha1_starts_ret(&hash->sha1);
+#endif
+	}
+#endif
+}
+
+static void hawkbit_hash_update(struct hawkbit_hash *hash,
+				const u8_t *data, size_t len)
+{
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+	u32_t start = k_cycle_get_32();
+
+	switch (hash->type) {
+#if defined(MBEDTLS_SHA1_C)
+	case HAWKBIT_HASH_SHA1:
+		mbedtls_sha1_update_ret(&hash->sha1, data, len);
+		break;
+#endif
+	case HAWKBIT_HASH_SHA256:
+		mbedtls_sha256_update_ret(&hash->sha256, data, len);
+		break;
+	default:
+		return;
+	}
+
+	hash->cycles += k_cycle_get_32() - start;
+	hash->len += len;
+#endif
+}
+
+/*
+ * The MCUboot image going into slot1 is checked as it is written, so
+ * that one which MCUboot would reject fails the download as soon as
+ * the problem shows, instead of after a reboot.
+ */
+static void hawkbit_img_check_start(struct hawkbit_context *hbc,
+				    const struct hawkbit_artifact *art)
+{
+#if defined(CONFIG_FOTA_CHECK_IMAGE)
+	/* Compressed images and delta patches have an unknown size. */
+	mcuboot_img_check_init(&hbc->img_check, FLASH_BANK_SIZE,
+			       art->flags ? 0 : art->size,
+			       CONFIG_FLASH_BASE_ADDRESS + EXEC_SLOT_OFFSET,
+			       EXEC_SLOT_SIZE);
+#endif
+}
+
+/*
+ * Check the next "len" bytes of the image at "data"; "final" if
+ * they're the last. Returns -EBADMSG if the image is bad.
+ */
+static int hawkbit_img_check(struct hawkbit_context *hbc,
+			     const u8_t *data, size_t len, bool final)
+{
+#if defined(CONFIG_FOTA_CHECK_IMAGE)
+	int ret;
+
+	ret = mcuboot_img_check_feed(&hbc->img_check, data, len);
+	if (!ret && final) {
+		ret = mcuboot_img_check_finish(&hbc->img_check);
+	}
+
+	if (ret == -EBADMSG) {
+		LOG_ERR("Image doesn't match its SHA-256 TLV");
+	} else if (ret) {
+		LOG_ERR("Bad MCUboot image (error %d)", ret);
+	}
+
+	return ret ? -EBADMSG : 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Hash and check the first "len" bytes of slot1, which were written
+ * by an earlier download attempt.
+ */
+static void hawkbit_hash_slot1(struct hawkbit_context *hbc, size_t len)
+{
+	size_t off, chunk;
+
+	if (hbc->hash.type == HAWKBIT_HASH_NONE &&
+	    !IS_ENABLED(CONFIG_FOTA_CHECK_IMAGE)) {
+		return;
+	}
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = MIN(len - off, hbc->tcp_buffer_size);
+		flash_read(flash_dev, DL_SLOT_OFFSET + off, hbc->tcp_buffer,
+			   chunk);
+		hawkbit_hash_update(&hbc->hash, hbc->tcp_buffer, chunk);
+		/* Any error shows up with the next write. */
+		hawkbit_img_check(hbc, hbc->tcp_buffer, chunk, false);
+	}
+}
+
+/*
+ * Check the downloaded artifact's hash against the server's.
+ *
+ * Returns 0 if it matches or if there is nothing to check against,
+ * and -EBADMSG on mismatch.
+ */
+static int hawkbit_hash_verify(struct hawkbit_hash *hash,
+			       const struct hawkbit_artifact_hashes *hashes)
+{
+#if defined(CONFIG_FOTA_VERIFY_ARTIFACT)
+	u8_t digest[HAWKBIT_SHA256_SIZE];
+	const u8_t *expected;
+	size_t len;
+
+	switch (hash->type) {
+#if defined(MBEDTLS_SHA1_C)
+	case HAWKBIT_HASH_SHA1:
+		mbedtls_sha1_finish_ret(&hash->sha1, digest);
+		mbedtls_sha1_free(&hash->sha1);
+		expected = hashes->sha1;
+		len = HAWKBIT_SHA1_SIZE;
+		break;
+#endif
+	case HAWKBIT_HASH_SHA256:
+		mbedtls_sha256_finish_ret(&hash->sha256, digest);
+		mbedtls_sha256_free(&hash->sha256);
+		expected = hashes->sha256;
+		len = HAWKBIT_SHA256_SIZE;
+		break;
+	default:
+		LOG_WRN("No artifact hash to verify against");
+		return 0;
+	}
+
+	if (memcmp(digest, expected, len)) {
+		LOG_ERR("Artifact %s mismatch",
+			hash->type == HAWKBIT_HASH_SHA1 ? "SHA-1" : "SHA-256");
+		LOG_HEXDUMP_ERR(digest, len, "downloaded:");
+		LOG_HEXDUMP_ERR(expected, len, "expected:");
+		return -EBADMSG;
+	}
+
+	LOG_INF("Artifact %s verified",
+		hash->type == HAWKBIT_HASH_SHA1 ? "SHA-1" : "SHA-256");
+#endif
+	return 0;
+}
+
+/*
+ * Log how fast the artifact was hashed compared to how fast it was
+ * downloaded, as a check that inline verification isn't slowing
+ * downloads down on this CPU.
+ */
+static void hawkbit_hash_benchmark(struct hawkbit_hash *hash,
+				   size_t downloaded, u32_t download_ms)
+{
+	u32_t hash_us;
+
+	if (hash->type == HAWKBIT_HASH_NONE) {
+		return;
+	}
+
+	hash_us = SYS_CLOCK_HW_CYCLES_TO_NS64(hash->cycles) / NSEC_PER_USEC;
+	LOG_INF("Hashed %zu bytes in %u us (%u KiB/s); "
+		"downloaded %zu bytes in %u ms (%u KiB/s)",
+		hash->len, hash_us,
+		hash_us ? (u32_t)((u64_t)hash->len * 1000000 / 1024 /
+				  hash_us) : 0,
+		downloaded, download_ms,
+		download_ms ? (u32_t)((u64_t)downloaded * 1000 / 1024 /
+				      download_ms) : 0);
+}
+
+/*
+ * Erase scheduler.
+ *
+ * Sectors are erased ahead of the write pointer by the flash writer
+ * thread whenever it is idle, starting as soon as a deployment is
+ * found. For slot1 with CONFIG_FOTA_ERASE_PROGRESSIVELY, only
+ * CONFIG_FOTA_ERASE_AHEAD_SECTORS are kept in reserve (unless the
+ * flash can erase slot1 while running from slot0); otherwise, all the
+ * artifact needs is erased in the background. Writes that catch up
+ * with the scheduler erase what they need themselves.
+ */
+
+/* Bytes of the current artifact's image which have been written. */
+static size_t hawkbit_flash_written(struct hawkbit_context *hbc)
+{
+	return hbc->data_written;
+}
+
+static K_MUTEX_DEFINE(erase_lock);
+/* Wakes the flash writer thread up when it has something to do. */
+static K_SEM_DEFINE(writer_kick, 0, 1);
+
+/* Erase the sector at *offset, and move past it. Hold erase_lock. */
+static int hawkbit_erase_sector(off_t *offset)
+{
+	int ret;
+
+	LOG_DBG("Erasing sector at offset 0x%lx", (long)*offset);
+	flash_write_protection_set(flash_dev, false);
+	ret = flash_erase(flash_dev, *offset, FLASH_ERASE_BLOCK_SIZE);
+	flash_write_protection_set(flash_dev, true);
+
+	if (ret) {
+		LOG_ERR("Error %d while erasing sector", ret);
+		return ret;
+	}
+
+	*offset += FLASH_ERASE_BLOCK_SIZE;
+	return 0;
+}
+
+/*
+ * Erase one sector of the old image in slot1, and come back for the
+ * next one after whatever else is queued, so that this doesn't hold
+ * anything up.
+ */
+static void hawkbit_cleanup_fn(struct k_work *work)
+{
+	bool done;
+
+	k_mutex_lock(&erase_lock, K_FOREVER);
+	if (cleanup_offset < SLOT1_END &&
+	    hawkbit_erase_sector(&cleanup_offset)) {
+		/* A download erases what it needs anyway. */
+		cleanup_offset = SLOT1_END;
+	}
+	done = cleanup_offset >= SLOT1_END;
+	k_mutex_unlock(&erase_lock);
+
+	if (!done) {
+		k_work_submit_to_queue(hb_context.work_q, work);
+	} else {
+		LOG_DBG("Old image erased from slot1");
+	}
+}
+
+/* How far ahead of the write pointer to erase. */
+static off_t hawkbit_erase_limit(struct hawkbit_context *hbc)
+{
+#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY) && \
+	!defined(CONFIG_FOTA_ERASE_READ_WHILE_WRITE)
+	off_t ahead = hbc->art->offset +
+		ROUND_UP(hawkbit_flash_written(hbc), FLASH_ERASE_BLOCK_SIZE) +
+		CONFIG_FOTA_ERASE_AHEAD_SECTORS * FLASH_ERASE_BLOCK_SIZE;
+
+	if (!(hbc->art->flags & HAWKBIT_ARTIFACT_DATA)) {
+		return MIN(ahead, hbc->erase_end);
+	}
+#endif
+
+	return hbc->erase_end;
+}
+
+/*
+ * Start erasing flash for an artifact which will be written from
+ * "offset" onwards. Sectors already erased for the same artifact and
+ * offset are kept, as long as nothing was written to them.
+ */
+static void hawkbit_erase_start(struct hawkbit_context *hbc,
+				const struct hawkbit_artifact *art,
+				size_t offset)
+{
+	off_t base = art->offset + offset;
+
+	k_mutex_lock(&erase_lock, K_FOREVER);
+	if (!hbc->erase_active || !hbc->erase_clean ||
+	    hbc->art != art || hbc->erase_base != base) {
+		hbc->erase_base = base;
+		hbc->erase_offset = base;
+	}
+	hbc->art = art;
+	hbc->data_written = offset;
+	/* Slot1 is erased to the end, to clear the image trailer. */
+	if (art->flags & HAWKBIT_ARTIFACT_DATA) {
+		hbc->erase_end = art->offset +
+			ROUND_UP(art->size, FLASH_ERASE_BLOCK_SIZE);
+	} else {
+		hbc->erase_end = SLOT1_END;
+		/* The old image gets erased along the way. */
+		cleanup_offset = SLOT1_END;
+	}
+	hbc->erase_active = true;
+	hbc->erase_clean = true;
+	k_mutex_unlock(&erase_lock);
+
+	k_sem_give(&writer_kick);
+}
+
+static void hawkbit_erase_stop(struct hawkbit_context *hbc)
+{
+	k_mutex_lock(&erase_lock, K_FOREVER);
+	hbc->erase_active = false;
+	k_mutex_unlock(&erase_lock);
+}
+
+/* Make sure flash is erased up to "end", waiting for it if need be. */
+static int hawkbit_erase_to(struct hawkbit_context *hbc, off_t end)
+{
+	int ret = 0;
+
+	k_mutex_lock(&erase_lock, K_FOREVER);
+	hbc->erase_clean = false;
+	while (!ret && hbc->erase_offset < MIN(end, hbc->erase_end)) {
+		ret = hawkbit_erase_sector(&hbc->erase_offset);
+	}
+	k_mutex_unlock(&erase_lock);
+
+	return ret;
+}
+
+/*
+ * Erase one sector ahead of the write pointer, if the scheduler wants
+ * to. Returns true if a sector was erased.
+ */
+static bool hawkbit_erase_ahead(struct hawkbit_context *hbc)
+{
+	bool erased = false;
+
+	k_mutex_lock(&erase_lock, K_FOREVER);
+	if (hbc->erase_active &&
+	    hbc->erase_offset < hawkbit_erase_limit(hbc)) {
+		if (hawkbit_erase_sector(&hbc->erase_offset)) {
+			/* Leave it to the writes to retry. */
+			hbc->erase_active = false;
+		} else {
+			erased = true;
+		}
+	}
+	k_mutex_unlock(&erase_lock);
+
+	return erased;
+}
+
+/*
+ * Write the next piece of the current artifact to flash. Flash is
+ * written in whole write blocks: a partial block at the end is held
+ * back until the next piece completes it, or "flush" pads it with
+ * erased bytes.
+ */
+static int hawkbit_flash_write(struct hawkbit_context *hbc,
+			       const u8_t *data, size_t len, bool flush)
+{
+	size_t held = hbc->data_written % FLASH_WRITE_BLOCK_SIZE;
+	off_t off = hbc->art->offset + hbc->data_written - held;
+	size_t chunk, aligned;
+	int ret;
+
+	ret = hawkbit_erase_to(hbc, off + ROUND_UP(held + len,
+						   FLASH_WRITE_BLOCK_SIZE));
+	if (ret) {
+		return ret;
+	}
+	hbc->data_written += len;
+
+	flash_write_protection_set(flash_dev, false);
+	if (held && len) {
+		chunk = MIN(len, FLASH_WRITE_BLOCK_SIZE - held);
+		memcpy(hbc->write_tail + held, data, chunk);
+		data += chunk;
+		len -= chunk;
+		held += chunk;
+		if (held == FLASH_WRITE_BLOCK_SIZE) {
+			ret = flash_write(flash_dev, off, hbc->write_tail,
+					  FLASH_WRITE_BLOCK_SIZE);
+			off += FLASH_WRITE_BLOCK_SIZE;
+			held = 0;
+		}
+	}
+	aligned = ROUND_DOWN(len, FLASH_WRITE_BLOCK_SIZE);
+	if (!ret && aligned) {
+		ret = flash_write(flash_dev, off, data, aligned);
+		off += aligned;
+	}
+	if (!ret && aligned < len) {
+		held = len - aligned;
+		memcpy(hbc->write_tail, data + aligned, held);
+	}
+	if (!ret && flush && held) {
+		memset(hbc->write_tail + held, 0xff,
+		       FLASH_WRITE_BLOCK_SIZE - held);
+		ret = flash_write(flash_dev, off, hbc->write_tail,
+				  FLASH_WRITE_BLOCK_SIZE);
+	}
+	flash_write_protection_set(flash_dev, true);
+
+	if (ret) {
+		LOG_ERR("Flash write error: %d", ret);
+	}
+
+	return ret;
+}
+
+/* Write the next piece of the new image to slot1. */
+static int hawkbit_slot1_write(struct hawkbit_context *hbc,
+			       const u8_t *data, size_t len, bool flush)
+{
+	int ret;
+
+	ret = hawkbit_img_check(hbc, data, len, flush);
+	if (ret) {
+		return ret;
+	}
+
+	return hawkbit_flash_write(hbc, data, len, flush);
+}
+
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+/*
+ * Delta updates: the artifact is a patch which rebuilds the new image
+ * in slot1 from the running image in slot0.
+ */
+
+static int hawkbit_delta_read(size_t off, u8_t *buf, size_t len,
+			      void *user_data)
+{
+	return flash_read(flash_dev, RUN_SLOT_OFFSET + off, buf, len);
+}
+
+static int hawkbit_delta_write(const u8_t *buf, size_t len, void *user_data)
+{
+	return hawkbit_slot1_write(user_data, buf, len, false);
+}
+
+static int hawkbit_delta_apply(struct hawkbit_context *hbc,
+			       const u8_t *data, size_t len, bool final)
+{
+	int ret;
+
+	ret = delta_patch_feed(&hbc->delta, data, len);
+	if (!ret && final) {
+		ret = delta_patch_finish(&hbc->delta);
+		if (!ret) {
+			ret = hawkbit_slot1_write(hbc, NULL, 0, true);
+		}
+	}
+
+	if (ret == -ESRCH) {
+		LOG_ERR("Delta patch is for a different image than slot0");
+	} else if (ret) {
+		LOG_ERR("Error %d applying delta patch", ret);
+	}
+
+	return ret;
+}
+#endif
+
+/* Write the next piece of the (decompressed) artifact. */
+static int hawkbit_image_write(struct hawkbit_context *hbc,
+			       const u8_t *data, size_t len, bool final)
+{
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+	if (hbc->dl.flags & HAWKBIT_ARTIFACT_DELTA) {
+		return hawkbit_delta_apply(hbc, data, len, final);
+	}
+#endif
+
+	return hawkbit_slot1_write(hbc, data, len, final);
+}
+
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+/*
+ * Compressed artifacts are decompressed on the fly, before being
+ * passed along to hawkbit_image_write().
+ */
+
+static int hawkbit_lzss_write(const u8_t *buf, size_t len, void *user_data)
+{
+	return hawkbit_image_write(user_data, buf, len, false);
+}
+
+static int hawkbit_lzss_apply(struct hawkbit_context *hbc,
+			      const u8_t *data, size_t len, bool final)
+{
+	int ret;
+
+	ret = lzss_stream_feed(&hbc->lzss, data, len);
+	if (!ret && final) {
+		ret = lzss_stream_finish(&hbc->lzss);
+		if (!ret) {
+			ret = hawkbit_image_write(hbc, NULL, 0, true);
+		}
+	}
+
+	if (ret) {
+		LOG_ERR("Error %d decompressing artifact", ret);
+	}
+
+	return ret;
+}
+#endif
+
+/* Write the next piece of the artifact, as downloaded. */
+static int hawkbit_artifact_write(struct hawkbit_context *hbc,
+				  const u8_t *data, size_t len, bool final)
+{
+	if (hbc->dl.flags & HAWKBIT_ARTIFACT_DATA) {
+		return hawkbit_flash_write(hbc, data, len, final);
+	}
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+	if (hbc->dl.flags & HAWKBIT_ARTIFACT_COMPRESSED) {
+		return hawkbit_lzss_apply(hbc, data, len, final);
+	}
+#endif
+
+	return hawkbit_image_write(hbc, data, len, final);
+}
+
+/*
+ * Size of the image written to flash, once the artifact is
+ * downloaded. This is only known from the artifact itself if it is
+ * compressed or a delta patch.
+ */
+static size_t hawkbit_image_size(struct hawkbit_context *hbc,
+				 size_t file_size)
+{
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+	if (hbc->dl.flags & HAWKBIT_ARTIFACT_DELTA) {
+		return delta_patch_dst_size(&hbc->delta);
+	}
+#endif
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+	if (hbc->dl.flags & HAWKBIT_ARTIFACT_COMPRESSED) {
+		return lzss_stream_size(&hbc->lzss);
+	}
+#endif
+
+	return file_size;
+}
+
+/*
+ * Tell the download step that the transfer or the writer moved on:
+ * it runs from the work queue, as soon as it's free.
+ */
+static void hawkbit_download_event(struct hawkbit_context *hbc)
+{
+	k_sem_give(hbc->sem);
+	if (hbc->step == HAWKBIT_STEP_DOWNLOAD) {
+		k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work,
+					       K_NO_WAIT);
+	}
+}
+
+/*
+ * Flash writer thread.
+ *
+ * Erasing and programming flash can take tens of milliseconds, which
+ * would stall TCP if it happened in the receive callback. Instead,
+ * install_update_cb() only copies the artifact into one of a few
+ * buffers, and this thread drains them to slot1. The receive callback
+ * blocks only when every buffer is full.
+ */
+
+#define HAWKBIT_WRITER_STACK_SIZE	1536
+#define HAWKBIT_WRITER_PRIORITY		K_LOWEST_APPLICATION_THREAD_PRIO
+
+BUILD_ASSERT_MSG(CONFIG_FOTA_FLASH_WRITER_BUFFER_SIZE %
+		 FLASH_WRITE_BLOCK_SIZE == 0,
+		 "flash writer buffers must be write block aligned");
+
+static struct hawkbit_wbuf wbufs[CONFIG_FOTA_FLASH_WRITER_BUFFERS];
+static K_FIFO_DEFINE(wbufs_free);
+static K_FIFO_DEFINE(wbufs_full);
+
+/* Handle a buffer of the artifact in the writer thread. */
+static int hawkbit_writer_process(struct hawkbit_context *hbc,
+				  struct hawkbit_wbuf *buf)
+{
+	size_t checkpoint;
+	int ret;
+
+	ret = hawkbit_artifact_write(hbc, buf->data, buf->len, buf->final);
+	if (ret < 0) {
+		return ret;
+	}
+	hawkbit_hash_update(&hbc->hash, buf->data, buf->len);
+	hbc->dl.written_size += buf->len;
+
+	/*
+	 * Transformed artifacts aren't journaled: the artifact offset
+	 * can't be recovered from the amount of slot1 which was written.
+	 */
+	checkpoint = ROUND_DOWN(hbc->data_written, FLASH_ERASE_BLOCK_SIZE);
+	if (!hbc->dl.flags && checkpoint > hbc->dl.journal_offset &&
+	    !hawkbit_journal_checkpoint(checkpoint)) {
+		hbc->dl.journal_offset = checkpoint;
+	}
+
+	return 0;
+}
+
+static void hawkbit_writer_fn(void *p1, void *p2, void *p3)
+{
+	struct hawkbit_context *hbc = p1;
+	struct hawkbit_wbuf *buf;
+	int ret;
+
+	while (1) {
+		/* When there's nothing to write, erase ahead. */
+		buf = k_fifo_get(&wbufs_full, K_NO_WAIT);
+		if (!buf) {
+			if (!hawkbit_erase_ahead(hbc)) {
+				k_sem_take(&writer_kick, K_FOREVER);
+			}
+			continue;
+		}
+
+		/* After an error, just give the buffers back. */
+		if (hbc->dl.download_status == 0) {
+			ret = hawkbit_writer_process(hbc, buf);
+			if (ret) {
+				hbc->dl.download_status = ret;
+				hawkbit_download_event(hbc);
+			} else if (buf->final) {
+				hbc->dl.download_status = 1;
+				hawkbit_download_event(hbc);
+			}
+		}
+
+		k_fifo_put(&wbufs_free, buf);
+		if (hbc->dl.writer_wait) {
+			/* hawkbit_lanes_step() has more for it. */
+			hbc->dl.writer_wait = false;
+			hawkbit_download_event(hbc);
+		}
+	}
+}
+
+K_THREAD_DEFINE(hawkbit_writer, HAWKBIT_WRITER_STACK_SIZE,
+		hawkbit_writer_fn, &hb_context, NULL, NULL,
+		HAWKBIT_WRITER_PRIORITY, 0, K_NO_WAIT);
+
+/* Prepare the writer for a new download. It must be idle. */
+static void hawkbit_writer_start(struct hawkbit_context *hbc)
+{
+	int i;
+
+	k_fifo_init(&wbufs_free);
+	k_fifo_init(&wbufs_full);
+	for (i = 0; i < ARRAY_SIZE(wbufs); i++) {
+		k_fifo_put(&wbufs_free, &wbufs[i]);
+	}
+	hbc->wbuf = NULL;
+}
+
+/* Wait for the writer to finish with every buffer. */
+static void hawkbit_writer_stop(struct hawkbit_context *hbc)
+{
+	int i;
+
+	if (hbc->wbuf) {
+		k_fifo_put(&wbufs_free, hbc->wbuf);
+		hbc->wbuf = NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(wbufs); i++) {
+		if (!k_fifo_get(&wbufs_free, HAWKBIT_DOWNLOAD_TIMEOUT)) {
+			LOG_ERR("Flash writer is stuck");
+			break;
+		}
+	}
+
+	/*
+	 * The writer gets to check this only after it gave its last
+	 * buffer back, so it won't raise an event for the next download.
+	 */
+	hbc->dl.writer_wait = false;
+}
+
+/* Hand the writer thread its next buffer. */
+static void hawkbit_writer_submit(struct hawkbit_context *hbc, bool final)
+{
+	hbc->wbuf->final = final;
+	k_fifo_put(&wbufs_full, hbc->wbuf);
+	hbc->wbuf = NULL;
+	k_sem_give(&writer_kick);
+}
+
+/*
+ * Queue the next piece of the artifact for the writer thread, waiting
+ * up to "timeout" for a buffer whenever every one is in use. Returns
+ * the number of bytes queued, which is less than "len" if it timed out.
+ */
+static size_t hawkbit_writer_put(struct hawkbit_context *hbc,
+				 const u8_t *data, size_t len, bool final,
+				 s32_t timeout)
+{
+	size_t put = 0;
+	size_t n;
+
+	while (len || final) {
+		if (!hbc->wbuf) {
+			hbc->wbuf = k_fifo_get(&wbufs_free, timeout);
+			if (!hbc->wbuf) {
+				break;
+			}
+			hbc->wbuf->len = 0;
+		}
+
+		n = MIN(len, sizeof(hbc->wbuf->data) - hbc->wbuf->len);
+		memcpy(hbc->wbuf->data + hbc->wbuf->len, data, n);
+		hbc->wbuf->len += n;
+		data += n;
+		len -= n;
+		put += n;
+
+		if (final && !len) {
+			hawkbit_writer_submit(hbc, true);
+			break;
+		} else if (hbc->wbuf->len == sizeof(hbc->wbuf->data)) {
+			hawkbit_writer_submit(hbc, false);
+		}
+	}
+
+	return put;
+}
+
+/*
+ * Find header "name" among the "len" bytes of HTTP headers at "hdrs",
+ * and copy its value to "buf". Returns false if it's missing, or too
+ * big for "buf".
+ */
+static bool hawkbit_find_header(const u8_t *hdrs, size_t len,
+				const char *name, char *buf, size_t size)
+{
+	const u8_t *end = hdrs + len;
+	const u8_t *eol;
+	size_t name_len = strlen(name);
+	size_t i;
+
+	for (; hdrs < end; hdrs = eol + 1) {
+		eol = memchr(hdrs, '\n', end - hdrs);
+		if (!eol) {
+			eol = end;
+		}
+		if (eol - hdrs <= name_len || hdrs[name_len] != ':') {
+			continue;
+		}
+		for (i = 0; i < name_len; i++) {
+			if (tolower(hdrs[i]) != tolower(name[i])) {
+				break;
+			}
+		}
+		if (i < name_len) {
+			continue;
+		}
+
+		/* Trim the value. */
+		hdrs += name_len + 1;
+		while (hdrs < eol && *hdrs == ' ') {
+			hdrs++;
+		}
+		while (eol > hdrs && (eol[-1] == '\r' || eol[-1] == ' ')) {
+			eol--;
+		}
+		if (eol - hdrs >= size) {
+			return false;
+		}
+		memcpy(buf, hdrs, eol - hdrs);
+		buf[eol - hdrs] = '\0';
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Remember how long a server which is overloaded (429) or down for
+ * maintenance (503) asked us to wait, from the response headers in
+ * the "len" bytes at "hdrs". Only the delay-seconds form of
+ * Retry-After is understood.
+ */
+static void hawkbit_save_retry_after(struct hawkbit_context *hbc,
+				     const u8_t *hdrs, size_t len)
+{
+	char value[12];
+	long secs;
+	char *end;
+
+	if (!hawkbit_find_header(hdrs, len, "Retry-After", value,
+				 sizeof(value))) {
+		return;
+	}
+
+	secs = strtol(value, &end, 10);
+	if (end == value || *end || secs < 0) {
+		LOG_DBG("Ignoring Retry-After: %s", value);
+		return;
+	}
+
+	hbc->retry_after = K_SECONDS(MIN(secs, HAWKBIT_RETRY_AFTER_MAX));
+	LOG_WRN("Server asked us to retry after %ld seconds", secs);
+}
+
+/* http_client doesn't callback until the HTTP body has started */
+static void install_update_cb(struct http_ctx *ctx,
+			      u8_t *data, size_t data_size,
+			      size_t data_len,
+			      enum http_final_call final_data,
+			      void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+	int downloaded;
+	u8_t *body_data = NULL;
+	size_t body_len = 0;
+	int status = ctx->http.parser.status_code;
+	int expected_status = hbc->dl.ranged ? 206 : 200;
+	bool final = final_data == HTTP_DATA_FINAL;
+	bool last = final && hbc->dl.segment_end == hbc->dl.file_size;
+
+	if (final) {
+		hbc->dl.done_ms = k_uptime_get_32();
+	}
+
+	/*
+	 * Redirects are followed by hawkbit_download_step(), once this
+	 * response is over; the headers are only seen the first time.
+	 */
+	if (status == 301 || status == 302 || status == 303 ||
+	    status == 307 || status == 308) {
+		if (!hbc->dl.redirected) {
+			hbc->dl.redirected = true;
+			if (!hawkbit_find_header(ctx->http.rsp.response_buf,
+						 data_len, "Location",
+						 hbc->content_url,
+						 sizeof(hbc->content_url))) {
+				hbc->content_url[0] = '\0';
+			}
+		}
+		if (final) {
+			hawkbit_download_event(hbc);
+		}
+		return;
+	}
+
+	/*
+	 * A server which ignores Range sends all of the artifact when
+	 * asked for its first segment: take it as one unsegmented
+	 * download, which can't be canceled until it's over. When
+	 * resuming, the download has to start over instead.
+	 */
+	if (status == 200 && hbc->dl.ranged && !hbc->dl.resume_offset) {
+		LOG_WRN("Server ignored Range; downloading it all at once");
+		hbc->dl.ranged = false;
+		hbc->dl.segment_end = hbc->dl.file_size;
+		expected_status = 200;
+	} else if (status == 200 && hbc->dl.ranged) {
+		if (hbc->dl.download_status != -ERANGE) {
+			LOG_WRN("Server ignored Range; can't resume at %zu",
+				hbc->dl.resume_offset);
+			hbc->dl.download_status = -ERANGE;
+			hawkbit_download_event(hbc);
+		}
+		return;
+	}
+
+	/* HTTP error */
+	if (status != expected_status) {
+		LOG_ERR("HTTP error: %d (expected %d)!", status,
+			expected_status);
+		if (status == 429 || status == 503) {
+			hawkbit_save_retry_after(hbc, ctx->http.rsp.response_buf,
+						 data_len);
+		}
+		goto error;
+	}
+
+	/* header hasn't been read yet */
+	if (hbc->dl.http_content_size == 0) {
+		if (ctx->http.rsp.body_found == 0) {
+			LOG_ERR("Callback called w/o HTTP header found!");
+			goto error;
+		}
+
+		body_data = ctx->http.rsp.body_start;
+		body_len = data_len;
+		body_len -= (ctx->http.rsp.body_start -
+			     ctx->http.rsp.response_buf);
+		hbc->dl.http_content_size = hbc->dl.resume_offset +
+			ctx->http.rsp.content_length;
+		hbc->dl.first_byte_ms = k_uptime_get_32();
+	}
+
+	if (body_data == NULL) {
+		body_data = ctx->http.rsp.response_buf;
+		body_len = data_len;
+	}
+
+	/* the writer thread failed; don't bother it any further */
+	if (hbc->dl.download_status) {
+		return;
+	}
+
+	/* everything looks good: queue it up for flashing */
+	hawkbit_writer_put(hbc, body_data, body_len, last, K_FOREVER);
+	hbc->dl.downloaded_size += body_len;
+
+	downloaded = hbc->dl.downloaded_size * 100 / hbc->dl.file_size;
+	if (downloaded > hbc->dl.download_progress) {
+		hbc->dl.download_progress = downloaded;
+		LOG_DBG("%d%%", hbc->dl.download_progress);
+	}
+
+	/*
+	 * The writer thread signals completion, once the last segment
+	 * is flashed; the end of the others is ours to signal.
+	 */
+	if (final && !last) {
+		hbc->dl.segment_done = true;
+		hawkbit_download_event(hbc);
+	}
+	return;
+
+error:
+	hbc->dl.download_status = -1;
+	hawkbit_download_event(hbc);
+}
+
+/*
+ * HTTP connection handling.
+ *
+ * hawkbit_conn_open() makes sure hbc->http_ctx is ready to send a
+ * request to a host, replacing a connection to any other, and
+ * hawkbit_conn_done() decides whether the connection may be reused
+ * after a request completes. The connection is torn down at the
+ * end of each poll cycle by hawkbit_conn_close(), unless the next
+ * poll may reuse it (see HAWKBIT_IDLE_TIMEOUT).
+ */
+
+static void hawkbit_http_closed(struct http_ctx *ctx, int status,
+				void *user_data)
+{
+	struct hawkbit_context *hbc = CONTAINER_OF(ctx, struct hawkbit_context,
+						   http_ctx);
+
+	LOG_DBG("Server closed the connection (%d)", status);
+	hbc->http_closed = true;
+}
+
+static void hawkbit_conn_close(struct hawkbit_context *hbc)
+{
+	if (!hbc->http_open) {
+		return;
+	}
+
+	http_release(&hbc->http_ctx);
+	hbc->http_open = false;
+	hbc->http_closed = false;
+}
+
+/* Is there a usable connection to "host" (NULL for the server)? */
+static bool hawkbit_conn_usable(struct hawkbit_context *hbc,
+				const struct hawkbit_host *host)
+{
+	if (!hbc->http_open || hbc->http_closed) {
+		return false;
+	}
+	if (!host) {
+		return !hbc->conn_host.addr[0];
+	}
+
+	return hbc->conn_host.port == host->port &&
+		!strcmp(hbc->conn_host.addr, host->addr);
+}
+
+static int hawkbit_conn_open(struct hawkbit_context *hbc,
+			     const struct hawkbit_host *host)
+{
+	int ret;
+
+	if (hawkbit_conn_usable(hbc, host)) {
+		return 0;
+	}
+	hawkbit_conn_close(hbc);
+
+	ret = http_client_init(&hbc->http_ctx,
+			       host ? host->addr : HAWKBIT_SERVER_ADDR,
+			       host ? host->port : HAWKBIT_PORT,
+			       NULL, HAWKBIT_RX_TIMEOUT);
+	if (ret < 0) {
+		LOG_ERR("Failed to init http ctx, err %d", ret);
+		return ret;
+	}
+	if (host) {
+		hbc->conn_host = *host;
+	} else {
+		memset(&hbc->conn_host, 0, sizeof(hbc->conn_host));
+	}
+
+#if defined(CONFIG_NET_CONTEXT_NET_PKT_POOL)
+	net_app_set_net_pkt_pool(&hbc->http_ctx.app_ctx, tx_slab, data_pool);
+#endif
+	http_set_cb(&hbc->http_ctx, NULL, NULL, NULL, hawkbit_http_closed);
+
+#if defined(CONFIG_FOTA_TLS)
+	/* Other hosts only serve artifacts, which have known hashes. */
+	if (!host) {
+		ret = http_client_set_tls(&hbc->http_ctx, hbc->tls_buffer,
+					  sizeof(hbc->tls_buffer),
+					  (u8_t *)TLS_CONF_PERSONALIZATION,
+					  strlen(TLS_CONF_PERSONALIZATION),
+					  tls_conf_ca_cert_cb,
+					  TLS_CONF_HOSTNAME, NULL,
+					  &hawkbit_tls_pool, hawkbit_tls_stack,
+					  K_THREAD_STACK_SIZEOF(
+						  hawkbit_tls_stack));
+		if (ret < 0) {
+			LOG_ERR("Failed to set up TLS, err %d", ret);
+			http_release(&hbc->http_ctx);
+			return ret;
+		}
+		hbc->stats.handshakes++;
+	}
+#endif
+
+	hbc->http_open = true;
+	hbc->stats.connects++;
+	return 0;
+}
+
+static void hawkbit_conn_done(struct hawkbit_context *hbc, int result)
+{
+	if (!IS_ENABLED(CONFIG_FOTA_HTTP_KEEPALIVE) || result < 0 ||
+	    hbc->http_closed ||
+	    !http_should_keep_alive(&hbc->http_ctx.http.parser)) {
+		hawkbit_conn_close(hbc);
+	}
+}
+
+/*
+ * Send hbc->http_req to "host", or to the hawkBit server if that is
+ * NULL, opening a connection first if needed.
+ *
+ * A kept-alive connection may have been dropped by the server
+ * without us noticing yet, so if sending on a reused connection
+ * fails, retry once on a fresh one.
+ */
+static int hawkbit_send_req(struct hawkbit_context *hbc,
+			    const struct hawkbit_host *host,
+			    http_response_cb_t cb, s32_t timeout)
+{
+	bool reused = hawkbit_conn_usable(hbc, host);
+	int handshakes = hbc->stats.handshakes;
+	u32_t start_ms = k_uptime_get_32();
+	int ret;
+
+	ret = hawkbit_conn_open(hbc, host);
+	if (ret < 0) {
+		return ret;
+	}
+
+	hbc->stats.requests++;
+	ret = http_client_send_req(&hbc->http_ctx, &hbc->http_req, cb,
+				   hbc->tcp_buffer, hbc->tcp_buffer_size,
+				   hbc, timeout);
+	if (ret < 0 && ret != -EINPROGRESS && reused) {
+		LOG_DBG("Reconnecting after error %d on reused connection",
+			ret);
+		hawkbit_conn_close(hbc);
+		ret = hawkbit_conn_open(hbc, host);
+		if (ret < 0) {
+			return ret;
+		}
+
+		hbc->stats.requests++;
+		ret = http_client_send_req(&hbc->http_ctx, &hbc->http_req, cb,
+					   hbc->tcp_buffer,
+					   hbc->tcp_buffer_size,
+					   hbc, timeout);
+	}
+
+	if (hbc->stats.handshakes != handshakes) {
+		hbc->stats.handshake_ms += k_uptime_get_32() - start_ms;
+	}
+
+	return ret;
+}
+
+/*
+ * Download sources.
+ *
+ * Artifacts on the hawkBit server are downloaded from the mirrors in
+ * CONFIG_FOTA_DOWNLOAD_MIRRORS, if there are any, picking the one
+ * which is expected to be fastest from how its earlier transfers
+ * went. Artifacts whose URLs name another host are downloaded from
+ * there, and redirects are followed.
+ */
+
+static void hawkbit_mirrors_init(void)
+{
+	const char *s = CONFIG_FOTA_DOWNLOAD_MIRRORS;
+	int entry = 0;
+	size_t len;
+
+	memset(mirrors, 0, sizeof(mirrors));
+	num_mirrors = 0;
+	for (; *s; s += len) {
+		len = strcspn(s, " ");
+		if (!len) {
+			len = 1;
+			continue;
+		}
+		if (num_mirrors == ARRAY_SIZE(mirrors)) {
+			LOG_WRN("Ignoring download mirrors past the first %d",
+				HAWKBIT_MIRRORS_MAX);
+			break;
+		}
+		if (hawkbit_parse_host(s, len, &mirrors[num_mirrors].host)) {
+			LOG_ERR("Invalid download mirror %d", entry);
+		} else {
+			num_mirrors++;
+		}
+		entry++;
+	}
+}
+
+/*
+ * Expected time, in ms, to fetch HAWKBIT_MIRROR_COST_BYTES from a
+ * mirror. Those which haven't been measured yet come first, so that
+ * each gets its turn, and each consecutive failure doubles the cost.
+ */
+static u32_t hawkbit_mirror_cost(const struct hawkbit_mirror *m)
+{
+	u32_t cost;
+
+	if (!m->rate) {
+		return 0;
+	}
+
+	cost = m->latency_ms +
+		(u64_t)HAWKBIT_MIRROR_COST_BYTES * MSEC_PER_SEC / m->rate;
+	return cost << m->failures;
+}
+
+/* Returns NULL if the server should be used instead. */
+static struct hawkbit_mirror *hawkbit_mirror_pick(void)
+{
+	struct hawkbit_mirror *best = NULL;
+	size_t i;
+
+	for (i = 0; i < num_mirrors; i++) {
+		if (mirrors[i].failures >= HAWKBIT_MIRROR_FAILURES_MAX) {
+			continue;
+		}
+		if (!best ||
+		    hawkbit_mirror_cost(&mirrors[i]) <
+		    hawkbit_mirror_cost(best)) {
+			best = &mirrors[i];
+		}
+	}
+
+	if (!best && num_mirrors) {
+		/* Give them all another chance next time. */
+		LOG_WRN("All download mirrors are failing");
+		for (i = 0; i < num_mirrors; i++) {
+			mirrors[i].failures = 0;
+		}
+	}
+
+	return best;
+}
+
+/* Account for a transfer from a mirror which went through. */
+static void hawkbit_mirror_measure(struct hawkbit_download *dl)
+{
+	struct hawkbit_mirror *m = dl->mirror;
+	u32_t latency;
+	u32_t rate;
+
+	if (!m || !dl->first_byte_ms) {
+		return;
+	}
+
+	latency = dl->first_byte_ms - dl->request_ms;
+	rate = (u64_t)(dl->segment_end - dl->resume_offset) * MSEC_PER_SEC /
+		MAX(dl->done_ms - dl->first_byte_ms, 1);
+	rate = MAX(rate, 1);
+
+	/* Smooth them out, giving the latest a quarter of the weight. */
+	if (m->rate) {
+		m->latency_ms = (3 * m->latency_ms + latency) / 4;
+		m->rate = MAX((3 * (u64_t)m->rate + rate) / 4, 1);
+	} else {
+		m->latency_ms = latency;
+		m->rate = rate;
+	}
+	m->failures = 0;
+	LOG_DBG("Mirror %s: %u ms latency, %u bytes/s", m->host.addr,
+		m->latency_ms, m->rate);
+}
+
+/* Decide where to download "art" from. */
+static int hawkbit_download_source(struct hawkbit_context *hbc,
+				   const struct hawkbit_artifact *art)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+
+	dl->path = hawkbit_parse_url(art->url, &hbc->content_host);
+	if (!dl->path) {
+		return -EINVAL;
+	}
+
+	if (hbc->content_host.addr[0]) {
+		dl->host = &hbc->content_host;
+	} else {
+		dl->mirror = hawkbit_mirror_pick();
+		dl->host = dl->mirror ? &dl->mirror->host : NULL;
+	}
+
+	if (dl->host) {
+		LOG_INF("Downloading from %s port %u", dl->host->addr,
+			dl->host->port);
+	}
+	return 0;
+}
+
+/*
+ * Switch the download over to where the last transfer was
+ * redirected, as given in hbc->content_url. A bare path stays on the
+ * same host.
+ */
+static int hawkbit_follow_redirect(struct hawkbit_context *hbc)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+	struct hawkbit_host host;
+	const char *path;
+
+	if (++dl->redirects > HAWKBIT_REDIRECTS_MAX) {
+		LOG_ERR("Too many redirects");
+		return -EINVAL;
+	}
+
+	path = hawkbit_parse_url(hbc->content_url, &host);
+	if (!path) {
+		LOG_ERR("Unsupported redirect: %s", hbc->content_url);
+		return -EINVAL;
+	}
+
+	LOG_INF("Download redirected to %s", hbc->content_url);
+	if (host.addr[0]) {
+		hbc->content_host = host;
+		dl->host = &hbc->content_host;
+		dl->mirror = NULL;
+	}
+	dl->path = path;
+	/* The redirect's body may not have been read to the end. */
+	hawkbit_conn_close(hbc);
+	return 0;
+}
+
+/*
+ * Request the next segment of the artifact, from where the last one
+ * ended. Segments are CONFIG_FOTA_DOWNLOAD_SEGMENT_SIZE bytes long,
+ * so that cancelation can be checked for in between; if that is 0,
+ * the rest of the artifact is requested at once.
+ */
+static int hawkbit_download_segment(struct hawkbit_context *hbc)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+	size_t start = dl->downloaded_size;
+	int ret;
+
+	dl->resume_offset = start;
+	dl->segment_end = dl->file_size;
+	if (CONFIG_FOTA_DOWNLOAD_SEGMENT_SIZE) {
+		dl->segment_end = MIN(start + CONFIG_FOTA_DOWNLOAD_SEGMENT_SIZE,
+				      dl->file_size);
+	}
+	dl->ranged = start || dl->segment_end < dl->file_size;
+	dl->segment_done = false;
+	dl->redirected = false;
+	dl->http_content_size = 0;
+	dl->first_byte_ms = 0;
+
+	memset(hbc->tcp_buffer, 0, hbc->tcp_buffer_size);
+	memset(&hbc->http_req, 0, sizeof(hbc->http_req));
+	hbc->http_req.method = HTTP_GET;
+	hbc->http_req.url = dl->path;
+	hbc->http_req.host = dl->host ? dl->host->addr : HAWKBIT_HOST;
+	hbc->http_req.protocol = " " HTTP_PROTOCOL;
+	hbc->http_req.header_fields = HAWKBIT_HEADER_FIELDS;
+	if (dl->ranged) {
+		snprintk(hbc->range_header, sizeof(hbc->range_header),
+			 HAWKBIT_RANGE_HEADER_FIELDS_FMT, start,
+			 dl->segment_end - 1);
+		hbc->http_req.header_fields = hbc->range_header;
+	}
+
+	dl->request_ms = k_uptime_get_32();
+	ret = hawkbit_send_req(hbc, dl->host, install_update_cb, K_NO_WAIT);
+	/* http_client returns EINPROGRESS for get_req w/ K_NO_WAIT */
+	if (ret < 0 && ret != -EINPROGRESS) {
+		LOG_ERR("Failed to send request, err %d", ret);
+		hawkbit_conn_close(hbc);
+		return ret;
+	}
+
+	return 0;
+}
+
+static bool hawkbit_cancel_requested(struct hawkbit_context *hbc);
+static void hawkbit_report_progress(struct hawkbit_context *hbc);
+
+/*
+ * Parallel downloads.
+ *
+ * With CONFIG_FOTA_DOWNLOAD_CONNECTIONS > 1, an artifact is fetched
+ * as consecutive Range segments over that many connections ("lanes")
+ * at once, so a link with a long round trip time is kept busy. Each
+ * lane receives its segment into a buffer of its own; the download
+ * step hands the finished ones to the flash writer in order, and
+ * gives the lane the next segment. Segments which fail or stall are
+ * requested again, up to HAWKBIT_DOWNLOAD_ATTEMPTS times each.
+ *
+ * Lanes use plain HTTP, so downloads from the hawkBit server with
+ * CONFIG_FOTA_TLS use a single connection, as do redirects: a lane
+ * which gets one fails, and the retry falls back to one connection.
+ */
+
+#if CONFIG_FOTA_DOWNLOAD_CONNECTIONS > 1
+#define HAWKBIT_LANES		CONFIG_FOTA_DOWNLOAD_CONNECTIONS
+#define HAWKBIT_LANE_SEGMENT	CONFIG_FOTA_DOWNLOAD_CONNECTION_SEGMENT_SIZE
+
+/*
+ * Lanes run alongside the hawkBit connection, MQTT, DNS and DHCP, and
+ * each needs room for a full TCP segment of 256 byte buffers. These
+ * are the Kconfig defaults; a board may not go below them.
+ */
+BUILD_ASSERT_MSG(CONFIG_NET_MAX_CONTEXTS >= 6 + HAWKBIT_LANES,
+		 "CONFIG_NET_MAX_CONTEXTS too small for download connections");
+BUILD_ASSERT_MSG(CONFIG_NET_PKT_RX_COUNT >= 10 + 2 * HAWKBIT_LANES,
+		 "CONFIG_NET_PKT_RX_COUNT too small for download connections");
+BUILD_ASSERT_MSG(CONFIG_NET_BUF_RX_COUNT >= 15 + 6 * HAWKBIT_LANES,
+		 "CONFIG_NET_BUF_RX_COUNT too small for download connections");
+
+struct hawkbit_lane {
+	struct hawkbit_context *hbc;
+	struct http_ctx http_ctx;
+	bool http_open;
+	bool http_closed;
+	struct http_request http_req;
+	char range_header[48];
+	u8_t tcp_buffer[TCP_RECV_BUFFER_SIZE];
+	enum {
+		HAWKBIT_LANE_IDLE,
+		HAWKBIT_LANE_BUSY,	/* the segment is on its way */
+		HAWKBIT_LANE_DONE,	/* ... and all of it is in buf */
+		HAWKBIT_LANE_FAILED,
+	} state;
+	size_t start;		/* segment offset in the artifact */
+	size_t size;		/* segment size */
+	size_t len;		/* bytes received so far */
+	bool body;		/* the body started */
+	int attempts;		/* failed requests for this segment */
+	u32_t active_ms;	/* uptime of the last data received */
+	u8_t buf[HAWKBIT_LANE_SEGMENT] __aligned(4);
+};
+
+static struct hawkbit_lane lanes[HAWKBIT_LANES];
+
+static void hawkbit_lane_closed(struct http_ctx *ctx, int status,
+				void *user_data)
+{
+	struct hawkbit_lane *lane = CONTAINER_OF(ctx, struct hawkbit_lane,
+						 http_ctx);
+
+	lane->http_closed = true;
+	/* Don't wait for the stall check to find an unfinished segment. */
+	if (lane->state == HAWKBIT_LANE_BUSY) {
+		lane->state = HAWKBIT_LANE_FAILED;
+		hawkbit_download_event(lane->hbc);
+	}
+}
+
+static void hawkbit_lane_close(struct hawkbit_lane *lane)
+{
+	if (lane->http_open) {
+		http_release(&lane->http_ctx);
+		lane->http_open = false;
+		lane->http_closed = false;
+	}
+}
+
+/* http_client response callback for a lane's segment. */
+static void hawkbit_lane_cb(struct http_ctx *ctx,
+			    u8_t *data, size_t data_size,
+			    size_t data_len,
+			    enum http_final_call final_data,
+			    void *user_data)
+{
+	struct hawkbit_lane *lane = user_data;
+	u8_t *body_data = ctx->http.rsp.response_buf;
+	size_t body_len = data_len;
+
+	if (lane->state != HAWKBIT_LANE_BUSY) {
+		return;
+	}
+
+	if (ctx->http.parser.status_code != 206) {
+		LOG_ERR("Lane %d: HTTP error: %d (expected 206)",
+			(int)(lane - lanes), ctx->http.parser.status_code);
+		/* Range is ignored: fall back to one connection now. */
+		if (ctx->http.parser.status_code == 200) {
+			lane->attempts = HAWKBIT_DOWNLOAD_ATTEMPTS;
+		}
+		goto error;
+	}
+
+	if (!lane->body) {
+		if (!ctx->http.rsp.body_found) {
+			goto error;
+		}
+		body_data = ctx->http.rsp.body_start;
+		body_len -= ctx->http.rsp.body_start -
+			    ctx->http.rsp.response_buf;
+		lane->body = true;
+	}
+
+	if (body_len > lane->size - lane->len) {
+		LOG_ERR("Lane %d: segment too long", (int)(lane - lanes));
+		goto error;
+	}
+	memcpy(lane->buf + lane->len, body_data, body_len);
+	lane->len += body_len;
+	lane->active_ms = k_uptime_get_32();
+
+	if (final_data == HTTP_DATA_FINAL) {
+		lane->state = lane->len == lane->size ?
+			HAWKBIT_LANE_DONE : HAWKBIT_LANE_FAILED;
+		hawkbit_download_event(lane->hbc);
+	}
+	return;
+
+error:
+	lane->state = HAWKBIT_LANE_FAILED;
+	hawkbit_download_event(lane->hbc);
+}
+
+/* Request the lane's segment, connecting first if need be. */
+static int hawkbit_lane_request(struct hawkbit_context *hbc,
+				struct hawkbit_lane *lane)
+{
+	const struct hawkbit_host *host = hbc->dl.host;
+	int ret;
+
+	if (lane->http_open && lane->http_closed) {
+		hawkbit_lane_close(lane);
+	}
+	if (!lane->http_open) {
+		ret = http_client_init(&lane->http_ctx,
+				       host ? host->addr : HAWKBIT_SERVER_ADDR,
+				       host ? host->port : HAWKBIT_PORT,
+				       NULL, HAWKBIT_RX_TIMEOUT);
+		if (ret < 0) {
+			LOG_ERR("Failed to init http ctx, err %d", ret);
+			return ret;
+		}
+#if defined(CONFIG_NET_CONTEXT_NET_PKT_POOL)
+		net_app_set_net_pkt_pool(&lane->http_ctx.app_ctx, tx_slab,
+					 data_pool);
+#endif
+		http_set_cb(&lane->http_ctx, NULL, NULL, NULL,
+			    hawkbit_lane_closed);
+		lane->http_open = true;
+		hbc->stats.connects++;
+	}
+
+	lane->hbc = hbc;
+	lane->len = 0;
+	lane->body = false;
+	lane->active_ms = k_uptime_get_32();
+	lane->state = HAWKBIT_LANE_BUSY;
+
+	snprintk(lane->range_header, sizeof(lane->range_header),
+		 HTTP_HEADER_RANGE_FMT_CRLF, lane->start,
+		 lane->start + lane->size - 1);
+	memset(&lane->http_req, 0, sizeof(lane->http_req));
+	lane->http_req.method = HTTP_GET;
+	lane->http_req.url = hbc->dl.path;
+	lane->http_req.host = host ? host->addr : HAWKBIT_HOST;
+	lane->http_req.protocol = " " HTTP_PROTOCOL;
+	lane->http_req.header_fields = lane->range_header;
+
+	hbc->stats.requests++;
+	ret = http_client_send_req(&lane->http_ctx, &lane->http_req,
+				   hawkbit_lane_cb, lane->tcp_buffer,
+				   sizeof(lane->tcp_buffer), lane, K_NO_WAIT);
+	if (ret < 0 && ret != -EINPROGRESS) {
+		LOG_ERR("Lane %d: failed to send request, err %d",
+			(int)(lane - lanes), ret);
+		hawkbit_lane_close(lane);
+		lane->state = HAWKBIT_LANE_FAILED;
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Should this download attempt go over lanes? */
+static bool hawkbit_lanes_usable(struct hawkbit_context *hbc)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+
+	return hbc->dep.attempt == 0 &&
+		!(IS_ENABLED(CONFIG_FOTA_TLS) && !dl->host) &&
+		dl->file_size - dl->downloaded_size > HAWKBIT_LANE_SEGMENT;
+}
+
+static void hawkbit_lanes_start(struct hawkbit_context *hbc)
+{
+	int i;
+
+	for (i = 0; i < HAWKBIT_LANES; i++) {
+		lanes[i].state = HAWKBIT_LANE_IDLE;
+		lanes[i].attempts = 0;
+	}
+	hbc->dl.next_offset = hbc->dl.downloaded_size;
+	LOG_INF("Downloading over %d connections", HAWKBIT_LANES);
+}
+
+static void hawkbit_lanes_stop(struct hawkbit_context *hbc)
+{
+	int i;
+
+	for (i = 0; i < HAWKBIT_LANES; i++) {
+		lanes[i].state = HAWKBIT_LANE_IDLE;
+		hawkbit_lane_close(&lanes[i]);
+	}
+}
+#else
+#define hawkbit_lanes_usable(hbc)	false
+#define hawkbit_lanes_start(hbc)
+#define hawkbit_lanes_stop(hbc)
+#endif
+
+/*
+ * Start downloading an artifact into slot1, "offset" bytes into it.
+ * "flags" are the artifact's HAWKBIT_ARTIFACT_* flags; if any are
+ * set, "offset" must be zero. hawkbit_download_step() takes it from
+ * there.
+ */
+static int hawkbit_download_start(struct hawkbit_context *hbc,
+				  const struct hawkbit_artifact *art,
+				  size_t offset)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+	unsigned int flags = art->flags;
+	int ret = 0;
+
+#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
+	/* instead of erasing slot 1, reset image data */
+	if (!(flags & HAWKBIT_ARTIFACT_DATA)) {
+		ret = boot_request_erase();
+		if (ret != 0) {
+			LOG_ERR("Flash image 1 reset: error %d", ret);
+			return -EIO;
+		}
+	}
+#endif
+
+	LOG_INF("Starting the download and flash process of %s at offset %zu",
+		art->part->name, offset);
+
+	/* Receive is special for download, since it writes to flash */
+	memset(&hbc->dl, 0, sizeof(struct hawkbit_download));
+	dl->journal_offset = offset;
+	dl->flags = flags;
+	dl->file_size = art->size;
+	dl->downloaded_size = offset;
+	dl->reported_ms = k_uptime_get_32();
+	dl->last_progress = offset;
+	ret = hawkbit_download_source(hbc, art);
+	if (ret < 0) {
+		return ret;
+	}
+	/* reset download semaphore -- TODO is this really needed? */
+	k_sem_init(hbc->sem, 0, 1);
+	/*
+	 * Re-initialize the flash writer state, picking up where the
+	 * last flash-committed erase block left off. Whatever the erase
+	 * scheduler already did for this offset is kept.
+	 */
+	hawkbit_erase_start(hbc, art, offset);
+#if defined(CONFIG_FOTA_DELTA_UPDATE)
+	if (flags & HAWKBIT_ARTIFACT_DELTA) {
+		delta_patch_init(&hbc->delta, hawkbit_delta_read,
+				 hawkbit_delta_write, FLASH_BANK_SIZE,
+				 FLASH_BANK_SIZE, hbc);
+	}
+#endif
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+	if (flags & HAWKBIT_ARTIFACT_COMPRESSED) {
+		lzss_stream_init(&hbc->lzss, hawkbit_lzss_write,
+				 FLASH_BANK_SIZE, hbc);
+	}
+#endif
+	hawkbit_writer_start(hbc);
+	dl->lanes = hawkbit_lanes_usable(hbc);
+	if (dl->lanes) {
+		hawkbit_lanes_start(hbc);
+	}
+
+	return 0;
+}
+
+/*
+ * Wrap up the download, after "ret" from the last request sent.
+ *
+ * Returns -EAGAIN if the transfer stalled, failed on a download
+ * mirror or couldn't be resumed, and may be retried from
+ * hbc->dl.journal_offset,
+ * -ECANCELED if the server canceled the action in the meantime, or
+ * -EBADMSG if the image is bad.
+ */
+static int hawkbit_download_end(struct hawkbit_context *hbc, int ret)
 {
-	struct hawkbit_context *hbc = user_data;
-	int downloaded, ret = 0;
-	u8_t *body_data = NULL;
-	size_t body_len = 0;
+	struct hawkbit_download *dl = &hbc->dl;
 
-	/* HTTP error */
-	if (ctx->http.parser.status_code != 200) {
-		LOG_ERR("HTTP error: %d!", ctx->http.parser.status_code);
-		goto error;
+	/* keep the connection only if the transfer finished cleanly */
+	hawkbit_conn_done(hbc, dl->download_status > 0 ? 0 : -EIO);
+	hawkbit_writer_stop(hbc);
+
+	if (dl->download_status == -ECANCELED) {
+		LOG_INF("Download canceled after %zu bytes",
+			dl->downloaded_size);
+		return -ECANCELED;
 	}
 
-	/* header hasn't been read yet */
-	if (hbc->dl.http_content_size == 0) {
-		if (ctx->http.rsp.body_found == 0) {
-			LOG_ERR("Callback called w/o HTTP header found!");
-			goto error;
-		}
+	if (dl->download_status == -EBADMSG) {
+		/* No point in downloading it again. */
+		LOG_ERR("Image rejected after %zu bytes", dl->downloaded_size);
+		return -EBADMSG;
+	}
 
-		body_data = ctx->http.rsp.body_start;
-		body_len = data_len;
-		body_len -= (ctx->http.rsp.body_start -
-			     ctx->http.rsp.response_buf);
-		hbc->dl.http_content_size = ctx->http.rsp.content_length;
+	if (dl->download_status == -ERANGE) {
+		/* The next attempt starts over, and so does the journal. */
+		hawkbit_journal_rewind();
+		dl->journal_offset = 0;
+		return -EAGAIN;
 	}
 
-	if (body_data == NULL) {
-		body_data = ctx->http.rsp.response_buf;
-		body_len = data_len;
+	if (dl->download_status <= 0 && dl->mirror &&
+	    dl->mirror->failures < HAWKBIT_MIRROR_FAILURES_MAX) {
+		dl->mirror->failures++;
 	}
 
-#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
-	/* Erase the sector that's going to be written to next */
-	while (hbc->last_offset <
-	       FLASH_AREA_IMAGE_1_OFFSET + dfu_ctx.bytes_written +
-	       FLASH_ERASE_BLOCK_SIZE) {
-		LOG_INF("Erasing sector at offset 0x%x", hbc->last_offset);
-		flash_write_protection_set(flash_dev, false);
-		ret = flash_erase(flash_dev, hbc->last_offset,
-				  FLASH_ERASE_BLOCK_SIZE);
-		flash_write_protection_set(flash_dev, true);
+	if (dl->download_status == 0) {
+		LOG_ERR("Download stalled after %zu bytes",
+			dl->downloaded_size);
+		return -EAGAIN;
+	} else if (dl->download_status < 0) {
+		LOG_ERR("Unable to finish the download process %d",
+			dl->download_status);
+		/* The next attempt may pick another mirror. */
+		if (dl->mirror) {
+			return -EAGAIN;
+		}
+		return ret < 0 ? ret : -EIO;
+	}
 
-		if (ret) {
-			LOG_ERR("Error %d while erasing sector", ret);
-			goto error;
+	return 0;
+}
+
+#if CONFIG_FOTA_DOWNLOAD_CONNECTIONS > 1
+/*
+ * hawkbit_download_step() over lanes: retry the segments which failed
+ * or stalled, write out the ones which are done, in order, and give
+ * idle lanes the next ones.
+ */
+static int hawkbit_lanes_step(struct hawkbit_context *hbc)
+{
+	struct hawkbit_download *dl = &hbc->dl;
+	struct hawkbit_lane *lane;
+	bool drained = false;
+	bool more;
+	size_t offset, put;
+	int downloaded;
+	int i, ret;
+
+	k_sem_take(hbc->sem, K_NO_WAIT);
+
+	for (i = 0; i < HAWKBIT_LANES; i++) {
+		lane = &lanes[i];
+		if (lane->state == HAWKBIT_LANE_BUSY &&
+		    k_uptime_get_32() - lane->active_ms >
+		    HAWKBIT_DOWNLOAD_TIMEOUT) {
+			LOG_ERR("Lane %d stalled", i);
+			lane->state = HAWKBIT_LANE_FAILED;
 		}
+		if (lane->state != HAWKBIT_LANE_FAILED) {
+			continue;
+		}
+		hawkbit_lane_close(lane);
+		if (++lane->attempts >= HAWKBIT_DOWNLOAD_ATTEMPTS) {
+			LOG_ERR("Segment at %zu failed %d times", lane->start,
+				lane->attempts);
+			dl->download_status = -1;
+			hawkbit_lanes_stop(hbc);
+			/* The retry falls back to a single connection. */
+			return hawkbit_download_end(hbc, -EAGAIN);
+		}
+		ret = hawkbit_lane_request(hbc, lane);
+		if (ret < 0) {
+			/* It's retried with the next event. */
+			hawkbit_download_event(hbc);
+		}
+	}
 
-		hbc->last_offset += FLASH_ERASE_BLOCK_SIZE;
+	/*
+	 * Whatever is next in order goes to the writer, as far as its
+	 * free buffers take it: waiting for flash here would hold up the
+	 * rest of the work queue. The writer raises an event when it
+	 * frees a buffer, if it's asked to before the buffers run out.
+	 */
+	dl->writer_wait = true;
+	do {
+		more = false;
+		for (i = 0; i < HAWKBIT_LANES; i++) {
+			lane = &lanes[i];
+			if (lane->state != HAWKBIT_LANE_DONE ||
+			    lane->start > dl->downloaded_size ||
+			    lane->start + lane->len <= dl->downloaded_size) {
+				continue;
+			}
+			offset = dl->downloaded_size - lane->start;
+			put = hawkbit_writer_put(hbc, lane->buf + offset,
+						 lane->len - offset,
+						 lane->start + lane->len ==
+						 dl->file_size, K_NO_WAIT);
+			dl->downloaded_size += put;
+			drained |= put > 0;
+			if (put < lane->len - offset) {
+				break;
+			}
+			lane->state = HAWKBIT_LANE_IDLE;
+			lane->attempts = 0;
+			more = true;
+		}
+	} while (more);
+	if (i == HAWKBIT_LANES) {
+		/* It took everything; no need to hear from it. */
+		dl->writer_wait = false;
 	}
-#endif
 
-	/* everything looks good: flash */
-	ret = flash_img_buffered_write(&dfu_ctx,
-				       body_data, body_len,
-				       final_data == HTTP_DATA_FINAL);
-	if (ret < 0) {
-		LOG_ERR("Flash write error: %d", ret);
-		goto error;
+	downloaded = dl->downloaded_size * 100 / dl->file_size;
+	if (downloaded > dl->download_progress) {
+		dl->download_progress = downloaded;
+		LOG_DBG("%d%%", dl->download_progress);
 	}
-	hbc->dl.downloaded_size = flash_img_bytes_written(&dfu_ctx);
 
-	downloaded = hbc->dl.downloaded_size * 100 /
-		     hbc->dl.http_content_size;
-	if (downloaded > hbc->dl.download_progress) {
-		hbc->dl.download_progress = downloaded;
-		LOG_DBG("%d%%", hbc->dl.download_progress);
+	if (dl->download_status) {
+		/* The writer failed, or wrote the last of it. */
+		dl->http_content_size = dl->downloaded_size;
+		hawkbit_lanes_stop(hbc);
+		return hawkbit_download_end(hbc, 0);
+	} else if (dl->downloaded_size == dl->file_size) {
+		return HAWKBIT_STEP_WAIT;
 	}
 
-	if (final_data == HTTP_DATA_FINAL) {
-		hbc->dl.download_status = 1;
-		k_sem_give(hbc->sem);
+	if (drained) {
+		/* Stop here if the update was canceled. */
+		if (hawkbit_cancel_requested(hbc)) {
+			dl->download_status = -ECANCELED;
+			hawkbit_lanes_stop(hbc);
+			return hawkbit_download_end(hbc, 0);
+		}
+		hawkbit_report_progress(hbc);
 	}
 
-	return;
+	for (i = 0; i < HAWKBIT_LANES && dl->next_offset < dl->file_size;
+	     i++) {
+		lane = &lanes[i];
+		if (lane->state != HAWKBIT_LANE_IDLE) {
+			continue;
+		}
+		lane->start = dl->next_offset;
+		lane->size = MIN(HAWKBIT_LANE_SEGMENT,
+				 dl->file_size - lane->start);
+		dl->next_offset += lane->size;
+		ret = hawkbit_lane_request(hbc, lane);
+		if (ret < 0) {
+			/* It's retried with the next event. */
+			hawkbit_download_event(hbc);
+		}
+	}
 
-error:
-	hbc->dl.download_status = -1;
-	k_sem_give(hbc->sem);
+	return HAWKBIT_STEP_WAIT;
 }
+#endif
 
-static int hawkbit_install_update(struct hawkbit_context *hbc,
-				  const char *download_http,
-				  size_t file_size)
+/*
+ * Move the download on, after an event from the transfer or the
+ * writer, or HAWKBIT_DOWNLOAD_TIMEOUT without one: follow a redirect,
+ * or request the next segment, unless the artifact is done.
+ *
+ * Returns HAWKBIT_STEP_WAIT while a transfer is in flight, and
+ * otherwise what hawkbit_download_end() does.
+ */
+static int hawkbit_download_step(struct hawkbit_context *hbc)
 {
 	struct hawkbit_download *dl = &hbc->dl;
-	int ret = 0;
-	size_t last_downloaded_size = 0;
+	size_t progress;
+	int ret;
 
-	if (!download_http || !file_size) {
-		return -EINVAL;
+#if CONFIG_FOTA_DOWNLOAD_CONNECTIONS > 1
+	if (dl->lanes) {
+		return hawkbit_lanes_step(hbc);
 	}
+#endif
 
-#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
-	/* instead of erasing slot 1, reset image data */
-	ret = boot_request_erase();
-	if (ret != 0) {
-		LOG_ERR("Flash image 1 reset: error %d", ret);
-		return -EIO;
-	}
-#else
-	flash_write_protection_set(flash_dev, false);
-	ret = flash_erase(flash_dev, FLASH_AREA_IMAGE_1_OFFSET,
-			  FLASH_BANK_SIZE);
-	flash_write_protection_set(flash_dev, true);
-	if (ret != 0) {
-		LOG_ERR("Failed to erase flash at offset %x, size %d",
-			FLASH_AREA_IMAGE_1_OFFSET, FLASH_BANK_SIZE);
-		return -EIO;
+	if (dl->pending) {
+		if (k_sem_take(hbc->sem, K_NO_WAIT)) {
+			/*
+			 * Timeout: check for download activity,
+			 * counting the writer's too, since the receive
+			 * callback waits for it when all the buffers
+			 * are full.
+			 */
+			progress = dl->downloaded_size + dl->written_size;
+			if (progress != dl->last_progress) {
+				dl->last_progress = progress;
+				return HAWKBIT_STEP_WAIT;
+			}
+		}
+		dl->pending = false;
+
+		if (dl->redirected) {
+			ret = hawkbit_follow_redirect(hbc);
+			if (ret < 0) {
+				dl->download_status = -1;
+				return hawkbit_download_end(hbc, ret);
+			}
+		} else {
+			/* Finished, failed or stalled? */
+			if (dl->download_status > 0 || dl->segment_done) {
+				hawkbit_mirror_measure(dl);
+			}
+			if (dl->download_status || !dl->segment_done) {
+				return hawkbit_download_end(hbc, 0);
+			}
+
+			/* More to come; stop here if it was canceled. */
+			if (hawkbit_cancel_requested(hbc)) {
+				dl->download_status = -ECANCELED;
+				return hawkbit_download_end(hbc, 0);
+			}
+
+			hawkbit_report_progress(hbc);
+		}
 	}
-#endif
 
-	LOG_INF("Starting the download and flash process");
+	ret = hawkbit_download_segment(hbc);
+	if (ret < 0) {
+		dl->download_status = -1;
+		return hawkbit_download_end(hbc, ret);
+	}
 
-	/* Receive is special for download, since it writes to flash */
-	memset(hbc->tcp_buffer, 0, hbc->tcp_buffer_size);
-	memset(&hbc->dl, 0, sizeof(struct hawkbit_download));
-	/* reset download semaphore -- TODO is this really needed? */
-	k_sem_init(hbc->sem, 0, 1);
-	/* Re-initialize the flash writer state. */
-	flash_img_init(&dfu_ctx, flash_dev);
+	dl->pending = true;
+	return HAWKBIT_STEP_WAIT;
+}
 
-	ret = http_client_init(&hbc->http_ctx,
-			       HAWKBIT_SERVER_ADDR, HAWKBIT_PORT,
-			       NULL, HAWKBIT_RX_TIMEOUT);
-	if (ret < 0) {
-		LOG_ERR("Failed to init http ctx, err %d", ret);
-		return ret;
+/*
+ * Find where the download of an artifact starts: after what a previous
+ * attempt journaled, or at the beginning.
+ */
+static size_t hawkbit_resume_offset(s32_t action_id,
+				    const struct hawkbit_artifact *art)
+{
+	if (art->flags) {
+		return 0;
 	}
 
-#if defined(CONFIG_NET_CONTEXT_NET_PKT_POOL)
-	net_app_set_net_pkt_pool(&hbc->http_ctx.app_ctx, tx_slab, data_pool);
-#endif
+	return hawkbit_journal_resume(action_id, art->size, art->hashes.sha1);
+}
 
-	ret = http_client_send_get_req(&hbc->http_ctx, download_http,
-				       HAWKBIT_HOST,
-				       HTTP_HEADER_CONNECTION_CLOSE_CRLF,
-				       install_update_cb,
-				       hbc->tcp_buffer,
-				       hbc->tcp_buffer_size,
-				       hbc, K_NO_WAIT);
-	/* http_client returns EINPROGRESS for get_req w/ K_NO_WAIT */
-	if (ret < 0 && ret != -EINPROGRESS) {
-		LOG_ERR("Failed to send request, err %d", ret);
-		return ret;
+/* Start an attempt at downloading the artifact, from dep->offset. */
+static int hawkbit_attempt_start(struct hawkbit_context *hbc)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	const struct hawkbit_artifact *art = &hbc->artifacts[dep->artifact];
+
+	/*
+	 * The hash restarts with each attempt, since a resumed
+	 * download may rewrite data past the last checkpoint.
+	 */
+	hawkbit_hash_start(&hbc->hash, &art->hashes);
+	hawkbit_img_check_start(hbc, art);
+	hawkbit_hash_slot1(hbc, dep->offset);
+	return hawkbit_download_start(hbc, art, dep->offset);
+}
+
+/* Start installing the deployment's artifact dep->artifact. */
+static int hawkbit_install_start(struct hawkbit_context *hbc)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	const struct hawkbit_artifact *art = &hbc->artifacts[dep->artifact];
+	s32_t action_id = hbc->action_id;
+	unsigned int flags = art->flags;
+	int ret;
+
+	if (!art->url || !art->size) {
+		return -EINVAL;
 	}
 
-	while (k_sem_take(hbc->sem, HAWKBIT_DOWNLOAD_TIMEOUT)) {
-		/* wait timeout: check for download activity */
-		if (last_downloaded_size == dl->downloaded_size) {
-			/* no activity: break loop */
-			break;
-		} else {
-			last_downloaded_size = dl->downloaded_size;
+	if (flags) {
+		LOG_INF("Downloading%s%s %s artifact for action %d",
+			flags & HAWKBIT_ARTIFACT_COMPRESSED ? " compressed" : "",
+			flags & HAWKBIT_ARTIFACT_DELTA ? " delta" : "",
+			art->part->name, action_id);
+	}
+	if (dep->offset) {
+		LOG_INF("Resuming download of action %d at offset %zu",
+			action_id, dep->offset);
+	} else if (!flags) {
+		ret = hawkbit_journal_start(action_id, art->size,
+					    art->hashes.sha1);
+		if (ret) {
+			/* We can still download; we just can't resume. */
+			LOG_WRN("Can't start download journal: %d", ret);
 		}
 	}
 
-	/* clean up context */
-	http_release(&hbc->http_ctx);
+	dep->start_ms = k_uptime_get_32();
+	dep->start_offset = dep->offset;
+	dep->attempt = 0;
+	return hawkbit_attempt_start(hbc);
+}
 
-	if (dl->download_status < 0) {
-		LOG_ERR("Unable to finish the download process %d",
-			dl->download_status);
+/*
+ * Check the artifact once its download is over, with "ret" from
+ * hawkbit_download_end(), and verify its hash.
+ */
+static int hawkbit_install_finish(struct hawkbit_context *hbc, int ret)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	const struct hawkbit_artifact *art = &hbc->artifacts[dep->artifact];
+	struct hawkbit_download *dl = &hbc->dl;
+	size_t file_size = art->size;
+
+	if (ret == -ECANCELED) {
+		return ret;
+	} else if (ret == -EBADMSG) {
+		hawkbit_journal_clear();
+		return -1;
+	} else if (ret < 0) {
+		/* The journal is kept, so the next poll can resume. */
 		return -1;
 	}
 
@@ -725,6 +3497,7 @@ static int hawkbit_install_update(struct hawkbit_context *hbc,
 		LOG_ERR("Download: downloaded image size mismatch, "
 			"downloaded %zu, expecting %zu",
 			dl->downloaded_size, dl->http_content_size);
+		hawkbit_journal_clear();
 		return -1;
 	}
 
@@ -732,15 +3505,278 @@ static int hawkbit_install_update(struct hawkbit_context *hbc,
 		LOG_ERR("Download: downloaded image size mismatch, "
 			"downloaded %zu, expecting from JSON %zu",
 			dl->downloaded_size, file_size);
+		hawkbit_journal_clear();
+		return -1;
+	}
+
+	if (hawkbit_flash_written(hbc) != hawkbit_image_size(hbc, file_size)) {
+		LOG_ERR("Download: written image size mismatch, "
+			"wrote %zu, expecting %zu",
+			hawkbit_flash_written(hbc),
+			hawkbit_image_size(hbc, file_size));
+		hawkbit_journal_clear();
 		return -1;
 	}
 
+#if !defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
+	/* The image trailer must be erased before requesting the upgrade */
+	if (!(art->flags & HAWKBIT_ARTIFACT_DATA) &&
+	    hawkbit_erase_to(hbc, SLOT1_END)) {
+		return -1;
+	}
+#endif
+
+	hawkbit_journal_clear();
 	LOG_INF("Download: downloaded bytes %zu", dl->downloaded_size);
+	hawkbit_hash_benchmark(&hbc->hash,
+			       dl->downloaded_size - dep->start_offset,
+			       k_uptime_get_32() - dep->start_ms);
+
+	return hawkbit_hash_verify(&hbc->hash, &art->hashes);
+}
+
+/*
+ * JSON decoding helpers, called from json_stream as responses arrive.
+ */
+
+static const char *hawkbit_json_strdup(struct hawkbit_context *hbc,
+				       const char *str, size_t len)
+{
+	char *ret = hbc->json_strings + hbc->json_strings_used;
+
+	if (len + 1 > sizeof(hbc->json_strings) - hbc->json_strings_used) {
+		return NULL;
+	}
+
+	memcpy(ret, str, len + 1);
+	hbc->json_strings_used += len + 1;
+	return ret;
+}
+
+static int hawkbit_json_set(struct hawkbit_context *hbc, void *res,
+			    const struct hawkbit_json_field *fields,
+			    size_t num_fields, const char *path,
+			    const struct json_stream_value *val)
+{
+	const struct hawkbit_json_field *field = NULL;
+	u8_t *dst;
+	size_t i;
+
+	for (i = 0; i < num_fields; i++) {
+		if (!strcmp(fields[i].path, path)) {
+			field = &fields[i];
+			break;
+		}
+	}
+
+	if (!field || val->type == JSON_TOK_NULL) {
+		return 0;
+	} else if (val->type != field->type) {
+		LOG_ERR("unexpected type for %s", val->path);
+		return -EINVAL;
+	} else if (val->truncated) {
+		LOG_ERR("%s is too long", val->path);
+		return -ENOMEM;
+	}
+
+	dst = (u8_t *)res + field->offset;
+	if (field->type == JSON_TOK_NUMBER) {
+		*(s32_t *)dst = strtol(val->str, NULL, 10);
+		return 0;
+	}
+
+	*(const char **)dst = hawkbit_json_strdup(hbc, val->str, val->len);
+	if (!*(const char **)dst) {
+		LOG_ERR("no room to store %s", val->path);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
+static int hawkbit_ctl_res_cb(struct json_stream *js,
+			      const struct json_stream_value *val,
+			      void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+
+	return hawkbit_json_set(hbc, hbc->json_res, json_ctl_res_fields,
+				ARRAY_SIZE(json_ctl_res_fields),
+				val->path, val);
+}
+
+static int hawkbit_dep_res_cb(struct json_stream *js,
+			      const struct json_stream_value *val,
+			      void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+	struct hawkbit_dep_res *res = hbc->json_res;
+	struct hawkbit_dep_res_chunk *chunk;
+	const char *path = val->path;
+	int c, a;
+
+	if (strncmp(path, JSON_DEP_RES_CHUNK_PATH,
+		    strlen(JSON_DEP_RES_CHUNK_PATH))) {
+		return hawkbit_json_set(hbc, res, json_dep_res_fields,
+					ARRAY_SIZE(json_dep_res_fields),
+					path, val);
+	}
+
+	/*
+	 * Count every chunk and artifact we see, even those we have
+	 * no room for, so hawkbit_parse_deployment() can reject them.
+	 */
+	c = json_stream_index(js, 0);
+	res->deployment.num_chunks = MAX(res->deployment.num_chunks,
+					 (size_t)c + 1);
+	if (c >= HAWKBIT_DEP_MAX_CHUNKS) {
+		return 0;
+	}
+	chunk = &res->deployment.chunks[c];
+
+	if (strncmp(path, JSON_DEP_RES_ARTS_PATH,
+		    strlen(JSON_DEP_RES_ARTS_PATH))) {
+		return hawkbit_json_set(hbc, chunk, json_dep_res_chunk_fields,
+					ARRAY_SIZE(json_dep_res_chunk_fields),
+					path + strlen(JSON_DEP_RES_CHUNK_PATH),
+					val);
+	}
+
+	a = json_stream_index(js, 1);
+	chunk->num_artifacts = MAX(chunk->num_artifacts, (size_t)a + 1);
+	if (a >= HAWKBIT_DEP_MAX_CHUNK_ARTS) {
+		return 0;
+	}
+
+	return hawkbit_json_set(hbc, &chunk->artifacts[a],
+				json_dep_res_arts_fields,
+				ARRAY_SIZE(json_dep_res_arts_fields),
+				path + strlen(JSON_DEP_RES_ARTS_PATH), val);
+}
+
+static int hawkbit_cancel_res_cb(struct json_stream *js,
+				 const struct json_stream_value *val,
+				 void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+
+	return hawkbit_json_set(hbc, hbc->json_res, json_cancel_fields,
+				ARRAY_SIZE(json_cancel_fields),
+				val->path, val);
+}
+
+/* Remember a response's ETag and Last-Modified for the next poll. */
+static void hawkbit_save_validators(struct hawkbit_context *hbc,
+				    struct http_ctx *ctx, size_t data_len)
+{
+	u8_t *hdrs = ctx->http.rsp.response_buf;
+	size_t len = data_len;
+
+	if (ctx->http.rsp.body_found && ctx->http.rsp.body_start) {
+		len = ctx->http.rsp.body_start - hdrs;
+	}
+
+	if (!hawkbit_find_header(hdrs, len, "ETag", hbc->etag,
+				 sizeof(hbc->etag))) {
+		hbc->etag[0] = '\0';
+	}
+	if (!hawkbit_find_header(hdrs, len, "Last-Modified",
+				 hbc->last_modified,
+				 sizeof(hbc->last_modified))) {
+		hbc->last_modified[0] = '\0';
+	}
+}
+
+/*
+ * Set the time of day from the "hh:mm:ss" in the Date header among the
+ * "len" bytes of HTTP headers at "hdrs".
+ */
+static void hawkbit_save_date(struct hawkbit_context *hbc,
+			      const u8_t *hdrs, size_t len)
+{
+	char date[HAWKBIT_DATE_SIZE];
+	const char *t;
+
+	if (!hawkbit_find_header(hdrs, len, "Date", date, sizeof(date))) {
+		return;
+	}
+
+	t = strchr(date, ':');
+	if (!t || t - date < 2 || strlen(t) < 6 || t[3] != ':' ||
+	    !isdigit(t[-2]) || !isdigit(t[-1]) || !isdigit(t[1]) ||
+	    !isdigit(t[2]) || !isdigit(t[4]) || !isdigit(t[5])) {
+		LOG_DBG("Ignoring Date: %s", date);
+		return;
+	}
+
+	hbc->date_sod = ((t[-2] - '0') * 10 + t[-1] - '0') * 3600 +
+		((t[1] - '0') * 10 + t[2] - '0') * 60 +
+		(t[4] - '0') * 10 + t[5] - '0';
+	hbc->date_ms = k_uptime_get_32();
+}
+
+/* http_client response callback which feeds the body to hbc->json. */
+static void hawkbit_json_recv_cb(struct http_ctx *ctx,
+				 u8_t *data, size_t data_size,
+				 size_t data_len,
+				 enum http_final_call final_data,
+				 void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+	u8_t *body_data = data;
+	size_t body_len = data_len;
+
+	/* A 304 Not Modified leaves the validators we have alone. */
+	if (hbc->json_validators) {
+		if (ctx->http.parser.status_code == 200) {
+			hawkbit_save_validators(hbc, ctx, data_len);
+		}
+		hbc->json_validators = false;
+	}
+
+	/* Error responses are handled in hawkbit_query(). */
+	if (ctx->http.parser.status_code != 200) {
+		return;
+	}
+
+	/* The first call also contains the HTTP headers. */
+	if (!hbc->json_body) {
+		if (!ctx->http.rsp.body_found || !ctx->http.rsp.body_start) {
+			return;
+		}
+
+		body_data = ctx->http.rsp.body_start;
+		body_len -= ctx->http.rsp.body_start -
+			    ctx->http.rsp.response_buf;
+		hbc->json_body = true;
+		hawkbit_save_date(hbc, ctx->http.rsp.response_buf,
+				  data_len - body_len);
+	}
+
+#ifdef HAWKBIT_EXTRA_DEBUG
+	LOG_HEXDUMP_DBG(body_data, body_len, "JSON DATA:");
+#endif
+
+	json_stream_feed(&hbc->json, body_data, body_len);
+}
+
+/*
+ * Send hbc->http_req and wait for the response.
+ *
+ * If json_cb is not NULL, the response body is decoded into json_res
+ * as it arrives; json_cb must be one of the hawkbit_*_res_cb()
+ * callbacks above, and json_res the corresponding structure, which
+ * the caller must zero out first. Any strings in the result remain
+ * valid until the next query which decodes a response into a
+ * json_res. A json_cb which keeps no strings may be used with a NULL
+ * json_res, to peek at a response while those strings are in use.
+ *
+ * Returns -EBADMSG if the response could not be decoded, and
+ * HAWKBIT_NOT_MODIFIED if the server answered a conditional request
+ * with 304 Not Modified.
+ */
 static int hawkbit_query(struct hawkbit_context *hbc,
-			 struct json_data_t *json)
+			 json_stream_cb_t json_cb, void *json_res)
 {
 	int ret = 0;
 
@@ -748,35 +3784,44 @@ static int hawkbit_query(struct hawkbit_context *hbc,
 		http_method_str(hbc->http_req.method),
 		hbc->http_req.host, hbc->http_req.url);
 
-	memset(hbc->tcp_buffer, 0, hbc->tcp_buffer_size);
-
-	ret = http_client_init(&hbc->http_ctx,
-			       HAWKBIT_SERVER_ADDR, HAWKBIT_PORT,
-			       NULL, HAWKBIT_RX_TIMEOUT);
-	if (ret < 0) {
-		LOG_ERR("Failed to init http ctx, err %d", ret);
-		return ret;
-	}
-
-#if defined(CONFIG_NET_CONTEXT_NET_PKT_POOL)
-	net_app_set_net_pkt_pool(&hbc->http_ctx.app_ctx, tx_slab, data_pool);
-#endif
+	memset(hbc->tcp_buffer, 0, hbc->tcp_buffer_size);
+	hbc->json_res = json_res;
+	hbc->json_body = false;
+	if (json_res) {
+		hbc->json_strings_used = 0;
+	}
+	if (json_cb) {
+		json_stream_init(&hbc->json, json_cb, hbc);
+	}
 
-	ret = http_client_send_req(&hbc->http_ctx, &hbc->http_req, NULL,
-				   hbc->tcp_buffer, hbc->tcp_buffer_size,
-				   NULL, HAWKBIT_RX_TIMEOUT);
+	ret = hawkbit_send_req(hbc, NULL,
+			       json_cb ? hawkbit_json_recv_cb : NULL,
+			       HAWKBIT_RX_TIMEOUT);
 	if (ret < 0) {
 		LOG_ERR("Failed to send buffer, err %d", ret);
 		goto cleanup;
 	}
 
-	if (hbc->http_ctx.http.rsp.data_len == 0) {
+	if (!json_cb && hbc->http_ctx.http.rsp.data_len == 0) {
 		LOG_ERR("No received data (rsp.data_len: %zu)",
 			hbc->http_ctx.http.rsp.data_len);
 		ret = -EIO;
 		goto cleanup;
 	}
 
+	if (hbc->http_ctx.http.parser.status_code == 304) {
+		LOG_DBG("Not modified");
+		ret = HAWKBIT_NOT_MODIFIED;
+		goto cleanup;
+	}
+
+	if (hbc->http_ctx.http.parser.status_code == 429 ||
+	    hbc->http_ctx.http.parser.status_code == 503) {
+		hawkbit_save_retry_after(hbc,
+					 hbc->http_ctx.http.rsp.response_buf,
+					 hbc->http_ctx.http.rsp.data_len);
+	}
+
 	if (hbc->http_ctx.http.parser.status_code != 200) {
 		LOG_ERR("Invalid HTTP status code [%d]",
 			hbc->http_ctx.http.parser.status_code);
@@ -784,24 +3829,19 @@ static int hawkbit_query(struct hawkbit_context *hbc,
 		goto cleanup;
 	}
 
-	if (json) {
-		json->data = hbc->http_ctx.http.rsp.body_start;
-		json->len = strlen(hbc->http_ctx.http.rsp.response_buf);
-		json->len -= hbc->http_ctx.http.rsp.body_start -
-			     hbc->http_ctx.http.rsp.response_buf;
-
-		/* FIXME: Each poll needs a new connection, this saves
-		 * us from using content from a previous package.
-		 */
-		json->data[json->len] = '\0';
-		LOG_DBG("JSON DATA:\n%s", json->data);
+	if (json_cb) {
+		ret = json_stream_finish(&hbc->json);
+		if (ret < 0) {
+			LOG_ERR("JSON parse error %d", ret);
+			ret = -EBADMSG;
+			goto cleanup;
+		}
 	}
 
 	LOG_DBG("Hawkbit query completed");
 
 cleanup:
-	/* clean up context */
-	http_release(&hbc->http_ctx);
+	hawkbit_conn_done(hbc, ret);
 	return ret;
 }
 
@@ -821,6 +3861,10 @@ static void hawkbit_update_sleep(struct hawkbit_ctl_res *hawkbit_res)
 		if (len > 0 && poll_sleep != K_SECONDS(len)) {
 			LOG_INF("New poll sleep %d seconds", len);
 			poll_sleep = K_SECONDS(len);
+			/* Start off with it after a reboot, too. */
+			state_store_write(&state_store,
+					  HAWKBIT_STATE_POLL_SLEEP,
+					  &poll_sleep, sizeof(poll_sleep));
 		}
 	}
 }
@@ -864,12 +3908,12 @@ static int hawkbit_report_config_data(struct hawkbit_context *hbc)
 	hbc->http_req.url = hbc->url_buffer;
 	hbc->http_req.host = HAWKBIT_HOST;
 	hbc->http_req.protocol = " " HTTP_PROTOCOL;
-	hbc->http_req.header_fields = HTTP_HEADER_CONNECTION_CLOSE_CRLF;
+	hbc->http_req.header_fields = HAWKBIT_HEADER_FIELDS;
 	hbc->http_req.content_type_value = "application/json";
 	hbc->http_req.payload = hbc->status_buffer;
 	hbc->http_req.payload_size = strlen(hbc->status_buffer);
 
-	if (hawkbit_query(hbc, NULL)) {
+	if (hawkbit_query(hbc, NULL, NULL)) {
 		LOG_ERR("Error when reporting config data to Hawkbit");
 		return -1;
 	}
@@ -915,19 +3959,122 @@ static int hawkbit_find_deployment_base(struct hawkbit_ctl_res *res,
 /*
  * Parse the results of polling the deployment operations resource.
  */
-static int hawkbit_parse_deployment(struct hawkbit_dep_res *res,
-				    int *json_acid,
-				    char *download_http,
-				    size_t download_http_size,
-				    s32_t *file_size)
+static const struct hawkbit_part *hawkbit_find_part(const char *name)
 {
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hawkbit_parts); i++) {
+		if (!strcmp(hawkbit_parts[i].name, name)) {
+			return &hawkbit_parts[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue up an artifact which is written to "part", starting at flash
+ * offset "offset".
+ */
+static int hawkbit_parse_artifact(struct hawkbit_dep_res_arts *artifact,
+				  const struct hawkbit_part *part,
+				  off_t offset, struct hawkbit_artifact *art)
+{
+	struct hawkbit_host host;
 	const char *href;
 	const char *helper;
-	size_t len;
+	size_t room = part->offset + part->size - offset;
+	s32_t size;
+
+	memset(art, 0, sizeof(*art));
+	art->part = part;
+	art->offset = offset;
+	art->flags = part->flags;
+#if defined(CONFIG_FOTA_COMPRESSED_UPDATE)
+	/* Only the firmware image can be compressed. */
+	if (!(part->flags & HAWKBIT_ARTIFACT_DATA) && artifact->filename &&
+	    strlen(artifact->filename) > strlen(HAWKBIT_COMPRESSED_SUFFIX) &&
+	    !strcmp(artifact->filename + strlen(artifact->filename) -
+		    strlen(HAWKBIT_COMPRESSED_SUFFIX),
+		    HAWKBIT_COMPRESSED_SUFFIX)) {
+		art->flags |= HAWKBIT_ARTIFACT_COMPRESSED;
+	}
+#endif
+	/*
+	 * For compressed artifacts and delta patches, this just rules
+	 * out the obviously too big; the size of the image they expand
+	 * to is checked against FLASH_BANK_SIZE while downloading.
+	 */
+	size = artifact->size;
+	if (size < 0 || (size_t)size > room) {
+		LOG_ERR("%s artifact file size too big (got %d, max is %zu)",
+			part->name, size, room);
+		return -ENOSPC;
+	}
+	art->size = size;
+	/*
+	 * Find the download-http href. Links into the DEFAULT tenant's
+	 * controller resources are taken to be on the hawkBit server
+	 * (or its download mirrors), whatever host they name; other
+	 * http URLs are downloaded from the host they name.
+	 */
+	href = artifact->_links.download_http.href;
+	if (!href) {
+		LOG_ERR("missing expected download-http href");
+		return -EINVAL;
+	}
+	helper = strstr(href, "/DEFAULT/controller/v1");
+	if (helper) {
+		art->url = helper;
+	} else if (hawkbit_parse_url(href, &host)) {
+		art->url = href;
+	} else {
+		LOG_ERR("unexpected download-http href format: %s", href);
+		return -EINVAL;
+	}
+	/*
+	 * The SHA-1 identifies the artifact in the download journal,
+	 * and the artifact is verified against the SHA-256 or SHA-1.
+	 * It's not an error if the server doesn't provide them.
+	 */
+	if (artifact->hashes.sha1 &&
+	    hex2bin_n(artifact->hashes.sha1, art->hashes.sha1,
+		      sizeof(art->hashes.sha1))) {
+		LOG_WRN("ignoring malformed sha1 %s", artifact->hashes.sha1);
+		memset(art->hashes.sha1, 0, sizeof(art->hashes.sha1));
+	}
+	if (artifact->hashes.sha256 &&
+	    hex2bin_n(artifact->hashes.sha256, art->hashes.sha256,
+		      sizeof(art->hashes.sha256))) {
+		LOG_WRN("ignoring malformed sha256 %s",
+			artifact->hashes.sha256);
+		memset(art->hashes.sha256, 0, sizeof(art->hashes.sha256));
+	}
+
+	return 0;
+}
+
+/*
+ * Queue up every artifact in a deployment in hbc->artifacts. There
+ * may be at most one firmware image, which is queued first, since its
+ * download journal would be cleared by the others; chunks with
+ * secondary payloads follow in the order the server lists them.
+ *
+ * The queued artifacts' URLs point into the decoded response, so they
+ * are valid until the next query which decodes one.
+ */
+static int hawkbit_parse_deployment(struct hawkbit_context *hbc,
+				    struct hawkbit_dep_res *res,
+				    int *json_acid)
+{
 	struct hawkbit_dep_res_chunk *chunk;
-	struct hawkbit_dep_res_arts *artifact;
+	const struct hawkbit_part *part;
+	struct hawkbit_artifact *art, tmp;
 	size_t num_chunks, num_artifacts;
-	s32_t acid, size;
+	bool image = false;
+	s32_t acid;
+	off_t offset;
+	int c, a, ret;
 
 	acid = strtol(res->id, NULL, 10);
 	if (acid < 0) {
@@ -935,55 +4082,142 @@ static int hawkbit_parse_deployment(struct hawkbit_dep_res *res,
 		return -EINVAL;
 	}
 	*json_acid = acid;
+	hbc->num_artifacts = 0;
 	num_chunks = res->deployment.num_chunks;
-	if (num_chunks != 1) {
-		LOG_ERR("expecting one chunk (got %d)", num_chunks);
+	if (num_chunks == 0 || num_chunks > HAWKBIT_DEP_MAX_CHUNKS) {
+		LOG_ERR("expecting 1 to %d chunks (got %d)",
+			HAWKBIT_DEP_MAX_CHUNKS, num_chunks);
 		return -ENOSPC;
 	}
-	chunk = &res->deployment.chunks[0];
-	if (strcmp("os", chunk->part)) {
-		LOG_ERR("only part 'os' is supported; got %s", chunk->part);
-		return -EINVAL;
+	for (c = 0; c < num_chunks; c++) {
+		chunk = &res->deployment.chunks[c];
+		if (!chunk->part) {
+			LOG_ERR("missing chunk part");
+			return -EINVAL;
+		}
+		part = hawkbit_find_part(chunk->part);
+		if (!part) {
+			LOG_ERR("unsupported part %s", chunk->part);
+			return -EINVAL;
+		} else if (!part->size) {
+			continue;
+		}
+		num_artifacts = chunk->num_artifacts;
+		if (num_artifacts == 0 ||
+		    num_artifacts > HAWKBIT_DEP_MAX_CHUNK_ARTS) {
+			LOG_ERR("expecting 1 to %d artifacts in %s (got %d)",
+				HAWKBIT_DEP_MAX_CHUNK_ARTS, chunk->part,
+				num_artifacts);
+			return -EINVAL;
+		}
+		if (!(part->flags & HAWKBIT_ARTIFACT_DATA)) {
+			if (image || num_artifacts != 1) {
+				LOG_ERR("expecting one firmware image");
+				return -EINVAL;
+			}
+			image = true;
+		}
+
+		offset = part->offset;
+		for (a = 0; a < num_artifacts; a++) {
+			art = &hbc->artifacts[hbc->num_artifacts];
+			ret = hawkbit_parse_artifact(&chunk->artifacts[a], part,
+						     offset, art);
+			if (ret) {
+				return ret;
+			}
+			hbc->num_artifacts++;
+			offset += ROUND_UP(art->size, FLASH_ERASE_BLOCK_SIZE);
+		}
 	}
-	num_artifacts = chunk->num_artifacts;
-	if (num_artifacts != 1) {
-		LOG_ERR("expecting one artifact (got %d)", num_artifacts);
+
+	if (!hbc->num_artifacts) {
+		LOG_ERR("no artifacts for this device");
 		return -EINVAL;
 	}
-	artifact = &chunk->artifacts[0];
-	size = artifact->size;
-	if (size > FLASH_BANK_SIZE) {
-		LOG_ERR("artifact file size too big (got %d, max is %d)",
-			size, FLASH_BANK_SIZE);
-		return -ENOSPC;
+
+	for (a = 1; a < hbc->num_artifacts; a++) {
+		if (!(hbc->artifacts[a].flags & HAWKBIT_ARTIFACT_DATA)) {
+			tmp = hbc->artifacts[a];
+			memmove(&hbc->artifacts[1], &hbc->artifacts[0],
+				a * sizeof(tmp));
+			hbc->artifacts[0] = tmp;
+			break;
+		}
 	}
-	/*
-	 * Find the download-http href. We only support the DEFAULT
-	 * tenant on the same hawkBit server.
-	 */
-	href = artifact->_links.download_http.href;
-	if (!href) {
-		LOG_ERR("missing expected download-http href");
+
+	/* Success. */
+	return 0;
+}
+
+/*
+ * Send feedback about an action to the feedback channel of "resource",
+ * which is "deploymentBase" or "cancelAction". "progress" may be NULL.
+ */
+static int hawkbit_report_fbk(struct hawkbit_context *hbc,
+			      const char *resource, s32_t action_id,
+			      enum hawkbit_status_fini finished,
+			      enum hawkbit_status_exec execution,
+			      const struct hawkbit_status_progress *progress)
+{
+	const struct product_id_t *product_id = product_id_get();
+	struct hawkbit_dep_fbk feedback;
+	char acid[11]; /* This is large enough for a 32 bit integer. */
+	const char *fini = hawkbit_status_finished(finished);
+	const char *exec = hawkbit_status_execution(execution);
+	const struct json_obj_descr *descr = json_dep_fbk_descr;
+	size_t descr_len = ARRAY_SIZE(json_dep_fbk_descr);
+	int ret;
+
+	if (!fini || !exec) {
 		return -EINVAL;
 	}
-	helper = strstr(href, "/DEFAULT/controller/v1");
-	if (!helper) {
-		LOG_ERR("unexpected download-http href format: %s", helper);
-		return -EINVAL;
+
+	LOG_INF("Reporting %s feedback %s (%s) for action %d",
+		resource, fini, exec, action_id);
+
+	/* Build URL */
+	snprintk(hbc->url_buffer, hbc->url_buffer_size,
+		 "%s/%s-%x/%s/%d/feedback",
+		 HAWKBIT_JSON_URL, product_id->name, product_id->number,
+		 resource, action_id);
+
+	/* Build JSON */
+	memset(&feedback, 0, sizeof(feedback));
+	snprintk(acid, sizeof(acid), "%d", action_id);
+	feedback.id = acid;
+	feedback.status.result.finished = fini;
+	feedback.status.execution = exec;
+	if (progress) {
+		feedback.status.result.progress = *progress;
+		descr = json_dep_fbk_progress_descr;
+		descr_len = ARRAY_SIZE(json_dep_fbk_progress_descr);
 	}
-	len = strlen(helper);
-	if (len == 0) {
-		LOG_ERR("empty download-http");
-		return -EINVAL;
-	} else if (len > download_http_size - 1) {
-		LOG_ERR("download-http %s is too big (len: %zu, max: %zu)",
-			helper, len, download_http_size - 1);
-		return -ENOMEM;
+	ret = json_obj_encode_buf(descr, descr_len, &feedback,
+				  hbc->status_buffer,
+				  hbc->status_buffer_size - 1);
+	if (ret) {
+		LOG_ERR("Can't encode response: %d", ret);
+		return ret;
 	}
-	/* Success. */
-	strncpy(download_http, helper, download_http_size);
-	*file_size = size;
-	return 0;
+	LOG_DBG("JSON response: %s", hbc->status_buffer);
+
+	memset(&hbc->http_req, 0, sizeof(hbc->http_req));
+	hbc->http_req.method = HTTP_POST;
+	hbc->http_req.url = hbc->url_buffer;
+	hbc->http_req.host = HAWKBIT_HOST;
+	hbc->http_req.protocol = " " HTTP_PROTOCOL;
+	hbc->http_req.header_fields = HAWKBIT_HEADER_FIELDS;
+	hbc->http_req.content_type_value = "application/json";
+	hbc->http_req.payload = hbc->status_buffer;
+	hbc->http_req.payload_size = strlen(hbc->status_buffer);
+
+	ret = hawkbit_query(hbc, NULL, NULL);
+	if (ret) {
+		LOG_ERR("Failed to report %s feedback", resource);
+	}
+
+	return ret;
 }
 
 static int hawkbit_report_dep_fbk(struct hawkbit_context *hbc,
@@ -991,87 +4225,366 @@ static int hawkbit_report_dep_fbk(struct hawkbit_context *hbc,
 				  enum hawkbit_status_fini finished,
 				  enum hawkbit_status_exec execution)
 {
-	const struct product_id_t *product_id = product_id_get();
-	struct hawkbit_dep_fbk feedback;
-	char acid[11]; /* This is large enough for a 32 bit integer. */
-	const char *fini = hawkbit_status_finished(finished);
-	const char *exec = hawkbit_status_execution(execution);
-	int ret;
+	return hawkbit_report_fbk(hbc, "deploymentBase", action_id,
+				  finished, execution, NULL);
+}
+
+/*
+ * Between download segments, tell the server how far the download
+ * got, if it moved by at least CONFIG_FOTA_PROGRESS_FEEDBACK_STEP
+ * percent in at least CONFIG_FOTA_PROGRESS_FEEDBACK_INTERVAL seconds.
+ * This goes over the download's connection. A failure to report is
+ * not a reason to stop downloading.
+ */
+static void hawkbit_report_progress(struct hawkbit_context *hbc)
+{
+#if defined(CONFIG_FOTA_PROGRESS_FEEDBACK)
+	struct hawkbit_download *dl = &hbc->dl;
+	struct hawkbit_status_progress progress;
+
+	if (dl->download_progress - dl->reported_progress <
+	    CONFIG_FOTA_PROGRESS_FEEDBACK_STEP ||
+	    k_uptime_get_32() - dl->reported_ms <
+	    K_SECONDS(CONFIG_FOTA_PROGRESS_FEEDBACK_INTERVAL)) {
+		return;
+	}
+
+	progress.cnt = dl->download_progress;
+	progress.of = 100;
+	hawkbit_report_fbk(hbc, "deploymentBase", hbc->action_id,
+			   HAWKBIT_STATUS_FINISHED_NONE,
+			   HAWKBIT_STATUS_EXEC_PROCEEDING, &progress);
+
+	dl->reported_progress = dl->download_progress;
+	dl->reported_ms = k_uptime_get_32();
+#endif
+}
+
+/* Did the server turn the last request down for good? */
+static bool hawkbit_request_refused(struct hawkbit_context *hbc)
+{
+	unsigned int status = hbc->http_ctx.http.parser.status_code;
+
+	return status >= 400 && status < 500 && status != 429;
+}
+
+/*
+ * Deliver what's in the outbox, oldest first, stopping at the first
+ * failure. Feedback the server refuses, say for an action it already
+ * closed, is dropped rather than retried forever.
+ */
+static int hawkbit_outbox_flush(struct hawkbit_context *hbc)
+{
+	struct hawkbit_outbox_rec *rec = &outbox.recs[0];
+	bool changed = false;
+	int ret = 0;
+	int i;
+
+	if (outbox.config_data) {
+		hbc->http_ctx.http.parser.status_code = 0;
+		ret = hawkbit_report_config_data(hbc);
+		if (ret && !hawkbit_request_refused(hbc)) {
+			return ret;
+		}
+		outbox.config_data = 0;
+	}
+
+	for (i = 0; i < HAWKBIT_OUTBOX_RECORDS && rec->action_id >= 0; i++) {
+		if (rec->resource < ARRAY_SIZE(hawkbit_outbox_resources)) {
+			hbc->http_ctx.http.parser.status_code = 0;
+			ret = hawkbit_report_fbk(
+				hbc, hawkbit_outbox_resources[rec->resource],
+				rec->action_id, rec->finished,
+				rec->execution, NULL);
+			if (ret && !hawkbit_request_refused(hbc)) {
+				break;
+			} else if (ret) {
+				LOG_WRN("Server refused feedback for action %d",
+					rec->action_id);
+			}
+		}
+
+		memmove(&outbox.recs[0], &outbox.recs[1],
+			(HAWKBIT_OUTBOX_RECORDS - 1) * sizeof(*rec));
+		outbox.recs[HAWKBIT_OUTBOX_RECORDS - 1].action_id = -1;
+		changed = true;
+		ret = 0;
+	}
+
+	if (changed) {
+		hawkbit_outbox_save();
+	}
+	return ret;
+}
+
+/*
+ * Queue feedback closing an action and try to deliver it, along with
+ * anything else in the outbox. Even if this fails, the feedback is
+ * kept for the next poll.
+ */
+static int hawkbit_queue_fbk(struct hawkbit_context *hbc,
+			     enum hawkbit_outbox_resource resource,
+			     s32_t action_id,
+			     enum hawkbit_status_fini finished,
+			     enum hawkbit_status_exec execution)
+{
+	hawkbit_outbox_put(resource, action_id, finished, execution);
+	return hawkbit_outbox_flush(hbc);
+}
+
+static void hawkbit_forget_validators(struct hawkbit_context *hbc)
+{
+	hbc->etag[0] = '\0';
+	hbc->last_modified[0] = '\0';
+}
+
+/*
+ * Header fields for a base resource poll, which is conditional on it
+ * having changed if we have its validators.
+ */
+static const char *hawkbit_poll_header(struct hawkbit_context *hbc)
+{
+	char *hdr = hbc->poll_header;
+	size_t size = sizeof(hbc->poll_header);
+	int len = 0;
+
+	if (!IS_ENABLED(CONFIG_FOTA_CONDITIONAL_POLL) ||
+	    (!hbc->etag[0] && !hbc->last_modified[0])) {
+		return HAWKBIT_HEADER_FIELDS;
+	}
+
+	if (hbc->etag[0]) {
+		len += snprintk(hdr + len, size - len,
+				HTTP_HEADER_IF_NONE_MATCH_FMT_CRLF, hbc->etag);
+	}
+	if (hbc->last_modified[0]) {
+		len += snprintk(hdr + len, size - len,
+				HTTP_HEADER_IF_MODIFIED_SINCE_FMT_CRLF,
+				hbc->last_modified);
+	}
+#if !defined(CONFIG_FOTA_HTTP_KEEPALIVE)
+	snprintk(hdr + len, size - len, HTTP_HEADER_CONNECTION_CLOSE_CRLF);
+#endif
+
+	return hdr;
+}
+
+/*
+ * Get the action ID from an href to "resource" (like "deploymentBase"
+ * or "cancelAction"), or -1.
+ */
+static s32_t hawkbit_href_acid(const char *href, const char *resource)
+{
+	const char *id = strstr(href, resource);
+	char *end;
+	long acid;
+
+	if (!id || id[strlen(resource)] != '/') {
+		return -1;
+	}
+
+	id += strlen(resource) + 1;
+	acid = strtol(id, &end, 10);
+	if (end == id || acid < 0) {
+		return -1;
+	}
+
+	return acid;
+}
+
+/*
+ * Cancelation.
+ *
+ * The server cancels an action by replacing the deploymentBase link
+ * in the base resource with a cancelAction one. Between download
+ * segments, hawkbit_cancel_requested() polls the base resource for
+ * that, at most once per poll interval; the response is only peeked
+ * at, since hbc->json_strings still holds the artifact URLs, and its
+ * validators are left for the next full poll.
+ */
+
+static int hawkbit_cancel_check_cb(struct json_stream *js,
+				   const struct json_stream_value *val,
+				   void *user_data)
+{
+	struct hawkbit_context *hbc = user_data;
+
+	if (val->type == JSON_TOK_STRING && !val->truncated &&
+	    !strcmp(val->path, "_links.cancelAction.href")) {
+		hbc->cancel_acid = hawkbit_href_acid(val->str,
+						     "cancelAction");
+	}
+
+	return 0;
+}
+
+static bool hawkbit_cancel_requested(struct hawkbit_context *hbc)
+{
+	const struct product_id_t *product_id = product_id_get();
+	int ret;
+
+	if (k_uptime_get_32() - hbc->base_poll_ms < (u32_t)poll_sleep) {
+		return false;
+	}
+	hbc->base_poll_ms = k_uptime_get_32();
+
+	LOG_DBG("Checking whether action %d was canceled", hbc->action_id);
+
+	snprintk(hbc->url_buffer, hbc->url_buffer_size, "%s/%s-%x",
+		 HAWKBIT_JSON_URL, product_id->name, product_id->number);
+
+	memset(&hbc->http_req, 0, sizeof(hbc->http_req));
+	hbc->http_req.method = HTTP_GET;
+	hbc->http_req.url = hbc->url_buffer;
+	hbc->http_req.host = HAWKBIT_HOST;
+	hbc->http_req.protocol = " " HTTP_PROTOCOL;
+	hbc->http_req.header_fields = hawkbit_poll_header(hbc);
+
+	/* Carry on downloading if the server can't tell us. */
+	hbc->cancel_acid = -1;
+	ret = hawkbit_query(hbc, hawkbit_cancel_check_cb, NULL);
+	if (ret < 0) {
+		return false;
+	}
+
+	return hbc->cancel_acid >= 0 && hbc->cancel_acid == hbc->action_id;
+}
+
+/*
+ * Act on the server's request to cancel action "action_id": find out
+ * which action to stop, drop its download journal and confirm. We
+ * always can, since nothing is installed before the reboot into a
+ * new image.
+ *
+ * Returns the ID of the stopped action, or a negative errno.
+ */
+static s32_t hawkbit_cancel_action(struct hawkbit_context *hbc,
+				   s32_t action_id)
+{
+	const struct product_id_t *product_id = product_id_get();
+	struct hawkbit_cancel cancel;
+	s32_t stop_acid = action_id;
+	char *end;
+	int ret;
+
+	LOG_INF("Canceling action %d", action_id);
+
+	snprintk(hbc->url_buffer, hbc->url_buffer_size,
+		 "%s/%s-%x/cancelAction/%d",
+		 HAWKBIT_JSON_URL, product_id->name, product_id->number,
+		 action_id);
+
+	memset(&hbc->http_req, 0, sizeof(hbc->http_req));
+	hbc->http_req.method = HTTP_GET;
+	hbc->http_req.url = hbc->url_buffer;
+	hbc->http_req.host = HAWKBIT_HOST;
+	hbc->http_req.protocol = " " HTTP_PROTOCOL;
+	hbc->http_req.header_fields = HAWKBIT_HEADER_FIELDS;
+
+	memset(&cancel, 0, sizeof(cancel));
+	ret = hawkbit_query(hbc, hawkbit_cancel_res_cb, &cancel);
+	if (ret < 0) {
+		LOG_ERR("Error when querying cancelAction from Hawkbit");
+		return ret;
+	}
+
+	if (cancel.cancelAction.stopId) {
+		stop_acid = strtol(cancel.cancelAction.stopId, &end, 10);
+		if (end == cancel.cancelAction.stopId || *end ||
+		    stop_acid < 0) {
+			LOG_ERR("invalid stopId %s",
+				cancel.cancelAction.stopId);
+			return -EINVAL;
+		}
+	}
+
+	hawkbit_journal_clear();
+
+	/* If this doesn't get through now, it will with the next poll. */
+	hawkbit_queue_fbk(hbc, HAWKBIT_OUTBOX_CANCEL, action_id,
+			  HAWKBIT_STATUS_FINISHED_SUCCESS,
+			  HAWKBIT_STATUS_EXEC_CLOSED);
+
+	LOG_INF("Action %d canceled", stop_acid);
+	return stop_acid;
+}
+
+/*
+ * Download and install windows.
+ *
+ * Each is "len" minutes a day, from "start" minutes past midnight UTC.
+ * If it's closed, the next poll is due no later than when it opens.
+ */
+static bool hawkbit_in_window(struct hawkbit_context *hbc, int start, int len)
+{
+	s32_t now, since, wait;
 
-	if (!fini || !exec) {
-		return -EINVAL;
+	if (!len || len >= HAWKBIT_SECS_PER_DAY / 60) {
+		return true;
+	} else if (hbc->date_sod < 0) {
+		LOG_WRN("No time of day from the server");
+		return false;
 	}
 
-	LOG_INF("Reporting deployment feedback %s (%s) for action %d",
-		fini, exec, action_id);
+	now = (hbc->date_sod + (k_uptime_get_32() - hbc->date_ms) /
+	       MSEC_PER_SEC) % HAWKBIT_SECS_PER_DAY;
+	since = (now - start * 60 + HAWKBIT_SECS_PER_DAY) %
+		HAWKBIT_SECS_PER_DAY;
+	if (since < len * 60) {
+		return true;
+	}
 
-	/* Build URL */
-	snprintk(hbc->url_buffer, hbc->url_buffer_size,
-		 "%s/%s-%x/deploymentBase/%d/feedback",
-		 HAWKBIT_JSON_URL, product_id->name, product_id->number,
-		 action_id);
+	wait = K_SECONDS(HAWKBIT_SECS_PER_DAY - since);
+	if (!hbc->window_wait || wait < hbc->window_wait) {
+		hbc->window_wait = wait;
+	}
+	return false;
+}
 
-	/* Build JSON */
-	memset(&feedback, 0, sizeof(feedback));
-	snprintk(acid, sizeof(acid), "%d", action_id);
-	feedback.id = acid;
-	feedback.status.result.finished = fini;
-	feedback.status.execution = exec;
-	ret = json_obj_encode_buf(json_dep_fbk_descr,
-				  ARRAY_SIZE(json_dep_fbk_descr),
-				  &feedback, hbc->status_buffer,
-				  hbc->status_buffer_size - 1);
-	if (ret) {
-		LOG_ERR("Can't encode response: %d", ret);
-		return ret;
+/*
+ * May we download or install now, given the deployment's "download" or
+ * "update" type? Servers which don't say force it.
+ */
+static bool hawkbit_policy_allows(struct hawkbit_context *hbc,
+				  const char *type, int start, int len)
+{
+	if (!type || !strcmp(type, "forced")) {
+		return true;
+	} else if (!strcmp(type, "skip")) {
+		return false;
 	}
-	LOG_DBG("JSON response: %s", hbc->status_buffer);
 
-	memset(&hbc->http_req, 0, sizeof(hbc->http_req));
-	hbc->http_req.method = HTTP_POST;
-	hbc->http_req.url = hbc->url_buffer;
-	hbc->http_req.host = HAWKBIT_HOST;
-	hbc->http_req.protocol = " " HTTP_PROTOCOL;
-	hbc->http_req.header_fields = HTTP_HEADER_CONNECTION_CLOSE_CRLF;
-	hbc->http_req.content_type_value = "application/json";
-	hbc->http_req.payload = hbc->status_buffer;
-	hbc->http_req.payload_size = strlen(hbc->status_buffer);
+	return hawkbit_in_window(hbc, start, len);
+}
 
-	ret = hawkbit_query(hbc, NULL);
-	if (ret) {
-		LOG_ERR("Failed to report deployment feedback");
+/*
+ * Poll cycle steps.
+ *
+ * Each step does at most a few short requests, or, while downloading,
+ * moves the transfer on; it then sets the step to run next and
+ * returns to the work queue. See hawkbit_work_fn().
+ */
+
+/* Deliver whatever the last polls couldn't, first. */
+static int hawkbit_step_feedback(struct hawkbit_context *hbc)
+{
+	if (hawkbit_outbox_flush(hbc) < 0) {
+		LOG_WRN("Feedback outbox not delivered; will retry");
 	}
 
-	return ret;
+	hbc->step = HAWKBIT_STEP_POLL;
+	return HAWKBIT_STEP_NEXT;
 }
 
-static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
+/* Query the hawkBit base polling resource. */
+static int hawkbit_step_poll(struct hawkbit_context *hbc)
 {
-	/*
-	 * "Raw" decoded JSON objects.
-	 */
-	union {
-		struct hawkbit_ctl_res base; /* Base resource. */
-		struct hawkbit_dep_res dep;  /* Deployment operations. */
-	} hawkbit_results;
-	/*
-	 * Cached hawkBit base resource results.
-	 */
-	char deployment_base[40];	/* TODO: Find a better value */
-	char download_http[200];	/* TODO: Find a better value */
-	static s32_t json_acid;
-	s32_t file_size = 0;
-	/*
-	 * Etc.
-	 */
-	struct hawkbit_device_acid device_acid;
-	struct json_data_t json = { NULL, 0 };
+	struct hawkbit_ctl_res base;
+	char *deployment_base = hbc->deployment_base;
 	const struct product_id_t *product_id = product_id_get();
+	s32_t cancel_acid;
 	int ret;
 
-	/*
-	 * Query the hawkBit base polling resource.
-	 */
 	LOG_DBG("Polling target data from Hawkbit");
 
 	/* Build URL */
@@ -1083,52 +4596,71 @@ static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
 	hbc->http_req.url = hbc->url_buffer;
 	hbc->http_req.host = HAWKBIT_HOST;
 	hbc->http_req.protocol = " " HTTP_PROTOCOL;
-	hbc->http_req.header_fields = HTTP_HEADER_CONNECTION_CLOSE_CRLF;
-
-	ret = hawkbit_query(hbc, &json);
-	if (ret < 0) {
-		LOG_ERR("Error when polling from Hawkbit");
-		return ret;
-	}
+	hbc->http_req.header_fields = hawkbit_poll_header(hbc);
 
 	/*
-	 * Decode the results from the base polling resource, finding
-	 * the hawkBit DDI v1 deployment base in the returned result.
+	 * The results from the base polling resource are decoded as
+	 * they arrive; the hawkBit DDI v1 deployment base is found in
+	 * the returned result below. If it didn't change since the
+	 * last poll, what we found then still holds.
 	 */
-	memset(&hawkbit_results.base, 0, sizeof(hawkbit_results.base));
-	ret = json_obj_parse(json.data, json.len, json_ctl_res_descr,
-			     ARRAY_SIZE(json_ctl_res_descr),
-			     &hawkbit_results.base);
+	memset(&base, 0, sizeof(base));
+	hbc->json_validators = true;
+	ret = hawkbit_query(hbc, hawkbit_ctl_res_cb, &base);
+	hbc->json_validators = false;
+	hbc->base_poll_ms = k_uptime_get_32();
 	if (ret < 0) {
-		LOG_ERR("JSON parse error %d polling base resource", ret);
+		LOG_ERR("Error when polling from Hawkbit");
 		return ret;
+	} else if (ret == HAWKBIT_NOT_MODIFIED) {
+		goto base_done;
 	}
 
 #ifdef HAWKBIT_EXTRA_DEBUG
-	hawkbit_dump_base(&hawkbit_results.base, "");
+	hawkbit_dump_base(&base, "");
 #endif
 
-	if (hawkbit_results.base.config.polling.sleep) {
+	if (base.config.polling.sleep) {
 		/* Update the sleep time. */
-		hawkbit_update_sleep(&hawkbit_results.base);
+		hawkbit_update_sleep(&base);
 	}
-	if (hawkbit_results.base._links.cancelAction.href) {
-		/* TODO: implement cancelAction logic. */
-		LOG_WRN("Ignoring cancelAction (href %s)",
-			hawkbit_results.base._links.cancelAction.href);
+	if (base._links.cancelAction.href) {
+		cancel_acid = hawkbit_href_acid(base._links.cancelAction.href,
+						"cancelAction");
+		if (cancel_acid < 0) {
+			LOG_ERR("missing cancelAction/ in href %s",
+				base._links.cancelAction.href);
+			ret = -EINVAL;
+		} else {
+			ret = hawkbit_cancel_action(hbc, cancel_acid);
+		}
+		if (ret < 0) {
+			hawkbit_forget_validators(hbc);
+			return ret;
+		}
+		/* There is no deployment base while this link is up. */
+		deployment_base[0] = '\0';
+		hbc->handled_acid = ret;
+		return 0;
 	}
-	ret = hawkbit_find_deployment_base(&hawkbit_results.base,
-					   deployment_base,
-					   sizeof(deployment_base));
+	/*
+	 * If we couldn't act on the results, the next poll must fetch
+	 * them again rather than get a 304.
+	 */
+	ret = hawkbit_find_deployment_base(&base, deployment_base,
+					   sizeof(hbc->deployment_base));
 	if (ret < 0) {
+		hawkbit_forget_validators(hbc);
 		return ret;
 	}
 
 	/* Provide this device's config data if the server asked for it. */
-	if (hawkbit_results.base._links.configData.href) {
-		hawkbit_report_config_data(hbc);
+	if (base._links.configData.href) {
+		outbox.config_data = 1;
+		hawkbit_outbox_flush(hbc);
 	}
 
+ base_done:
 	/*
 	 * If one was found, poll the deployment base discovered
 	 * earlier. If there was no deployment base, there is nothing
@@ -1139,7 +4671,58 @@ static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
 		return 0;
 	}
 
-	memset(&json, 0, sizeof(struct json_data_t));
+	hbc->step = HAWKBIT_STEP_DEPLOYMENT;
+	return HAWKBIT_STEP_NEXT;
+}
+
+/*
+ * The action is over: its closing feedback is delivered, or in the
+ * outbox, so remember not to redo it.
+ */
+static void hawkbit_action_closed(struct hawkbit_context *hbc,
+				  s32_t action_id)
+{
+	if (action_id == hbc->dep.href_acid) {
+		hbc->handled_acid = action_id;
+	}
+}
+
+static int hawkbit_action_failed(struct hawkbit_context *hbc,
+				 s32_t action_id, int ret)
+{
+	hawkbit_queue_fbk(hbc, HAWKBIT_OUTBOX_DEPLOYMENT, action_id,
+			  HAWKBIT_STATUS_FINISHED_FAILURE,
+			  HAWKBIT_STATUS_EXEC_CLOSED);
+	hawkbit_action_closed(hbc, action_id);
+	return ret;
+}
+
+/*
+ * Query the deployment base found by the poll, and decide what to do
+ * about it.
+ */
+static int hawkbit_step_deployment(struct hawkbit_context *hbc)
+{
+	struct hawkbit_dep_res res;
+	struct hawkbit_deployment *dep = &hbc->dep;
+	const char *deployment_base = hbc->deployment_base;
+	const struct product_id_t *product_id = product_id_get();
+	struct hawkbit_device_acid device_acid;
+	const struct hawkbit_artifact *art;
+	static s32_t json_acid;
+	bool download, staged;
+	int i, ret;
+
+	/*
+	 * The action ID is in the deployment base href. If we already
+	 * closed that action, don't fetch and decode it again.
+	 */
+	memset(dep, 0, sizeof(*dep));
+	dep->href_acid = hawkbit_href_acid(deployment_base, "deploymentBase");
+	if (dep->href_acid >= 0 && dep->href_acid == hbc->handled_acid) {
+		LOG_DBG("Action %d was already handled", dep->href_acid);
+		return 0;
+	}
 
 	/* Build URL: Hawkbit DDI v1 deploymentBase */
 	snprintk(hbc->url_buffer, hbc->url_buffer_size, "%s/%s-%x/%s",
@@ -1151,57 +4734,53 @@ static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
 	hbc->http_req.url = hbc->url_buffer;
 	hbc->http_req.host = HAWKBIT_HOST;
 	hbc->http_req.protocol = " " HTTP_PROTOCOL;
-	hbc->http_req.header_fields = HTTP_HEADER_CONNECTION_CLOSE_CRLF;
-
-	if (hawkbit_query(hbc, &json) < 0) {
-		LOG_ERR("Error when querying from Hawkbit");
-		return -1;
-	}
+	hbc->http_req.header_fields = HAWKBIT_HEADER_FIELDS;
 
 	/*
-	 * Decode results from the deployment operations resource.
+	 * Query and decode results from the deployment operations
+	 * resource.
 	 */
-
-	memset(&hawkbit_results.dep, 0, sizeof(hawkbit_results.dep));
-	ret = json_obj_parse(json.data, json.len, json_dep_res_descr,
-			     ARRAY_SIZE(json_dep_res_descr),
-			     &hawkbit_results.dep);
-	if (ret < 0) {
-		LOG_ERR("deploymentBase JSON parse error %d", ret);
-		goto report_error;
-	} else if (ret != (1 << ARRAY_SIZE(json_dep_res_descr)) - 1) {
-		LOG_ERR("deploymentBase JSON mismatch"
-			" (expected 0x%x, got 0x%x)",
-			(1 << ARRAY_SIZE(json_dep_res_descr)) - 1, ret);
-		ret = -EINVAL;
-		goto report_error;
+	memset(&res, 0, sizeof(res));
+	ret = hawkbit_query(hbc, hawkbit_dep_res_cb, &res);
+	if (ret == -EBADMSG) {
+		LOG_ERR("deploymentBase JSON parse error");
+		return hawkbit_action_failed(hbc, json_acid, ret);
+	} else if (ret < 0) {
+		LOG_ERR("Error when querying from Hawkbit");
+		return -1;
+	} else if (!res.id || !res.deployment.num_chunks) {
+		LOG_ERR("deploymentBase JSON mismatch (missing %s)",
+			res.id ? "chunks" : "id");
+		return hawkbit_action_failed(hbc, json_acid, -EINVAL);
 	}
 
 #ifdef HAWKBIT_EXTRA_DEBUG
-	hawkbit_dump_deployment(&hawkbit_results.dep, "");
+	hawkbit_dump_deployment(&res, "");
 #endif
 
-	ret = hawkbit_parse_deployment(&hawkbit_results.dep, &json_acid,
-				       download_http, sizeof(download_http),
-				       &file_size);
+	ret = hawkbit_parse_deployment(hbc, &res, &json_acid);
 	if (ret) {
-		goto report_error;
+		return hawkbit_action_failed(hbc, json_acid, ret);
 	}
 
-	/* TODO: handle download/update. */
 	LOG_DBG("action ID: %d", json_acid);
-	LOG_DBG("deployment: download %s, update %s (ignored)",
-		hawkbit_results.dep.deployment.download,
-		hawkbit_results.dep.deployment.update);
-	LOG_DBG("artifact address: %s", download_http);
-	LOG_DBG("artifact file size: %d", file_size);
+	LOG_DBG("deployment: download %s, update %s",
+		str_or_null(res.deployment.download),
+		str_or_null(res.deployment.update));
+	for (i = 0; i < hbc->num_artifacts; i++) {
+		art = &hbc->artifacts[i];
+		LOG_DBG("artifact %d: part %s, address %s, file size %d", i,
+			art->part->name, art->url, art->size);
+	}
 
 	hawkbit_device_acid_read(&device_acid);
 	if (device_acid.current == json_acid) {
 		/* We are coming from a successful flash, update the server */
-		ret = hawkbit_report_dep_fbk(hbc, json_acid,
-					     HAWKBIT_STATUS_FINISHED_SUCCESS,
-					     HAWKBIT_STATUS_EXEC_CLOSED);
+		ret = hawkbit_queue_fbk(hbc, HAWKBIT_OUTBOX_DEPLOYMENT,
+					json_acid,
+					HAWKBIT_STATUS_FINISHED_SUCCESS,
+					HAWKBIT_STATUS_EXEC_CLOSED);
+		hawkbit_action_closed(hbc, json_acid);
 		return ret;
 	}
 
@@ -1210,37 +4789,199 @@ static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
 	 */
 	if (device_acid.update == (u32_t)json_acid) {
 		LOG_ERR("Preventing repeated attempt to install %d", json_acid);
-		ret = -EALREADY;
-		goto report_error;
+		return hawkbit_action_failed(hbc, json_acid, -EALREADY);
+	}
+
+	/*
+	 * A firmware image may be downloaded ahead of its install, and
+	 * staged in slot1 until it's time. Data artifacts are installed
+	 * as they are written, so they have to wait, and so do direct-XIP
+	 * images, which MCUboot would run at the next reboot regardless.
+	 */
+	download = hawkbit_policy_allows(hbc, res.deployment.download,
+					 CONFIG_FOTA_DOWNLOAD_WINDOW_START,
+					 CONFIG_FOTA_DOWNLOAD_WINDOW_LENGTH);
+	dep->install = hawkbit_policy_allows(hbc, res.deployment.update,
+					     CONFIG_FOTA_INSTALL_WINDOW_START,
+					     CONFIG_FOTA_INSTALL_WINDOW_LENGTH);
+	/*
+	 * The server's own maintenance window must be open as well; a
+	 * later poll tells us when it is.
+	 */
+	if (res.deployment.maintenanceWindow &&
+	    !strcmp(res.deployment.maintenanceWindow, "unavailable")) {
+		LOG_INF("Server maintenance window is closed");
+		dep->install = false;
+	}
+	art = &hbc->artifacts[0];
+	staged = !(art->flags & HAWKBIT_ARTIFACT_DATA) &&
+		hawkbit_staged(json_acid, art);
+	if (!dep->install &&
+	    (staged || !download || hbc->num_artifacts > 1 ||
+	     (art->flags & HAWKBIT_ARTIFACT_DATA) ||
+	     IS_ENABLED(CONFIG_FOTA_UPGRADE_DIRECT_XIP))) {
+		LOG_INF("Action %d %s, waiting to install", json_acid,
+			staged ? "staged" : "not downloaded");
+		return 0;
 	}
+	hbc->window_wait = 0;
 
 	/* Here we should have everything we need to apply the action */
-	LOG_INF("Valid action ID %d found, proceeding with the update",
-		json_acid);
+	LOG_INF("Valid action ID %d found, proceeding with the %s",
+		json_acid, dep->install ? "update" : "download");
+	hbc->action_id = json_acid;
+	if (staged) {
+		LOG_INF("Firmware image already staged");
+		dep->image = true;
+		dep->artifact = 1;
+	} else {
+		hawkbit_unstage();
+	}
+	/* Get flash erased while we're still talking to the server. */
+	if (dep->artifact < hbc->num_artifacts) {
+		art = &hbc->artifacts[dep->artifact];
+		dep->offset = hawkbit_resume_offset(json_acid, art);
+		hawkbit_erase_start(hbc, art, dep->offset);
+	}
 	ret = hawkbit_report_dep_fbk(hbc, json_acid,
 				     HAWKBIT_STATUS_FINISHED_SUCCESS,
 				     HAWKBIT_STATUS_EXEC_PROCEEDING);
 	if (ret) {
+		hawkbit_erase_stop(hbc);
 		return ret;
 	}
-	ret = hawkbit_install_update(hbc, download_http, file_size);
-	if (ret != 0) {
+
+	/*
+	 * Download the artifacts back to back, over the same connection
+	 * with CONFIG_FOTA_HTTP_KEEPALIVE. The server only hears about
+	 * the action as a whole.
+	 */
+	if (dep->artifact < hbc->num_artifacts) {
+		dep->result = hawkbit_install_start(hbc);
+		hbc->step = dep->result ? HAWKBIT_STEP_VERIFY :
+			HAWKBIT_STEP_DOWNLOAD;
+	} else {
+		hbc->step = HAWKBIT_STEP_INSTALL;
+	}
+	return HAWKBIT_STEP_NEXT;
+}
+
+/* Move the artifact's download on, retrying it if it stalls. */
+static int hawkbit_step_download(struct hawkbit_context *hbc)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	int ret;
+
+	ret = hawkbit_download_step(hbc);
+	if (ret == HAWKBIT_STEP_WAIT) {
+		return ret;
+	} else if (ret == -EAGAIN &&
+		   ++dep->attempt < HAWKBIT_DOWNLOAD_ATTEMPTS) {
+		dep->offset = hbc->dl.journal_offset;
+		ret = hawkbit_attempt_start(hbc);
+		if (!ret) {
+			return HAWKBIT_STEP_NEXT;
+		}
+	}
+
+	dep->result = ret;
+	hbc->step = HAWKBIT_STEP_VERIFY;
+	return HAWKBIT_STEP_NEXT;
+}
+
+/* Check the artifact just downloaded, and go on to the next one. */
+static int hawkbit_step_verify(struct hawkbit_context *hbc)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	s32_t action_id = hbc->action_id;
+	int ret;
+
+	ret = hawkbit_install_finish(hbc, dep->result);
+	if (!ret) {
+		dep->image |= !(hbc->artifacts[dep->artifact].flags &
+				HAWKBIT_ARTIFACT_DATA);
+		if (++dep->artifact < hbc->num_artifacts) {
+			dep->offset = hawkbit_resume_offset(action_id,
+					&hbc->artifacts[dep->artifact]);
+			dep->result = hawkbit_install_start(hbc);
+			hbc->step = dep->result ? HAWKBIT_STEP_VERIFY :
+				HAWKBIT_STEP_DOWNLOAD;
+			return HAWKBIT_STEP_NEXT;
+		}
+	}
+
+	hawkbit_erase_stop(hbc);
+	if (ret == -ECANCELED) {
+		/* The server already knows; confirm instead of failing. */
+		ret = hawkbit_cancel_action(hbc, action_id);
+		if (ret < 0) {
+			return ret;
+		}
+		hawkbit_action_closed(hbc, action_id);
+		return 0;
+	} else if (ret != 0) {
 		LOG_ERR("Failed to install the update for action ID %d",
-			json_acid);
-		goto report_error;
+			action_id);
+		return hawkbit_action_failed(hbc, action_id, ret);
+	}
+
+	hbc->step = HAWKBIT_STEP_INSTALL;
+	return HAWKBIT_STEP_NEXT;
+}
+
+/* Everything is downloaded; stage it, or install it. */
+static int hawkbit_step_install(struct hawkbit_context *hbc)
+{
+	struct hawkbit_deployment *dep = &hbc->dep;
+	s32_t action_id = hbc->action_id;
+	int ret;
+
+	if (!dep->install) {
+		/* Only the firmware image, verified; keep it for later. */
+		ret = hawkbit_stage(action_id, &hbc->artifacts[0]);
+		if (ret) {
+			LOG_WRN("Can't record the staged image: %d", ret);
+		}
+		LOG_INF("Action %d downloaded, waiting to install",
+			action_id);
+		hawkbit_report_dep_fbk(hbc, action_id,
+				       HAWKBIT_STATUS_FINISHED_NONE,
+				       HAWKBIT_STATUS_EXEC_DOWNLOADED);
+		return 0;
+	}
+
+	if (!dep->image) {
+		/* Nothing to reboot into; the action is done. */
+		ret = hawkbit_device_acid_update(HAWKBIT_ACID_CURRENT,
+						 action_id);
+		if (ret != 0) {
+			LOG_ERR("Failed to update ACID: %d", ret);
+			return hawkbit_action_failed(hbc, action_id, ret);
+		}
+		LOG_INF("Action id %d installed", action_id);
+		ret = hawkbit_queue_fbk(hbc, HAWKBIT_OUTBOX_DEPLOYMENT,
+					action_id,
+					HAWKBIT_STATUS_FINISHED_SUCCESS,
+					HAWKBIT_STATUS_EXEC_CLOSED);
+		hawkbit_action_closed(hbc, action_id);
+		return ret;
 	}
 
 	LOG_INF("Triggering OTA update.");
-	boot_request_upgrade(false);
-	ret = hawkbit_device_acid_update(HAWKBIT_ACID_UPDATE, json_acid);
+	ret = hawkbit_request_upgrade();
+	if (ret != 0) {
+		LOG_ERR("Failed to request the upgrade: %d", ret);
+		return hawkbit_action_failed(hbc, action_id, ret);
+	}
+	ret = hawkbit_device_acid_update(HAWKBIT_ACID_UPDATE, action_id);
 	if (ret != 0) {
 		LOG_ERR("Failed to update ACID: %d", ret);
-		goto report_error;
+		return hawkbit_action_failed(hbc, action_id, ret);
 	}
 	LOG_INF("Image id %d flashed successfuly, rebooting now",
-		json_acid);
+		action_id);
 
-	/* Reboot and let the bootloader take care of the swap process */
+	/* Reboot and let the bootloader take care of the upgrade */
 #ifdef CONFIG_NET_L2_BT
 	bt_network_disable();
 #endif
@@ -1248,29 +4989,189 @@ static int hawkbit_ddi_poll(struct hawkbit_context *hbc)
 	sys_reboot(0);
 
 	return 0;
+}
 
- report_error:
-	hawkbit_report_dep_fbk(hbc, json_acid,
-			       HAWKBIT_STATUS_FINISHED_FAILURE,
-			       HAWKBIT_STATUS_EXEC_CLOSED);
-	return ret;
+static int hawkbit_step(struct hawkbit_context *hbc)
+{
+	switch (hbc->step) {
+	case HAWKBIT_STEP_FEEDBACK:
+		return hawkbit_step_feedback(hbc);
+	case HAWKBIT_STEP_POLL:
+		return hawkbit_step_poll(hbc);
+	case HAWKBIT_STEP_DEPLOYMENT:
+		return hawkbit_step_deployment(hbc);
+	case HAWKBIT_STEP_DOWNLOAD:
+		return hawkbit_step_download(hbc);
+	case HAWKBIT_STEP_VERIFY:
+		return hawkbit_step_verify(hbc);
+	case HAWKBIT_STEP_INSTALL:
+		return hawkbit_step_install(hbc);
+	default:
+		LOG_ERR("%d is invalid", (int)hbc->step);
+		return -EINVAL;
+	}
+}
+
+/*
+ * Poll scheduling.
+ *
+ * Polls normally happen every poll_sleep. After a failed poll, the
+ * delay doubles with each further failure, up to
+ * CONFIG_FOTA_POLL_BACKOFF_MAX, and is randomized so that devices
+ * which lost the server at the same time don't all come back to it
+ * at once. A Retry-After from the server is honored as a minimum.
+ */
+
+static u32_t poll_rand_state;
+
+/* xorshift32; this only needs to decorrelate devices. */
+static u32_t hawkbit_poll_rand(void)
+{
+	u32_t x = poll_rand_state;
+
+	if (!x) {
+		x = product_id_get()->number ^ k_cycle_get_32();
+		x = x ? x : 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	poll_rand_state = x;
+	return x;
+}
+
+/*
+ * Delay before a device's first poll: a fixed fraction of poll_sleep
+ * derived from its product ID, so a fleet that boots at once (after a
+ * power cut, say) spreads its polls out.
+ */
+static s32_t hawkbit_poll_phase(void)
+{
+	u32_t hash = product_id_get()->number * 2654435761U;
+
+	return hash % poll_sleep;
+}
+
+/*
+ * Delay before a poll which was asked for over MQTT: up to
+ * HAWKBIT_TRIGGER_POLL_SPREAD, so a fleet told to poll at once
+ * doesn't.
+ */
+static s32_t hawkbit_poll_spread(void)
+{
+	return hawkbit_poll_rand() % (HAWKBIT_TRIGGER_POLL_SPREAD + 1);
+}
+
+static s32_t hawkbit_poll_delay(struct hawkbit_context *hbc)
+{
+	s32_t delay = poll_sleep;
+	s32_t max = K_SECONDS(CONFIG_FOTA_POLL_BACKOFF_MAX);
+	int i;
+
+	if (hbc->failures) {
+		for (i = 0; i < hbc->failures && delay < max; i++) {
+			delay *= 2;
+		}
+		delay = MIN(delay, max);
+		/*
+		 * Wait between half and all of the backoff, but never
+		 * less than the server asked for.
+		 */
+		delay = delay / 2 + hawkbit_poll_rand() % (delay / 2 + 1);
+		delay = MAX(delay, poll_sleep);
+	}
+
+	if (hbc->poll_trigger && !hbc->failures) {
+		/* We'll hear it over MQTT when there's anything new. */
+		delay = MAX(delay, HAWKBIT_TRIGGER_POLL_INTERVAL);
+	}
+
+	if (hbc->poll_requested) {
+		delay = MIN(delay, hawkbit_poll_spread());
+		hbc->poll_requested = false;
+	}
+
+	if (hbc->window_wait) {
+		/* Be there when the window opens. */
+		delay = MIN(delay, hbc->window_wait);
+		hbc->window_wait = 0;
+	}
+
+	if (hbc->retry_after) {
+		/* ... plus up to 1/8 more, so we don't all come back. */
+		delay = MAX(delay, hbc->retry_after +
+			    hawkbit_poll_rand() % (hbc->retry_after / 8 + 1));
+		hbc->retry_after = 0;
+	}
+
+	return delay;
 }
 
-/* OTA worker */
+/*
+ * OTA worker. This runs a step of the poll cycle at a time, and is
+ * resubmitted for the next one, so other work gets to run in between.
+ * While a download is in flight, it's run again as data arrives, or
+ * after HAWKBIT_DOWNLOAD_TIMEOUT without any.
+ */
 static void hawkbit_work_fn(struct k_work *work)
 {
 	struct hawkbit_context *hbc = CONTAINER_OF(work, struct hawkbit_context,
 						   work);
+	s32_t delay;
 	int ret;
 
-	ret = hawkbit_ddi_poll(hbc);
+	if (hbc->step == HAWKBIT_STEP_FEEDBACK) {
+		memset(&hbc->stats, 0, sizeof(hbc->stats));
+		if (k_uptime_get_32() - hbc->idle_ms > HAWKBIT_IDLE_TIMEOUT) {
+			/* The server has probably given up on it by now. */
+			hawkbit_conn_close(hbc);
+		}
+	}
+	ret = hawkbit_step(hbc);
+	if (ret == HAWKBIT_STEP_NEXT) {
+		k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work,
+					       K_NO_WAIT);
+		return;
+	} else if (ret == HAWKBIT_STEP_WAIT) {
+		/*
+		 * Don't lose an event which came while this ran, or
+		 * whose K_NO_WAIT submission the timeout just replaced:
+		 * check again once the timeout is in place.
+		 */
+		delay = k_sem_count_get(hbc->sem) ? K_NO_WAIT :
+			HAWKBIT_DOWNLOAD_TIMEOUT;
+		k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work, delay);
+		if (delay != K_NO_WAIT && k_sem_count_get(hbc->sem)) {
+			k_delayed_work_submit_to_queue(hbc->work_q,
+						       &hbc->work, K_NO_WAIT);
+		}
+		return;
+	}
+
+	hbc->step = HAWKBIT_STEP_FEEDBACK;
+	if (ret < 0 || !HAWKBIT_IDLE_TIMEOUT || hbc->conn_host.addr[0]) {
+		hawkbit_conn_close(hbc);
+	}
+	hbc->idle_ms = k_uptime_get_32();
+	LOG_INF("Poll cycle: %d HTTP request(s) over %d connection(s)",
+		hbc->stats.requests, hbc->stats.connects);
+	if (IS_ENABLED(CONFIG_FOTA_TLS)) {
+		/*
+		 * With a local server, this is about the CPU time the
+		 * handshakes took.
+		 */
+		LOG_INF("Poll cycle: %d TLS handshake(s), %u ms in "
+			"requests waiting for them", hbc->stats.handshakes,
+			hbc->stats.handshake_ms);
+	}
 	if (ret < 0) {
 		hbc->failures++;
 	} else {
 		/* restart the failed attempt counter */
 		hbc->failures = 0;
 	}
-	if (hbc->failures == HAWKBIT_MAX_SERVER_FAIL) {
+	if (CONFIG_FOTA_POLL_FAILURE_REBOOT &&
+	    hbc->failures >= CONFIG_FOTA_POLL_FAILURE_REBOOT) {
 		LOG_ERR("Too many unsuccessful poll attempts, rebooting!");
 #ifdef CONFIG_NET_L2_BT
 		bt_network_disable();
@@ -1279,15 +5180,92 @@ static void hawkbit_work_fn(struct k_work *work)
 		sys_reboot(0);
 	}
 
-	k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work, poll_sleep);
+	delay = hawkbit_poll_delay(hbc);
+	if (hbc->failures) {
+		LOG_INF("Poll failed %d time(s) in a row, next in %d ms",
+			hbc->failures, delay);
+	}
+	k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work, delay);
+}
+
+/*
+ * Act on hawkbit_poll_now() and hawkbit_set_poll_trigger(). They're
+ * called from the MQTT callbacks, so they only record what they were
+ * told and leave the rest to this, which runs on the work queue like
+ * hawkbit_work_fn(): it can't reschedule a poll cycle in mid-step.
+ */
+static void hawkbit_trigger_fn(struct k_work *work)
+{
+	struct hawkbit_context *hbc = CONTAINER_OF(work, struct hawkbit_context,
+						   trigger_work);
+	bool active = atomic_test_bit(&hbc->triggers, HAWKBIT_TRIGGER_ACTIVE);
+	bool idle = hbc->step == HAWKBIT_STEP_FEEDBACK && !hbc->failures;
+	s32_t delay;
+
+	if (hbc->poll_trigger != active) {
+		LOG_INF("Poll triggers over MQTT %s",
+			active ? "up, polling less often" : "down");
+		hbc->poll_trigger = active;
+		if (!active && idle) {
+			/* Don't wait out the longer interval. */
+			k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work,
+						       poll_sleep);
+		}
+	}
+
+	if (!atomic_test_and_clear_bit(&hbc->triggers, HAWKBIT_TRIGGER_POLL)) {
+		return;
+	} else if (hbc->failures) {
+		/* Backing off has to run its course. */
+		return;
+	} else if (hbc->step != HAWKBIT_STEP_FEEDBACK) {
+		/* This poll may have missed it; poll again after it. */
+		hbc->poll_requested = true;
+		return;
+	}
+
+	delay = hawkbit_poll_spread();
+	LOG_INF("Poll requested, next in %d ms", delay);
+	k_delayed_work_submit_to_queue(hbc->work_q, &hbc->work, delay);
+}
+
+void hawkbit_poll_now(void)
+{
+	struct hawkbit_context *hbc = &hb_context;
+
+	if (!hbc->work_q) {
+		/* Not started. */
+		return;
+	}
+
+	atomic_set_bit(&hbc->triggers, HAWKBIT_TRIGGER_POLL);
+	k_work_submit_to_queue(hbc->work_q, &hbc->trigger_work);
+}
+
+void hawkbit_set_poll_trigger(bool active)
+{
+	struct hawkbit_context *hbc = &hb_context;
+
+	if (!hbc->work_q) {
+		return;
+	}
+
+	if (active) {
+		atomic_set_bit(&hbc->triggers, HAWKBIT_TRIGGER_ACTIVE);
+	} else {
+		atomic_clear_bit(&hbc->triggers, HAWKBIT_TRIGGER_ACTIVE);
+	}
+	k_work_submit_to_queue(hbc->work_q, &hbc->trigger_work);
 }
 
 static void event_iface_up(struct net_mgmt_event_callback *cb,
 			   u32_t mgmt_event, struct net_if *iface)
 {
-	LOG_INF("Submitting FOTA Service work");
+	s32_t phase = hawkbit_poll_phase();
+
+	LOG_INF("Submitting FOTA Service work, first poll in %d ms", phase);
 	k_delayed_work_submit_to_queue(hb_context.work_q, &hb_context.work,
-				       poll_sleep);
+				       phase);
 }
 
 int hawkbit_start(struct k_work_q *work_q)
@@ -1308,12 +5286,18 @@ int hawkbit_start(struct k_work_q *work_q)
 	hb_context.tcp_buffer_size = TCP_RECV_BUFFER_SIZE;
 	hb_context.url_buffer_size = URL_BUFFER_SIZE;
 	hb_context.status_buffer_size = STATUS_BUFFER_SIZE;
-	hb_context.work_q = work_q;
 	k_delayed_work_init(&hb_context.work, hawkbit_work_fn);
+	k_work_init(&hb_context.trigger_work, hawkbit_trigger_fn);
+	hb_context.work_q = work_q;
 	hb_context.sem = &hb_sem;
-#if defined(CONFIG_FOTA_ERASE_PROGRESSIVELY)
-	hb_context.last_offset = FLASH_AREA_IMAGE_1_OFFSET;
-#endif
+	hb_context.handled_acid = -1;
+	hb_context.date_sod = -1;
+	hawkbit_mirrors_init();
+
+	k_work_init(&cleanup_work, hawkbit_cleanup_fn);
+	if (cleanup_offset < SLOT1_END) {
+		k_work_submit_to_queue(work_q, &cleanup_work);
+	}
 
 #if defined(CONFIG_NET_MGMT_EVENT)
 	/* Subscribe to NET_EVENT_IF_UP if interface is not ready */
@@ -8,10 +8,29 @@
 #ifndef FOTA_HAWKBIT_H__
 #define FOTA_HAWKBIT_H__
 
+#if defined(CONFIG_FOTA_TLS)
+#define HAWKBIT_HOST	"mgmt.foundries.io:8443"
+#define HAWKBIT_PORT	8443
+#else
 #define HAWKBIT_HOST	"mgmt.foundries.io:8080"
 #define HAWKBIT_PORT	8080
+#endif
 #define HAWKBIT_JSON_URL "/DEFAULT/controller/v1"
 
 int hawkbit_start(struct k_work_q *work_q);
 
+/*
+ * Poll the hawkBit server soon, rather than after the poll interval,
+ * when told to over MQTT. This may be called from any thread; the
+ * poll is scheduled from the work queue given to hawkbit_start().
+ */
+void hawkbit_poll_now(void);
+
+/*
+ * Tell the client whether hawkbit_poll_now() calls are coming, so it
+ * may poll less often (see CONFIG_FOTA_MQTT_POLL_INTERVAL). This, too,
+ * may be called from any thread.
+ */
+void hawkbit_set_poll_trigger(bool active);
+
 #endif	/* FOTA_HAWKBIT_H__ */
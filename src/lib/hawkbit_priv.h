@@ -36,16 +36,22 @@ enum hawkbit_status_fini {
 	HAWKBIT_STATUS_FINISHED_NONE,
 };
 
+/*
+ * Progress of an action which is still proceeding: "cnt" steps done
+ * out of "of". We report download progress in percent.
+ */
+struct hawkbit_status_progress {
+	s32_t cnt;
+	s32_t of;
+};
+
 struct hawkbit_status_result {
 	/*
 	 * hawkbit_status_finished() converts from enum hawkbit_status_fini.
 	 */
 	const char			*finished;
-	/*
-	 * The "progress" field is unsupported. Its purpose is not
-	 * clear in the documentation, and the "of" and "cnt" fields
-	 * it contains seem to be unused in the result handling code.
-	 */
+	/* Only sent with progress feedback; see hawkbit_report_fbk(). */
+	struct hawkbit_status_progress	 progress;
 };
 
 enum hawkbit_status_exec {
@@ -55,6 +61,7 @@ enum hawkbit_status_exec {
 	HAWKBIT_STATUS_EXEC_SCHEDULED,
 	HAWKBIT_STATUS_EXEC_REJECTED,
 	HAWKBIT_STATUS_EXEC_RESUMED,
+	HAWKBIT_STATUS_EXEC_DOWNLOADED,
 };
 
 struct hawkbit_status {
@@ -158,13 +165,14 @@ struct hawkbit_cfg {
  */
 
 /* Maximum number of chunks we support */
-#define HAWKBIT_DEP_MAX_CHUNKS		1
+#define HAWKBIT_DEP_MAX_CHUNKS		3
 /* Maximum number of artifacts per chunk. */
-#define HAWKBIT_DEP_MAX_CHUNK_ARTS	1
+#define HAWKBIT_DEP_MAX_CHUNK_ARTS	2
 
 struct hawkbit_dep_res_hashes {
 	const char *sha1;
 	const char *md5;
+	const char *sha256;
 };
 
 struct hawkbit_dep_res_links {
@@ -189,9 +197,16 @@ struct hawkbit_dep_res_chunk {
 	size_t				 num_artifacts;
 };
 
+/*
+ * "download" and "update" are "skip", "attempt" or "forced".
+ * "maintenanceWindow" is "available" or "unavailable" if the action
+ * has a maintenance window on the server; while it's unavailable, the
+ * action may only be downloaded.
+ */
 struct hawkbit_dep_res_deploy {
 	const char			*download;
 	const char			*update;
+	const char			*maintenanceWindow;
 	struct hawkbit_dep_res_chunk	 chunks[HAWKBIT_DEP_MAX_CHUNKS];
 	size_t                           num_chunks;
 };
@@ -207,4 +222,28 @@ struct hawkbit_dep_fbk {
 	struct hawkbit_status	 status;
 };
 
+/*
+ * struct hawkbit_cancel represents results from the cancel action
+ * resource, which looks like this:
+ *
+ * {
+ *     "id": "11",
+ *     "cancelAction": {
+ *         "stopId": "11"
+ *     }
+ * }
+ *
+ * stopId is the action being canceled. The response sent to the
+ * feedback channel is a struct hawkbit_dep_fbk.
+ */
+
+struct hawkbit_cancel_action {
+	const char *stopId;
+};
+
+struct hawkbit_cancel {
+	const char			*id;
+	struct hawkbit_cancel_action	 cancelAction;
+};
+
 #endif /* HAWKBIT_PRIV_H__ */
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+enum json_stream_state {
+	JS_VALUE,		/* expecting a value */
+	JS_VALUE_OR_END,	/* expecting a value or ']' */
+	JS_KEY,			/* expecting a key */
+	JS_KEY_OR_END,		/* expecting a key or '}' */
+	JS_COLON,
+	JS_AFTER_VALUE,		/* expecting ',', '}' or ']' */
+	JS_STRING,
+	JS_STRING_ESC,
+	JS_STRING_UNICODE,
+	JS_LITERAL,
+	JS_DONE,
+};
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_literal_char(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+		(c >= 'A' && c <= 'Z') || c == '.' || c == '+' || c == '-';
+}
+
+static bool is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' ||
+		c == '+' || c == '-';
+}
+
+static bool is_hex(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+		(c >= 'A' && c <= 'F');
+}
+
+static void tok_append(struct json_stream *js, char c)
+{
+	if (js->tok_len < sizeof(js->tok) - 1) {
+		js->tok[js->tok_len++] = c;
+	} else {
+		js->truncated = true;
+	}
+}
+
+static void tok_start(struct json_stream *js)
+{
+	js->tok_len = 0;
+	js->truncated = false;
+}
+
+/*
+ * Set the last path component, after the first "base" bytes. If the
+ * path doesn't fit, or its parent's didn't ("unmapped"), the value
+ * is skipped.
+ */
+static void path_set(struct json_stream *js, size_t base, bool unmapped,
+		     const char *sep, const char *comp, size_t comp_len)
+{
+	size_t sep_len = strlen(sep);
+
+	if (unmapped || base + sep_len + comp_len >= sizeof(js->path)) {
+		js->path_len = base;
+		js->path[base] = '\0';
+		js->unmapped = true;
+		return;
+	}
+
+	memcpy(js->path + base, sep, sep_len);
+	memcpy(js->path + base + sep_len, comp, comp_len);
+	js->path_len = base + sep_len + comp_len;
+	js->path[js->path_len] = '\0';
+	js->unmapped = false;
+}
+
+/* Type of the innermost open object or array. */
+static char top_type(const struct json_stream *js)
+{
+	if (js->deep) {
+		return js->deep_objects & (1U << (js->deep - 1)) ? '{' : '[';
+	}
+
+	return js->stack[js->depth - 1].type;
+}
+
+static int push(struct json_stream *js, char type)
+{
+	if (js->depth == JSON_STREAM_MAX_DEPTH) {
+		/* Too deep for paths: only its syntax is checked. */
+		if (js->deep == JSON_STREAM_MAX_SKIP_DEPTH) {
+			return -ENOSPC;
+		}
+		if (type == '{') {
+			js->deep_objects |= (1U << js->deep);
+		} else {
+			js->deep_objects &= ~(1U << js->deep);
+		}
+		js->deep++;
+		js->unmapped = true;
+	} else {
+		js->stack[js->depth].type = type;
+		js->stack[js->depth].unmapped = js->unmapped;
+		js->stack[js->depth].path_len = js->path_len;
+		js->stack[js->depth].index = 0;
+		js->depth++;
+	}
+
+	js->state = type == '{' ? JS_KEY_OR_END : JS_VALUE_OR_END;
+	return 0;
+}
+
+static int pop(struct json_stream *js, char type)
+{
+	if (js->depth == 0 || top_type(js) != type) {
+		return -EINVAL;
+	}
+
+	if (js->deep) {
+		js->deep--;
+	} else {
+		js->depth--;
+	}
+	js->state = js->depth ? JS_AFTER_VALUE : JS_DONE;
+	return 0;
+}
+
+static int emit(struct json_stream *js, enum json_tokens type)
+{
+	struct json_stream_value val;
+	size_t i;
+
+	js->tok[js->tok_len] = '\0';
+
+	if (type != JSON_TOK_STRING) {
+		if (!strcmp(js->tok, "true")) {
+			type = JSON_TOK_TRUE;
+		} else if (!strcmp(js->tok, "false")) {
+			type = JSON_TOK_FALSE;
+		} else if (!strcmp(js->tok, "null")) {
+			type = JSON_TOK_NULL;
+		} else {
+			for (i = 0; i < js->tok_len; i++) {
+				if (!is_number_char(js->tok[i])) {
+					return -EINVAL;
+				}
+			}
+			type = JSON_TOK_NUMBER;
+		}
+	}
+
+	js->state = js->depth ? JS_AFTER_VALUE : JS_DONE;
+	if (js->unmapped) {
+		return 0;
+	}
+
+	val.path = js->path;
+	val.type = type;
+	val.str = js->tok;
+	val.len = js->tok_len;
+	val.truncated = js->truncated;
+	return js->cb(js, &val, js->user_data);
+}
+
+/* Set up the path for a value which is about to start. */
+static void value_start(struct json_stream *js)
+{
+	const struct json_stream_level *top;
+
+	if (js->depth == 0) {
+		path_set(js, 0, false, "", "", 0);
+		return;
+	}
+
+	top = &js->stack[js->depth - 1];
+	if (!js->deep && top->type == '[') {
+		path_set(js, top->path_len, top->unmapped, "", "[]", 2);
+	}
+
+	/*
+	 * Object member: the path was set when its key was parsed.
+	 * Beyond JSON_STREAM_MAX_DEPTH, it stays unmapped.
+	 */
+}
+
+static int key_done(struct json_stream *js)
+{
+	const struct json_stream_level *top = &js->stack[js->depth - 1];
+
+	js->tok[js->tok_len] = '\0';
+	js->state = JS_COLON;
+	if (!js->deep) {
+		path_set(js, top->path_len, top->unmapped,
+			 top->path_len ? "." : "", js->tok, js->tok_len);
+	}
+	return 0;
+}
+
+static int parse_value(struct json_stream *js, char c)
+{
+	value_start(js);
+
+	switch (c) {
+	case '{':
+	case '[':
+		return push(js, c);
+	case '"':
+		tok_start(js);
+		js->is_key = false;
+		js->state = JS_STRING;
+		return 0;
+	default:
+		if (c == '-' || (c >= '0' && c <= '9') ||
+		    c == 't' || c == 'f' || c == 'n') {
+			tok_start(js);
+			tok_append(js, c);
+			js->state = JS_LITERAL;
+			return 0;
+		}
+		return -EINVAL;
+	}
+}
+
+static int parse_string_char(struct json_stream *js, char c)
+{
+	switch (js->state) {
+	case JS_STRING:
+		if (c == '"') {
+			return js->is_key ? key_done(js) :
+				emit(js, JSON_TOK_STRING);
+		} else if (c == '\\') {
+			js->state = JS_STRING_ESC;
+		} else if ((u8_t)c < 0x20) {
+			return -EINVAL;
+		} else {
+			tok_append(js, c);
+		}
+		return 0;
+	case JS_STRING_ESC:
+		js->state = JS_STRING;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			tok_append(js, c);
+			return 0;
+		case 'b':
+			tok_append(js, '\b');
+			return 0;
+		case 'f':
+			tok_append(js, '\f');
+			return 0;
+		case 'n':
+			tok_append(js, '\n');
+			return 0;
+		case 'r':
+			tok_append(js, '\r');
+			return 0;
+		case 't':
+			tok_append(js, '\t');
+			return 0;
+		case 'u':
+			tok_append(js, '?');
+			js->unicode_left = 4;
+			js->state = JS_STRING_UNICODE;
+			return 0;
+		default:
+			return -EINVAL;
+		}
+	case JS_STRING_UNICODE:
+		if (!is_hex(c)) {
+			return -EINVAL;
+		}
+		if (--js->unicode_left == 0) {
+			js->state = JS_STRING;
+		}
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int parse_char(struct json_stream *js, char c)
+{
+	int ret;
+
+	switch (js->state) {
+	case JS_STRING:
+	case JS_STRING_ESC:
+	case JS_STRING_UNICODE:
+		return parse_string_char(js, c);
+	case JS_LITERAL:
+		if (is_literal_char(c)) {
+			tok_append(js, c);
+			return 0;
+		}
+		ret = emit(js, JSON_TOK_NUMBER);
+		if (ret) {
+			return ret;
+		}
+		/* The character after the literal still needs parsing. */
+		return parse_char(js, c);
+	default:
+		break;
+	}
+
+	if (is_space(c)) {
+		return 0;
+	}
+
+	switch (js->state) {
+	case JS_VALUE_OR_END:
+		if (c == ']') {
+			return pop(js, '[');
+		}
+		/* Fall through. */
+	case JS_VALUE:
+		return parse_value(js, c);
+	case JS_KEY_OR_END:
+		if (c == '}') {
+			return pop(js, '{');
+		}
+		/* Fall through. */
+	case JS_KEY:
+		if (c != '"') {
+			return -EINVAL;
+		}
+		tok_start(js);
+		js->is_key = true;
+		js->state = JS_STRING;
+		return 0;
+	case JS_COLON:
+		if (c != ':') {
+			return -EINVAL;
+		}
+		js->state = JS_VALUE;
+		return 0;
+	case JS_AFTER_VALUE:
+		if (c == '}' || c == ']') {
+			return pop(js, c == '}' ? '{' : '[');
+		} else if (c != ',') {
+			return -EINVAL;
+		}
+		if (top_type(js) == '{') {
+			js->state = JS_KEY;
+		} else {
+			if (!js->deep) {
+				js->stack[js->depth - 1].index++;
+			}
+			js->state = JS_VALUE;
+		}
+		return 0;
+	default:
+		/* Only whitespace is allowed after the document. */
+		return -EINVAL;
+	}
+}
+
+void json_stream_init(struct json_stream *js, json_stream_cb_t cb,
+		      void *user_data)
+{
+	memset(js, 0, sizeof(*js));
+	js->cb = cb;
+	js->user_data = user_data;
+	js->state = JS_VALUE;
+}
+
+int json_stream_feed(struct json_stream *js, const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && !js->err; i++) {
+		js->err = parse_char(js, data[i]);
+	}
+
+	return js->err;
+}
+
+int json_stream_finish(struct json_stream *js)
+{
+	if (js->err) {
+		return js->err;
+	}
+
+	/* A top-level number only ends with the document. */
+	if (js->state == JS_LITERAL) {
+		js->err = emit(js, JSON_TOK_NUMBER);
+		if (js->err) {
+			return js->err;
+		}
+	}
+
+	if (js->state != JS_DONE) {
+		js->err = -EINVAL;
+	}
+
+	return js->err;
+}
+
+int json_stream_index(const struct json_stream *js, int n)
+{
+	int i;
+
+	for (i = 0; i < js->depth; i++) {
+		if (js->stack[i].type != '[') {
+			continue;
+		}
+		if (n-- == 0) {
+			return js->stack[i].index;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_JSON_STREAM_H__
+#define FOTA_JSON_STREAM_H__
+
+/**
+ * @file
+ * @brief Incremental JSON tokenizer.
+ *
+ * This parses a JSON document as it arrives, in arbitrarily sized
+ * pieces, using a fixed amount of memory. Instead of decoding into a
+ * structure like json_obj_parse(), it calls back for each primitive
+ * value (string, number, true, false or null) with the path to that
+ * value in the document, for example:
+ *
+ *     deployment.chunks[].artifacts[].size
+ *
+ * The index of each array element on the path is available from the
+ * callback via json_stream_index().
+ *
+ * String values and keys longer than JSON_STREAM_TOKEN_SIZE - 1
+ * bytes are truncated; the callback is told when this happens.
+ * Unicode escapes are replaced with '?'.
+ *
+ * Values whose path doesn't fit in JSON_STREAM_PATH_SIZE, or which
+ * are nested more than JSON_STREAM_MAX_DEPTH deep, are skipped
+ * without a callback, along with everything inside them. Only
+ * nesting beyond JSON_STREAM_MAX_DEPTH + JSON_STREAM_MAX_SKIP_DEPTH
+ * fails the document.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <json.h>
+
+/* Maximum nesting of objects and arrays. */
+#define JSON_STREAM_MAX_DEPTH	10
+/* Further nesting which is skipped, at most 32. */
+#define JSON_STREAM_MAX_SKIP_DEPTH	32
+/* Maximum length of a value's path, including the NUL. */
+#define JSON_STREAM_PATH_SIZE	128
+/* Maximum length of a key or value, including the NUL. */
+#define JSON_STREAM_TOKEN_SIZE	256
+
+struct json_stream;
+
+/* An object or array being parsed. */
+struct json_stream_level {
+	char			 type;		/* '{' or '[' */
+	bool			 unmapped;	/* its path didn't fit */
+	u8_t			 path_len;
+	u16_t			 index;		/* of the array element */
+};
+
+struct json_stream_value {
+	/* Path to the value, e.g. "config.polling.sleep". */
+	const char		*path;
+	/*
+	 * One of JSON_TOK_STRING, JSON_TOK_NUMBER, JSON_TOK_TRUE,
+	 * JSON_TOK_FALSE or JSON_TOK_NULL.
+	 */
+	enum json_tokens	 type;
+	/* NUL-terminated value; unescaped if it is a string. */
+	const char		*str;
+	size_t			 len;
+	bool			 truncated;
+};
+
+/**
+ * @brief Value callback.
+ *
+ * @param js Stream the value was found in
+ * @param val The value
+ * @param user_data User data passed to json_stream_init()
+ * @return 0 to continue parsing, negative errno to stop.
+ */
+typedef int (*json_stream_cb_t)(struct json_stream *js,
+				const struct json_stream_value *val,
+				void *user_data);
+
+/* Everything in here is private. */
+struct json_stream {
+	json_stream_cb_t	 cb;
+	void			*user_data;
+	int			 err;
+	u8_t			 state;
+	bool			 is_key;
+	bool			 truncated;
+	u8_t			 unicode_left;
+	bool			 unmapped;	/* the value is skipped */
+	u8_t			 depth;
+	struct json_stream_level stack[JSON_STREAM_MAX_DEPTH];
+	/* Levels beyond the stack, and which of them are objects. */
+	u8_t			 deep;
+	u32_t			 deep_objects;
+	char			 path[JSON_STREAM_PATH_SIZE];
+	size_t			 path_len;
+	char			 tok[JSON_STREAM_TOKEN_SIZE];
+	size_t			 tok_len;
+};
+
+/**
+ * @brief Prepare a stream to parse a new document.
+ *
+ * @param js Stream to initialize
+ * @param cb Callback for each value in the document
+ * @param user_data Passed along to the callback
+ */
+void json_stream_init(struct json_stream *js, json_stream_cb_t cb,
+		      void *user_data);
+
+/**
+ * @brief Parse the next piece of a document.
+ *
+ * Errors are sticky: once this fails, it keeps returning the same
+ * error without parsing any further.
+ *
+ * @param js Stream
+ * @param data Next bytes of the document
+ * @param len Number of bytes in data
+ * @return 0 on success, negative errno on a syntax error, if the
+ *         document is nested more than JSON_STREAM_MAX_DEPTH +
+ *         JSON_STREAM_MAX_SKIP_DEPTH deep, or if the callback failed.
+ */
+int json_stream_feed(struct json_stream *js, const char *data, size_t len);
+
+/**
+ * @brief Finish parsing a document.
+ *
+ * @param js Stream
+ * @return 0 if a complete document was parsed, negative errno
+ *         otherwise.
+ */
+int json_stream_finish(struct json_stream *js);
+
+/**
+ * @brief Get the index of an array element on the current path.
+ *
+ * This may only be called from the value callback.
+ *
+ * @param js Stream
+ * @param n Which array on the path, counting from the outermost one
+ * @return Index of the element within that array, or -1 if the path
+ *         contains fewer arrays.
+ */
+int json_stream_index(const struct json_stream *js, int n);
+
+#endif /* FOTA_JSON_STREAM_H__ */
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <misc/byteorder.h>
+#include <misc/util.h>
+
+#include "lzss_stream.h"
+
+enum lzss_stream_state {
+	LS_HEADER,		/* assembling the header */
+	LS_CONTROL,		/* expecting a control byte */
+	LS_LITERAL,		/* copying literal bytes */
+	LS_DISTANCE,		/* assembling a match distance */
+};
+
+/* Write out the part of the window which hasn't been written yet. */
+static int flush(struct lzss_stream *ls)
+{
+	int ret;
+
+	if (ls->pos == ls->flushed) {
+		return 0;
+	}
+
+	ret = ls->write(ls->window + ls->flushed, ls->pos - ls->flushed,
+			ls->user_data);
+	if (ret) {
+		return ret;
+	}
+
+	if (ls->pos == ls->window_size) {
+		ls->pos = 0;
+	}
+	ls->flushed = ls->pos;
+	return 0;
+}
+
+/* Append a decompressed byte to the window. */
+static int put(struct lzss_stream *ls, u8_t c)
+{
+	ls->window[ls->pos++] = c;
+	ls->out++;
+
+	/* Don't let unwritten data be overwritten when we wrap. */
+	if (ls->pos == ls->window_size) {
+		return flush(ls);
+	}
+
+	return 0;
+}
+
+static int header_done(struct lzss_stream *ls)
+{
+	u8_t bits = ls->hdr[8];
+
+	if (sys_get_le32(ls->hdr) != LZSS_STREAM_MAGIC ||
+	    bits > LZSS_STREAM_WINDOW_BITS) {
+		return -EINVAL;
+	}
+
+	ls->size = sys_get_le32(ls->hdr + 4);
+	if (ls->size > ls->size_max) {
+		return -EFBIG;
+	}
+
+	ls->window_size = 1 << bits;
+	ls->state = LS_CONTROL;
+	return 0;
+}
+
+static int match(struct lzss_stream *ls, u16_t distance)
+{
+	u16_t from;
+	int ret;
+
+	if (distance == 0 || distance > ls->window_size ||
+	    distance > ls->out || ls->left > ls->size - ls->out) {
+		return -EINVAL;
+	}
+
+	from = (ls->pos + ls->window_size - distance) % ls->window_size;
+	while (ls->left) {
+		ret = put(ls, ls->window[from]);
+		if (ret) {
+			return ret;
+		}
+		from = (from + 1) % ls->window_size;
+		ls->left--;
+	}
+
+	ls->state = LS_CONTROL;
+	return 0;
+}
+
+/* Parse some of the stream; returns the number of bytes used. */
+static int parse(struct lzss_stream *ls, const u8_t *data, size_t len)
+{
+	size_t n, i;
+	int ret;
+
+	switch (ls->state) {
+	case LS_HEADER:
+		n = MIN(LZSS_STREAM_HDR_SIZE - ls->hdr_len, len);
+		memcpy(ls->hdr + ls->hdr_len, data, n);
+		ls->hdr_len += n;
+		if (ls->hdr_len == LZSS_STREAM_HDR_SIZE) {
+			ret = header_done(ls);
+			if (ret) {
+				return ret;
+			}
+		}
+		return n;
+	case LS_CONTROL:
+		ls->hdr_len = 0;
+		if (data[0] & 0x80) {
+			ls->left = (data[0] & 0x7f) + LZSS_STREAM_MIN_MATCH;
+			ls->state = LS_DISTANCE;
+		} else {
+			ls->left = data[0] + 1;
+			ls->state = LS_LITERAL;
+		}
+		return 1;
+	case LS_LITERAL:
+		n = MIN(ls->left, len);
+		if (n > ls->size - ls->out) {
+			return -EINVAL;
+		}
+		for (i = 0; i < n; i++) {
+			ret = put(ls, data[i]);
+			if (ret) {
+				return ret;
+			}
+		}
+		ls->left -= n;
+		if (ls->left == 0) {
+			ls->state = LS_CONTROL;
+		}
+		return n;
+	case LS_DISTANCE:
+		ls->hdr[ls->hdr_len++] = data[0];
+		if (ls->hdr_len == sizeof(u16_t)) {
+			ret = match(ls, sys_get_le16(ls->hdr));
+			if (ret) {
+				return ret;
+			}
+		}
+		return 1;
+	default:
+		return -EINVAL;
+	}
+}
+
+void lzss_stream_init(struct lzss_stream *ls, lzss_stream_write_t write,
+		      size_t size_max, void *user_data)
+{
+	memset(ls, 0, sizeof(*ls));
+	ls->write = write;
+	ls->size_max = size_max;
+	ls->user_data = user_data;
+	ls->state = LS_HEADER;
+}
+
+int lzss_stream_feed(struct lzss_stream *ls, const u8_t *data, size_t len)
+{
+	int ret;
+
+	while (len && !ls->err) {
+		ret = parse(ls, data, len);
+		if (ret < 0) {
+			ls->err = ret;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	/* Pass along what we have, rather than holding on to it. */
+	if (!ls->err) {
+		ls->err = flush(ls);
+	}
+
+	return ls->err;
+}
+
+int lzss_stream_finish(struct lzss_stream *ls)
+{
+	if (ls->err) {
+		return ls->err;
+	}
+
+	if (ls->state != LS_CONTROL || ls->out != ls->size) {
+		ls->err = -EINVAL;
+	}
+
+	return ls->err;
+}
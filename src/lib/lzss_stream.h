@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_LZSS_STREAM_H__
+#define FOTA_LZSS_STREAM_H__
+
+/**
+ * @file
+ * @brief Streaming LZSS decompressor.
+ *
+ * This decompresses artifacts produced by scripts/hawkbit.py
+ * --compress as they arrive, in arbitrarily sized pieces, using a
+ * fixed-size window.
+ *
+ * All values are little endian. A compressed stream starts with this
+ * header:
+ *
+ *     u32_t magic;            LZSS_STREAM_MAGIC
+ *     u32_t size;             decompressed size
+ *     u8_t window_bits;       log2 of the window size used
+ *
+ * followed by runs, each starting with a control byte "c":
+ *
+ *     c < 0x80:   c + 1 literal bytes follow.
+ *     c >= 0x80:  u16_t distance follows. Copy (c & 0x7f) +
+ *                 LZSS_STREAM_MIN_MATCH bytes from "distance" bytes
+ *                 back in the output.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#define LZSS_STREAM_MAGIC	0x315a4c46 /* "FLZ1" */
+#define LZSS_STREAM_HDR_SIZE	9
+#define LZSS_STREAM_MIN_MATCH	3
+/* Largest window supported, and so the decoder's RAM footprint. */
+#define LZSS_STREAM_WINDOW_BITS	11
+#define LZSS_STREAM_WINDOW_SIZE	(1 << LZSS_STREAM_WINDOW_BITS)
+
+/**
+ * @brief Write the next piece of decompressed data.
+ *
+ * @param buf Data to write
+ * @param len Number of bytes in buf
+ * @param user_data User data passed to lzss_stream_init()
+ * @return 0 on success, negative errno on error.
+ */
+typedef int (*lzss_stream_write_t)(const u8_t *buf, size_t len,
+				   void *user_data);
+
+/* Everything in here is private. */
+struct lzss_stream {
+	lzss_stream_write_t	 write;
+	void			*user_data;
+	size_t			 size_max;
+	int			 err;
+	u8_t			 state;
+	u8_t			 hdr[LZSS_STREAM_HDR_SIZE];
+	size_t			 hdr_len;
+	u32_t			 size;
+	u32_t			 window_size;
+	u32_t			 out;		/* bytes decompressed */
+	u16_t			 left;		/* in the current run */
+	u16_t			 pos;		/* next write into window */
+	u16_t			 flushed;	/* window written up to here */
+	u8_t			 window[LZSS_STREAM_WINDOW_SIZE];
+};
+
+/**
+ * @brief Prepare to decompress a new stream.
+ *
+ * @param ls Stream to initialize
+ * @param write Callback for the decompressed data
+ * @param size_max Largest decompressed size to accept
+ * @param user_data Passed along to the callback
+ */
+void lzss_stream_init(struct lzss_stream *ls, lzss_stream_write_t write,
+		      size_t size_max, void *user_data);
+
+/**
+ * @brief Decompress the next piece of a stream.
+ *
+ * Errors are sticky: once this fails, it keeps returning the same
+ * error without doing anything else.
+ *
+ * @param ls Stream
+ * @param data Next bytes of the compressed stream
+ * @param len Number of bytes in data
+ * @return 0 on success; -EINVAL if the stream is malformed, -EFBIG if
+ *         it decompresses to more than size_max bytes, or an error
+ *         from the callback.
+ */
+int lzss_stream_feed(struct lzss_stream *ls, const u8_t *data, size_t len);
+
+/**
+ * @brief Finish decompressing a stream.
+ *
+ * @param ls Stream
+ * @return 0 if the whole stream was decompressed, negative errno
+ *         otherwise.
+ */
+int lzss_stream_finish(struct lzss_stream *ls);
+
+/**
+ * @brief Get the decompressed size given in a stream's header.
+ *
+ * @param ls Stream
+ * @return Decompressed size, or 0 if the header hasn't been parsed.
+ */
+static inline size_t lzss_stream_size(const struct lzss_stream *ls)
+{
+	return ls->size;
+}
+
+#endif /* FOTA_LZSS_STREAM_H__ */
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <misc/byteorder.h>
+#include <misc/util.h>
+
+#include "mcuboot_img.h"
+
+enum mcuboot_img_state {
+	MI_HEADER,		/* assembling the header */
+	MI_IMAGE,		/* hashing the rest of the image */
+	MI_TLV_INFO,		/* assembling the TLV area's header */
+	MI_TLV_HDR,		/* assembling a TLV's header */
+	MI_TLV_DATA,		/* in a TLV's data */
+	MI_TRAILER,		/* past the TLV area */
+};
+
+/* Initial stack pointer and reset vector. */
+#define MI_VECTORS_SIZE		(2 * sizeof(u32_t))
+
+static int header_done(struct mcuboot_img_check *ic)
+{
+	u32_t load_addr = sys_get_le32(ic->hdr + 4);
+	u16_t hdr_size = sys_get_le16(ic->hdr + 8);
+	u32_t img_size = sys_get_le32(ic->hdr + 12);
+	u32_t flags = sys_get_le32(ic->hdr + 16);
+
+	if (sys_get_le32(ic->hdr) != MCUBOOT_IMG_MAGIC ||
+	    hdr_size < MCUBOOT_IMG_HDR_SIZE) {
+		return -EINVAL;
+	}
+
+	/* Only images which run in place from slot0 are bootable. */
+	if (load_addr ||
+	    flags & (MCUBOOT_IMG_F_NON_BOOTABLE | MCUBOOT_IMG_F_RAM_LOAD)) {
+		return -EINVAL;
+	}
+
+	if (hdr_size > ic->max_size || img_size > ic->max_size - hdr_size) {
+		return -EFBIG;
+	}
+	ic->img_start = hdr_size;
+	ic->hashed_end = hdr_size + img_size;
+	/* There must be room for the TLVs. */
+	if (ic->size &&
+	    ic->hashed_end + MCUBOOT_IMG_TLV_INFO_SIZE > ic->size) {
+		return -EFBIG;
+	}
+
+	return 0;
+}
+
+/* Check the vector table, in the "len" bytes at "data", at "off". */
+static int vectors_check(struct mcuboot_img_check *ic, const u8_t *data,
+			 size_t off, size_t len)
+{
+	u8_t *vectors = ic->hdr;	/* the header is done with */
+	u32_t start = ic->img_start;
+	u32_t reset;
+
+	if (!ic->exec_size || off + len <= start ||
+	    off >= start + MI_VECTORS_SIZE) {
+		return 0;
+	}
+
+	/* Copy the part of the vector table which is in "data". */
+	if (off < start) {
+		data += start - off;
+		len -= start - off;
+		off = start;
+	}
+	len = MIN(len, start + MI_VECTORS_SIZE - off);
+	memcpy(vectors + off - start, data, len);
+	if (off + len < start + MI_VECTORS_SIZE) {
+		return 0;
+	}
+
+	/* Ignoring the Thumb bit, the reset handler must be in there. */
+	reset = sys_get_le32(vectors + sizeof(u32_t)) & ~1;
+	if (reset < ic->exec_base + start ||
+	    reset >= ic->exec_base + ic->exec_size) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int tlv_info_done(struct mcuboot_img_check *ic)
+{
+	u16_t tlv_tot = sys_get_le16(ic->hdr + 2);
+
+	if (sys_get_le16(ic->hdr) != MCUBOOT_IMG_TLV_INFO_MAGIC ||
+	    tlv_tot < MCUBOOT_IMG_TLV_INFO_SIZE) {
+		return -EINVAL;
+	}
+
+	ic->tlv_end = ic->hashed_end + tlv_tot;
+	if (ic->tlv_end > ic->max_size ||
+	    (ic->size && ic->tlv_end > ic->size)) {
+		return -EFBIG;
+	}
+
+	return 0;
+}
+
+/* The TLV's header ends at "end". */
+static int tlv_hdr_done(struct mcuboot_img_check *ic, size_t end)
+{
+	ic->tlv_type = ic->hdr[0];
+	ic->tlv_left = sys_get_le16(ic->hdr + 2);
+
+	if (end > ic->tlv_end || ic->tlv_left > ic->tlv_end - end) {
+		return -EINVAL;
+	}
+	if (ic->tlv_type == MCUBOOT_IMG_TLV_SHA256) {
+		if (ic->tlv_left != MCUBOOT_IMG_SHA256_SIZE) {
+			return -EINVAL;
+		}
+		ic->sha256_found = true;
+	}
+
+	return 0;
+}
+
+/* Append up to "len" bytes at "data" to ic->hdr, until it has "size". */
+static size_t hdr_fill(struct mcuboot_img_check *ic, const u8_t *data,
+		       size_t len, size_t size)
+{
+	size_t chunk = MIN(len, size - ic->hdr_len);
+
+	memcpy(ic->hdr + ic->hdr_len, data, chunk);
+	ic->hdr_len += chunk;
+	return chunk;
+}
+
+void mcuboot_img_check_init(struct mcuboot_img_check *ic, size_t max_size,
+			    size_t size, u32_t exec_base, u32_t exec_size)
+{
+	memset(ic, 0, sizeof(*ic));
+	ic->max_size = max_size;
+	ic->size = size;
+	ic->exec_base = exec_base;
+	ic->exec_size = exec_size;
+	ic->state = MI_HEADER;
+	mbedtls_sha256_init(&ic->sha256_ctx);
+	mbedtls_sha256_starts_ret(&ic->sha256_ctx, 0);
+}
+
+int mcuboot_img_check_feed(struct mcuboot_img_check *ic, const u8_t *data,
+			   size_t len)
+{
+	size_t chunk;
+
+	while (len && !ic->err) {
+		switch (ic->state) {
+		case MI_HEADER:
+			chunk = hdr_fill(ic, data, len, MCUBOOT_IMG_HDR_SIZE);
+			mbedtls_sha256_update_ret(&ic->sha256_ctx, data, chunk);
+			if (ic->hdr_len == MCUBOOT_IMG_HDR_SIZE) {
+				ic->err = header_done(ic);
+				ic->state = MI_IMAGE;
+			}
+			break;
+		case MI_IMAGE:
+			if (ic->pos == ic->hashed_end) {
+				mbedtls_sha256_finish_ret(&ic->sha256_ctx,
+							  ic->digest);
+				ic->hdr_len = 0;
+				ic->state = MI_TLV_INFO;
+				continue;
+			}
+			chunk = MIN(len, ic->hashed_end - ic->pos);
+			mbedtls_sha256_update_ret(&ic->sha256_ctx, data, chunk);
+			ic->err = vectors_check(ic, data, ic->pos, chunk);
+			break;
+		case MI_TLV_INFO:
+			chunk = hdr_fill(ic, data, len,
+					 MCUBOOT_IMG_TLV_INFO_SIZE);
+			if (ic->hdr_len == MCUBOOT_IMG_TLV_INFO_SIZE) {
+				ic->err = tlv_info_done(ic);
+				ic->hdr_len = 0;
+				ic->state = MI_TLV_HDR;
+			}
+			break;
+		case MI_TLV_HDR:
+			if (ic->pos == ic->tlv_end) {
+				ic->state = MI_TRAILER;
+				continue;
+			}
+			chunk = hdr_fill(ic, data, len,
+					 MCUBOOT_IMG_TLV_HDR_SIZE);
+			if (ic->hdr_len == MCUBOOT_IMG_TLV_HDR_SIZE) {
+				ic->err = tlv_hdr_done(ic, ic->pos + chunk);
+				ic->hdr_len = 0;
+				ic->state = MI_TLV_DATA;
+			}
+			break;
+		case MI_TLV_DATA:
+			if (!ic->tlv_left) {
+				ic->state = MI_TLV_HDR;
+				continue;
+			}
+			chunk = MIN(len, ic->tlv_left);
+			if (ic->tlv_type == MCUBOOT_IMG_TLV_SHA256) {
+				memcpy(ic->sha256 + sizeof(ic->sha256) -
+				       ic->tlv_left, data, chunk);
+			}
+			ic->tlv_left -= chunk;
+			break;
+		default:
+			chunk = len;
+			break;
+		}
+
+		ic->pos += chunk;
+		data += chunk;
+		len -= chunk;
+		if (ic->pos > ic->max_size ||
+		    (ic->size && ic->pos > ic->size)) {
+			ic->err = -EFBIG;
+		}
+	}
+
+	return ic->err;
+}
+
+int mcuboot_img_check_finish(struct mcuboot_img_check *ic)
+{
+	if (ic->err) {
+		goto out;
+	}
+
+	/* The image and TLVs must be complete; the padding is optional. */
+	if (ic->state < MI_TLV_HDR || ic->pos < ic->tlv_end) {
+		ic->err = -EFBIG;
+	} else if (ic->size && ic->pos != ic->size) {
+		ic->err = -EFBIG;
+	} else if (!ic->sha256_found ||
+		   memcmp(ic->digest, ic->sha256, sizeof(ic->digest))) {
+		ic->err = -EBADMSG;
+	}
+
+ out:
+	mbedtls_sha256_free(&ic->sha256_ctx);
+	return ic->err;
+}
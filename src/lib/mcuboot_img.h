@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_MCUBOOT_IMG_H__
+#define FOTA_MCUBOOT_IMG_H__
+
+/**
+ * @file
+ * @brief Streaming check of MCUboot images.
+ *
+ * This checks an image for MCUboot as it is written, in arbitrarily
+ * sized pieces, so that a bad one can be rejected as soon as what's
+ * wrong with it arrives, rather than by MCUboot after a reboot.
+ *
+ * All values are little endian. An image starts with this header:
+ *
+ *     u32_t magic;            MCUBOOT_IMG_MAGIC
+ *     u32_t load_addr;        0, unless loaded to RAM
+ *     u16_t hdr_size;         size of the header, including padding
+ *     u16_t pad1;
+ *     u32_t img_size;         size of the image after the header
+ *     u32_t flags;            MCUBOOT_IMG_F_*
+ *     u8_t ver[8];
+ *     u32_t pad2;
+ *
+ * padded to hdr_size, followed by the image, whose SHA-256 (of the
+ * header and image) is in the TLV area which follows:
+ *
+ *     u16_t magic;            MCUBOOT_IMG_TLV_INFO_MAGIC
+ *     u16_t tlv_tot;          size of the TLV area, including this
+ *
+ * and then TLVs, each with this header and len bytes of data:
+ *
+ *     u8_t type;              MCUBOOT_IMG_TLV_*
+ *     u8_t pad;
+ *     u16_t len;
+ *
+ * Anything after the TLV area (such as the padding added by
+ * "imgtool sign --pad") is ignored. Signatures are left to MCUboot,
+ * which holds the key.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+
+#define MCUBOOT_IMG_MAGIC		0x96f3b83d
+#define MCUBOOT_IMG_HDR_SIZE		32
+#define MCUBOOT_IMG_F_NON_BOOTABLE	0x00000010
+#define MCUBOOT_IMG_F_RAM_LOAD		0x00000020
+#define MCUBOOT_IMG_TLV_INFO_MAGIC	0x6907
+#define MCUBOOT_IMG_TLV_INFO_SIZE	4
+#define MCUBOOT_IMG_TLV_HDR_SIZE	4
+#define MCUBOOT_IMG_TLV_SHA256		0x10
+#define MCUBOOT_IMG_SHA256_SIZE		32
+
+/* Everything in here is private. */
+struct mcuboot_img_check {
+	size_t max_size;
+	size_t size;
+	u32_t exec_base;
+	u32_t exec_size;
+	int err;
+	u8_t state;
+	/* Header being assembled. */
+	u8_t hdr[MCUBOOT_IMG_HDR_SIZE];
+	size_t hdr_len;
+	size_t pos;		/* bytes checked */
+	u32_t img_start;	/* end of the header's padding */
+	u32_t hashed_end;	/* end of the image */
+	u32_t tlv_end;		/* end of the TLV area */
+	u8_t tlv_type;
+	u16_t tlv_left;		/* bytes of the current TLV's data */
+	bool sha256_found;
+	u8_t sha256[MCUBOOT_IMG_SHA256_SIZE];
+	u8_t digest[MCUBOOT_IMG_SHA256_SIZE];
+	mbedtls_sha256_context sha256_ctx;
+};
+
+/**
+ * @brief Prepare to check a new image.
+ *
+ * If exec_size isn't 0, the image must be an ARM Cortex-M image run
+ * in place from exec_base, as images in slot0 are: the reset vector
+ * in its vector table, which follows the header, must point into
+ * the exec_size bytes at exec_base. This catches images built for
+ * another board or flash layout.
+ *
+ * @param ic Check state to initialize
+ * @param max_size Size of the slot the image is written to
+ * @param size Size of the image, if known, or 0
+ * @param exec_base Address the image runs from
+ * @param exec_size Size of the area the image runs from, or 0
+ */
+void mcuboot_img_check_init(struct mcuboot_img_check *ic, size_t max_size,
+			    size_t size, u32_t exec_base, u32_t exec_size);
+
+/**
+ * @brief Check the next piece of an image.
+ *
+ * Errors are sticky: once this fails, it keeps returning the same
+ * error without doing anything else.
+ *
+ * @param ic Check state
+ * @param data Next bytes of the image
+ * @param len Number of bytes in data
+ * @return 0 on success; -EINVAL if the header or TLV area is
+ *         malformed, or the image isn't for this device, or -EFBIG
+ *         if the image doesn't fit, or doesn't match its size.
+ */
+int mcuboot_img_check_feed(struct mcuboot_img_check *ic, const u8_t *data,
+			   size_t len);
+
+/**
+ * @brief Finish checking an image.
+ *
+ * @param ic Check state
+ * @return 0 if the whole image was seen and its SHA-256 matched the
+ *         one in its TLVs, -EBADMSG if it didn't, or as
+ *         mcuboot_img_check_feed().
+ */
+int mcuboot_img_check_finish(struct mcuboot_img_check *ic);
+
+#endif /* FOTA_MCUBOOT_IMG_H__ */
@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <flash.h>
+#include <misc/byteorder.h>
+#include <misc/util.h>
+
+#include "state_store.h"
+
+#define HDR_SIZE		(2 * sizeof(u32_t))
+#define REC_HDR_SIZE		4
+#define ERASED_WORD		0xffffffff
+
+static size_t aligned(const struct state_store *ss, size_t len)
+{
+	return ROUND_UP(len, ss->write_block_size);
+}
+
+static off_t sector_offset(const struct state_store *ss, u8_t sector)
+{
+	return ss->offset + sector * ss->sector_size;
+}
+
+static u16_t crc16_ccitt(const u8_t *data, size_t len, u16_t crc)
+{
+	int i;
+
+	while (len--) {
+		crc ^= (u16_t)*data++ << 8;
+		for (i = 0; i < 8; i++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+static u16_t rec_crc(u8_t id, const u8_t *data, u8_t len)
+{
+	u8_t hdr[2] = { id, len };
+
+	return crc16_ccitt(data, len, crc16_ccitt(hdr, sizeof(hdr), 0xffff));
+}
+
+static int flash_program(struct state_store *ss, off_t off, const void *data,
+			 size_t len)
+{
+	int ret;
+
+	flash_write_protection_set(ss->flash_dev, false);
+	ret = flash_write(ss->flash_dev, off, data, len);
+	flash_write_protection_set(ss->flash_dev, true);
+	return ret;
+}
+
+static int sector_erase(struct state_store *ss, u8_t sector)
+{
+	int ret;
+
+	flash_write_protection_set(ss->flash_dev, false);
+	ret = flash_erase(ss->flash_dev, sector_offset(ss, sector),
+			  ss->sector_size);
+	flash_write_protection_set(ss->flash_dev, true);
+	return ret;
+}
+
+static int sector_write_hdr(struct state_store *ss, u8_t sector, u32_t seq)
+{
+	u8_t hdr[8];
+
+	memset(hdr, 0xff, sizeof(hdr));
+	sys_put_le32(STATE_STORE_MAGIC, hdr);
+	sys_put_le32(seq, hdr + sizeof(u32_t));
+	return flash_program(ss, sector_offset(ss, sector), hdr,
+			     aligned(ss, HDR_SIZE));
+}
+
+/* Returns false if the sector doesn't hold a store. */
+static bool sector_read_hdr(struct state_store *ss, u8_t sector, u32_t *seq)
+{
+	u8_t hdr[HDR_SIZE];
+
+	if (flash_read(ss->flash_dev, sector_offset(ss, sector), hdr,
+		       sizeof(hdr)) ||
+	    sys_get_le32(hdr) != STATE_STORE_MAGIC) {
+		return false;
+	}
+
+	*seq = sys_get_le32(hdr + sizeof(u32_t));
+	return true;
+}
+
+/* Append a record at "pos" in "sector"; returns its size, or an error. */
+static int rec_append(struct state_store *ss, u8_t sector, size_t pos,
+		      u8_t id, const u8_t *data, u8_t len)
+{
+	u8_t rec[REC_HDR_SIZE + STATE_STORE_VALUE_MAX + 8];
+	size_t size = aligned(ss, REC_HDR_SIZE + len);
+	int ret;
+
+	if (pos + size > ss->sector_size) {
+		return -ENOSPC;
+	}
+
+	memset(rec, 0xff, size);
+	rec[0] = id;
+	rec[1] = len;
+	sys_put_le16(rec_crc(id, data, len), rec + 2);
+	if (len) {
+		memcpy(rec + REC_HDR_SIZE, data, len);
+	}
+	ret = flash_program(ss, sector_offset(ss, sector) + pos, rec, size);
+	if (ret) {
+		return ret;
+	}
+
+	return size;
+}
+
+/* Replay the records in the active sector into the cache. */
+static void sector_replay(struct state_store *ss)
+{
+	off_t base = sector_offset(ss, ss->sector);
+	u8_t data[STATE_STORE_VALUE_MAX];
+	u8_t hdr[REC_HDR_SIZE];
+	size_t pos = aligned(ss, HDR_SIZE);
+	u8_t id, len;
+
+	while (pos + REC_HDR_SIZE <= ss->sector_size) {
+		if (flash_read(ss->flash_dev, base + pos, hdr, sizeof(hdr)) ||
+		    sys_get_le32(hdr) == ERASED_WORD) {
+			break;
+		}
+
+		id = hdr[0];
+		len = hdr[1];
+		if (len > STATE_STORE_VALUE_MAX ||
+		    pos + aligned(ss, REC_HDR_SIZE + len) > ss->sector_size) {
+			/* Garbage; make the next write switch sectors. */
+			pos = ss->sector_size;
+			break;
+		}
+
+		if (!flash_read(ss->flash_dev, base + pos + REC_HDR_SIZE,
+				data, len) &&
+		    id < STATE_STORE_IDS &&
+		    sys_get_le16(hdr + 2) == rec_crc(id, data, len)) {
+			ss->present[id] = len != 0;
+			ss->len[id] = len;
+			memcpy(ss->value[id], data, len);
+		}
+
+		pos += aligned(ss, REC_HDR_SIZE + len);
+	}
+
+	ss->pos = pos;
+}
+
+/*
+ * Copy the latest values to the other sector, with "id" set to the
+ * "len" bytes at "data" (or deleted, if len is 0), and switch to it.
+ */
+static int sector_switch(struct state_store *ss, u8_t id, const u8_t *data,
+			 u8_t len)
+{
+	u8_t next = !ss->sector;
+	size_t pos = aligned(ss, HDR_SIZE);
+	int ret;
+	u8_t i;
+
+	ret = sector_erase(ss, next);
+	if (ret) {
+		return ret;
+	}
+
+	for (i = 0; i < STATE_STORE_IDS; i++) {
+		if (i == id) {
+			if (!len) {
+				continue;
+			}
+			ret = rec_append(ss, next, pos, i, data, len);
+		} else if (ss->present[i]) {
+			ret = rec_append(ss, next, pos, i, ss->value[i],
+					 ss->len[i]);
+		} else {
+			continue;
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		pos += ret;
+	}
+
+	/* Only now does the new sector take over. */
+	ret = sector_write_hdr(ss, next, ss->seq + 1);
+	if (ret) {
+		return ret;
+	}
+
+	ss->sector = next;
+	ss->seq++;
+	ss->pos = pos;
+	return 0;
+}
+
+static int store_set(struct state_store *ss, u8_t id, const u8_t *data,
+		     u8_t len)
+{
+	int ret;
+
+	k_mutex_lock(&ss->lock, K_FOREVER);
+
+	if (ss->present[id] == (len != 0) &&
+	    (!len || (ss->len[id] == len &&
+		      !memcmp(ss->value[id], data, len)))) {
+		ret = 0;
+		goto out;
+	}
+
+	ret = rec_append(ss, ss->sector, ss->pos, id, data, len);
+	if (ret == -ENOSPC) {
+		ret = sector_switch(ss, id, data, len);
+	} else if (ret > 0) {
+		ss->pos += ret;
+		ret = 0;
+	}
+	if (ret) {
+		goto out;
+	}
+
+	ss->present[id] = len != 0;
+	ss->len[id] = len;
+	if (len) {
+		memcpy(ss->value[id], data, len);
+	}
+
+ out:
+	k_mutex_unlock(&ss->lock);
+	return ret;
+}
+
+int state_store_init(struct state_store *ss, struct device *flash_dev,
+		     off_t offset, size_t sector_size,
+		     size_t write_block_size,
+		     const struct state_store_record *init, size_t num_init)
+{
+	u32_t seq[2];
+	bool valid[2];
+	size_t i;
+	int ret;
+
+	memset(ss, 0, sizeof(*ss));
+	ss->flash_dev = flash_dev;
+	ss->offset = offset;
+	ss->sector_size = sector_size;
+	ss->write_block_size = write_block_size;
+	k_mutex_init(&ss->lock);
+
+	if (write_block_size > 8) {
+		return -EINVAL;
+	}
+
+	valid[0] = sector_read_hdr(ss, 0, &seq[0]);
+	valid[1] = sector_read_hdr(ss, 1, &seq[1]);
+	if (valid[0] || valid[1]) {
+		/* The newer one wins, allowing for wraparound. */
+		if (!valid[0] ||
+		    (valid[1] && (s32_t)(seq[1] - seq[0]) > 0)) {
+			ss->sector = 1;
+		}
+		ss->seq = seq[ss->sector];
+		sector_replay(ss);
+		return 0;
+	}
+
+	for (i = 0; i < num_init; i++) {
+		if (init[i].id >= STATE_STORE_IDS || !init[i].len ||
+		    init[i].len > STATE_STORE_VALUE_MAX) {
+			return -EINVAL;
+		}
+		ss->present[init[i].id] = true;
+		ss->len[init[i].id] = init[i].len;
+		memcpy(ss->value[init[i].id], init[i].data, init[i].len);
+	}
+
+	/*
+	 * Switching from sector 0 copies the initial values into sector
+	 * 1 before its header, which gets sequence number 0.
+	 */
+	ss->sector = 0;
+	ss->seq = (u32_t)-1;
+	ret = sector_switch(ss, STATE_STORE_IDS, NULL, 0);
+	if (ret) {
+		return ret;
+	}
+
+	return 1;
+}
+
+int state_store_read(struct state_store *ss, u8_t id, void *data,
+		     size_t len)
+{
+	int ret = -ENOENT;
+
+	if (id >= STATE_STORE_IDS) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&ss->lock, K_FOREVER);
+	if (ss->present[id]) {
+		memcpy(data, ss->value[id], MIN(len, ss->len[id]));
+		ret = ss->len[id];
+	}
+	k_mutex_unlock(&ss->lock);
+
+	return ret;
+}
+
+int state_store_write(struct state_store *ss, u8_t id, const void *data,
+		      size_t len)
+{
+	if (id >= STATE_STORE_IDS || !len || len > STATE_STORE_VALUE_MAX) {
+		return -EINVAL;
+	}
+
+	return store_set(ss, id, data, len);
+}
+
+int state_store_delete(struct state_store *ss, u8_t id)
+{
+	if (id >= STATE_STORE_IDS) {
+		return -EINVAL;
+	}
+
+	return store_set(ss, id, NULL, 0);
+}
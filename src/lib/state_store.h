@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_STATE_STORE_H__
+#define FOTA_STATE_STORE_H__
+
+/**
+ * @file
+ * @brief Log-structured store for small persistent values.
+ *
+ * Values are identified by a small ID, and are appended to a log in
+ * one of two flash sectors, so that updating one doesn't erase
+ * anything. When the active sector fills up, the latest value of
+ * each ID is copied to the other sector, which then becomes active.
+ * The latest values are cached in RAM, so reads don't touch flash.
+ *
+ * Each sector starts with this header, padded to the flash write
+ * block size:
+ *
+ *     u32_t magic;            STATE_STORE_MAGIC
+ *     u32_t seq;              incremented with each sector switch
+ *
+ * followed by records, each padded to the write block size:
+ *
+ *     u8_t id;
+ *     u8_t len;               0 if the value was deleted
+ *     u16_t crc;              CRC-16/CCITT of id, len and data
+ *     u8_t data[len];
+ *
+ * A sector's header is written after the values copied into it, so
+ * a switch interrupted by a reset leaves the old sector in charge.
+ * Records which fail their CRC are ignored.
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <kernel.h>
+#include <device.h>
+
+#define STATE_STORE_MAGIC	0x54534b48 /* "HKST" */
+/* Number of different IDs, which are 0 to STATE_STORE_IDS - 1. */
+#define STATE_STORE_IDS		8
+/* Largest value which can be stored. */
+#define STATE_STORE_VALUE_MAX	48
+
+/* Everything in here is private. */
+struct state_store {
+	struct device		*flash_dev;
+	off_t			 offset;
+	size_t			 sector_size;
+	size_t			 write_block_size;
+	u32_t			 seq;
+	u8_t			 sector;	/* active: 0 or 1 */
+	size_t			 pos;		/* next record */
+	struct k_mutex		 lock;
+	/* Cache of the latest values. */
+	u8_t			 len[STATE_STORE_IDS];
+	bool			 present[STATE_STORE_IDS];
+	u8_t	 value[STATE_STORE_IDS][STATE_STORE_VALUE_MAX];
+};
+
+/* A value to create a store with. */
+struct state_store_record {
+	u8_t			 id;
+	const void		*data;
+	size_t			 len;
+};
+
+/**
+ * @brief Open a store, or create it if there is none.
+ *
+ * The store occupies the two sectors of "sector_size" bytes starting
+ * at "offset". If neither holds a store, the second is erased and a
+ * new store is created there, holding the "num_init" values of
+ * "init". These are written before the sector header, so the store
+ * only becomes valid with them in it, and the first sector is left
+ * alone until the store switches sectors: whatever was there before
+ * can still be read if the device is reset in the meantime.
+ *
+ * @param ss Store to initialize
+ * @param flash_dev Flash device the store lives on
+ * @param offset Offset of the first sector
+ * @param sector_size Size of each sector; a multiple of the erase size
+ * @param write_block_size Flash write block size, at most 8
+ * @param init Values for a new store, or NULL
+ * @param num_init Number of values in init
+ * @return 0 if a store was found, 1 if a new one was created, or a
+ *         negative errno if there was a flash error or a bad value.
+ */
+int state_store_init(struct state_store *ss, struct device *flash_dev,
+		     off_t offset, size_t sector_size,
+		     size_t write_block_size,
+		     const struct state_store_record *init, size_t num_init);
+
+/**
+ * @brief Get the value of an ID.
+ *
+ * This only copies from RAM.
+ *
+ * @param ss Store
+ * @param id ID of the value
+ * @param data Where to copy the value
+ * @param len Size of data; longer values are truncated
+ * @return Length of the value, or -ENOENT if there is none.
+ */
+int state_store_read(struct state_store *ss, u8_t id, void *data,
+		     size_t len);
+
+/**
+ * @brief Set the value of an ID.
+ *
+ * Writing the value an ID already has does nothing.
+ *
+ * @param ss Store
+ * @param id ID of the value
+ * @param data New value
+ * @param len Length of the new value, from 1 to STATE_STORE_VALUE_MAX
+ * @return 0 on success, -EINVAL if id or len is out of range, or a
+ *         negative errno if there was a flash error.
+ */
+int state_store_write(struct state_store *ss, u8_t id, const void *data,
+		      size_t len);
+
+/**
+ * @brief Delete the value of an ID.
+ *
+ * @param ss Store
+ * @param id ID of the value
+ * @return 0 on success, or as state_store_write().
+ */
+int state_store_delete(struct state_store *ss, u8_t id);
+
+#endif /* FOTA_STATE_STORE_H__ */
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <mbedtls/x509_crt.h>
+
+#include "tls_conf.h"
+
+/* PEM, which mbedTLS wants NUL terminated. */
+static const unsigned char ca_cert_pem[] = {
+#include "fota_ca_cert.inc"
+	0x00
+};
+
+int tls_conf_ca_cert_cb(struct net_app_ctx *ctx, void *ca_cert)
+{
+	if (mbedtls_x509_crt_parse(ca_cert, ca_cert_pem,
+				   sizeof(ca_cert_pem))) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2018 Foundries.io
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FOTA_TLS_CONF_H__
+#define FOTA_TLS_CONF_H__
+
+/**
+ * @file
+ * @brief TLS settings shared by the hawkBit and MQTT clients.
+ *
+ * Both clients use net_app's mbedTLS support. The servers'
+ * certificates are checked against the CA certificate built in from
+ * CONFIG_FOTA_TLS_CA_CERT, and their name against
+ * CONFIG_FOTA_TLS_HOSTNAME.
+ */
+
+#include <net/net_app.h>
+
+/* Size of each client's TLS request buffer. */
+#define TLS_CONF_REQUEST_BUF_SIZE	1024
+/* Personalization data for each client's random number generator. */
+#define TLS_CONF_PERSONALIZATION	"dm-hawkbit-mqtt"
+#define TLS_CONF_HOSTNAME		CONFIG_FOTA_TLS_HOSTNAME
+
+/**
+ * @brief Load the CA certificate.
+ *
+ * This is a net_app_ca_cert_cb_t, for net_app_client_tls() and the
+ * functions wrapping it.
+ *
+ * @param ctx net_app context setting up TLS
+ * @param ca_cert mbedtls_x509_crt to load the certificate into
+ * @return 0 on success, -EINVAL if the certificate can't be parsed.
+ */
+int tls_conf_ca_cert_cb(struct net_app_ctx *ctx, void *ca_cert);
+
+#endif /* FOTA_TLS_CONF_H__ */
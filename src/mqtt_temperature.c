@@ -38,7 +38,13 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 
 #include "product_id.h"
 #include "app_work_queue.h"
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+#include "hawkbit.h"
+#endif
 #include "mqtt_temperature.h"
+#if defined(CONFIG_FOTA_TLS)
+#include "tls_conf.h"
+#endif
 #ifdef CONFIG_NET_L2_BT
 #include "bluetooth.h"
 #endif
@@ -47,7 +53,11 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 #define NUM_TEST_RESULTS	5
 #define AMB_TEMP_DEV		"fota-ambient-temp"
 #define DIE_TEMP_DEV		"fota-die-temp"
+#if defined(CONFIG_FOTA_TLS)
+#define MQTT_PORT		8883
+#else
 #define MQTT_PORT		1883
+#endif
 #define MQTT_USERNAME		CONFIG_FOTA_MQTT_USERNAME
 #define MQTT_PASSWORD		CONFIG_FOTA_MQTT_PASSWORD
 #define MQTT_CONNECT_TRIES	10
@@ -55,6 +65,15 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 #define CONNECT_WAIT_TIMEOUT	K_MSEC(500)
 #define PUBLISH_DELAY_TIME	K_SECONDS(3)
 #define MQTT_NET_TIMEOUT	K_MSEC(300)
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+#define MQTT_APP_TYPE		MQTT_APP_PUBLISHER_SUBSCRIBER
+/* This device's poll topic, and the fleet's if there is one. */
+#define MQTT_POLL_TOPICS \
+	(sizeof(CONFIG_FOTA_MQTT_POLL_FLEET_TOPIC) > 1 ? 2 : 1)
+#define MQTT_POLL_PKT_ID	1
+#else
+#define MQTT_APP_TYPE		MQTT_APP_PUBLISHER
+#endif
 
 /* Network configuration checks */
 #if defined(CONFIG_NET_IPV6)
@@ -98,6 +117,15 @@ struct temp_mqtt_data {
 	struct k_sem mqtt_wait_sem;
 	struct k_delayed_work mqtt_work;
 	int failures;
+	bool published;			/* at least once since boot */
+	int connects;			/* since boot */
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+	u8_t poll_topic[64];		/* this device's poll trigger */
+	bool subscribed;		/* to the poll triggers */
+#endif
+#if defined(CONFIG_FOTA_TLS)
+	u8_t tls_buffer[TLS_CONF_REQUEST_BUF_SIZE];
+#endif
 
 	/* Sensor data sources. */
 	struct device *amb_dev;
@@ -152,6 +180,11 @@ static struct net_buf_pool *data_pool(void)
 #define data_pool NULL
 #endif /* CONFIG_NET_CONTEXT_NET_PKT_POOL */
 
+#if defined(CONFIG_FOTA_TLS)
+NET_APP_TLS_POOL_DEFINE(mqtt_tls_pool, 10);
+K_THREAD_STACK_DEFINE(mqtt_tls_stack, CONFIG_FOTA_TLS_STACK_SIZE);
+#endif
+
 static void temp_mqtt_reboot_check(struct temp_mqtt_data *data, int result)
 {
 	if (result) {
@@ -273,6 +306,9 @@ static void temp_mqtt_connect_cb(struct mqtt_ctx *mqtt)
 static void temp_mqtt_disconnect_cb(struct mqtt_ctx *mqtt)
 {
 	LOG_DBG("disconnected");
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+	hawkbit_set_poll_trigger(false);
+#endif
 	k_sem_give(&mqtt_to_data(mqtt)->mqtt_wait_sem);
 }
 
@@ -281,6 +317,65 @@ static void temp_mqtt_malformed_cb(struct mqtt_ctx *mqtt, u16_t pkt_type)
 	LOG_DBG("malformed data, type 0x%x", pkt_type);
 }
 
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+static int temp_mqtt_subscribe_cb(struct mqtt_ctx *mqtt, u16_t pkt_id,
+				  u8_t items, enum mqtt_qos qos[])
+{
+	struct temp_mqtt_data *data = mqtt_to_data(mqtt);
+	int i;
+
+	/* The broker grants QoS 0x80 to topics it refused. */
+	data->subscribed = items == MQTT_POLL_TOPICS;
+	for (i = 0; i < items; i++) {
+		if (qos[i] > MQTT_QoS2) {
+			data->subscribed = false;
+		}
+	}
+	k_sem_give(&data->mqtt_wait_sem);
+	return 0;
+}
+
+/* Whatever it says, a message on the poll topics asks for a poll. */
+static int temp_mqtt_publish_rx_cb(struct mqtt_ctx *mqtt,
+				   struct mqtt_publish_msg *msg,
+				   u16_t pkt_id, enum mqtt_packet type)
+{
+	LOG_DBG("poll trigger on %.*s", msg->topic_len, msg->topic);
+	hawkbit_poll_now();
+	return 0;
+}
+
+/*
+ * Subscribe to the hawkBit poll triggers. If the broker won't have
+ * it, polls are just as frequent as without them.
+ */
+static void temp_mqtt_subscribe(struct temp_mqtt_data *data)
+{
+	const char *topics[] = {
+		(const char *)data->poll_topic,
+		CONFIG_FOTA_MQTT_POLL_FLEET_TOPIC,
+	};
+	const enum mqtt_qos qos[] = { MQTT_QoS0, MQTT_QoS0 };
+	int ret;
+
+	snprintk(data->poll_topic, sizeof(data->poll_topic),
+		 "id/%s/update-available", data->mqtt_client_id);
+	data->subscribed = false;
+	ret = mqtt_tx_subscribe(&data->mqtt, MQTT_POLL_PKT_ID,
+				MQTT_POLL_TOPICS, topics, qos);
+	if (ret) {
+		LOG_ERR("mqtt_tx_subscribe: %d", ret);
+	} else {
+		temp_mqtt_wait(data, CONNECT_WAIT_TIMEOUT);
+	}
+
+	if (!data->subscribed) {
+		LOG_WRN("Not subscribed to poll triggers");
+	}
+	hawkbit_set_poll_trigger(data->subscribed);
+}
+#endif
+
 /*
  * Try to connect to the MQTT broker. The helper context must have
  * properly initialized mqtt and connect_msg fields.
@@ -289,6 +384,7 @@ static int temp_mqtt_connect(struct temp_mqtt_data *data)
 {
 	struct mqtt_ctx *mqtt = &data->mqtt;
 	struct mqtt_connect_msg *msg = &data->connect_msg;
+	u32_t start_ms = k_uptime_get_32();
 	int i = 0;
 	int ret = 0;
 
@@ -312,6 +408,16 @@ static int temp_mqtt_connect(struct temp_mqtt_data *data)
 		ret = temp_mqtt_wait(data, CONNECT_WAIT_TIMEOUT);
 
 		if (mqtt->connected) {
+			/*
+			 * The connection is kept for good, so this
+			 * (and a TLS handshake) should be rare.
+			 */
+			data->connects++;
+			LOG_INF("Connection %d took %u ms", data->connects,
+				k_uptime_get_32() - start_ms);
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+			temp_mqtt_subscribe(data);
+#endif
 			return 0;
 		}
 	}
@@ -357,6 +463,10 @@ static int temp_mqtt_publish(struct temp_mqtt_data *data)
 	 * and PINGRESP (depending on nonzero keep_alive). Those will
 	 * never be transmitted at the same time, as we ought to wait
 	 * for CONNACK before sending any PINGREQs.
+	 *
+	 * With CONFIG_FOTA_MQTT_POLL_TRIGGER, there's also one SUBACK,
+	 * waited for after CONNACK, and the rare QoS 0 PUBLISH on the
+	 * poll topics, which needs no reply.
 	 */
 	pub_msg->msg = data->mqtt_message;
 	pub_msg->msg_len = strlen(pub_msg->msg);
@@ -369,6 +479,10 @@ static int temp_mqtt_publish(struct temp_mqtt_data *data)
 	ret = mqtt_tx_publish(&data->mqtt, &data->pub_msg);
 	if (ret) {
 		LOG_ERR("publish failed: %d", ret);
+	} else if (!data->published) {
+		/* How long startup took, as far as the backend can tell. */
+		LOG_INF("First publish %u ms after boot", k_uptime_get_32());
+		data->published = true;
 	}
 
 	return ret;
@@ -383,6 +497,10 @@ static void temp_mqtt_try_to_publish(struct k_work *work)
 	int ret = 0;
 
 	if (!data->mqtt.connected) {
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+		/* Triggers are off until we're subscribed again. */
+		hawkbit_set_poll_trigger(false);
+#endif
 		ret = temp_mqtt_connect(data);
 		if (ret) {
 			LOG_ERR("connection failed: %d", ret);
@@ -448,10 +566,26 @@ static int init_mqtt_plumbing(struct temp_mqtt_data *data)
 	data->mqtt.connect = temp_mqtt_connect_cb;
 	data->mqtt.disconnect = temp_mqtt_disconnect_cb;
 	data->mqtt.malformed = temp_mqtt_malformed_cb;
+#if defined(CONFIG_FOTA_MQTT_POLL_TRIGGER)
+	data->mqtt.subscribe = temp_mqtt_subscribe_cb;
+	data->mqtt.publish_rx = temp_mqtt_publish_rx_cb;
+#endif
 	data->mqtt.net_timeout = MQTT_NET_TIMEOUT;
 	data->mqtt.peer_addr_str = MQTT_HELPER_SERVER_ADDR;
 	data->mqtt.peer_port = MQTT_PORT;
-	ret = mqtt_init(&data->mqtt, MQTT_APP_PUBLISHER);
+#if defined(CONFIG_FOTA_TLS)
+	data->mqtt.request_buf = data->tls_buffer;
+	data->mqtt.request_buf_len = sizeof(data->tls_buffer);
+	data->mqtt.personalization_data = (u8_t *)TLS_CONF_PERSONALIZATION;
+	data->mqtt.personalization_data_len =
+		strlen(TLS_CONF_PERSONALIZATION);
+	data->mqtt.cert_host = TLS_CONF_HOSTNAME;
+	data->mqtt.tls_mem_pool = &mqtt_tls_pool;
+	data->mqtt.tls_stack = mqtt_tls_stack;
+	data->mqtt.tls_stack_size = K_THREAD_STACK_SIZEOF(mqtt_tls_stack);
+	data->mqtt.cert_cb = tls_conf_ca_cert_cb;
+#endif
+	ret = mqtt_init(&data->mqtt, MQTT_APP_TYPE);
 	if (ret) {
 		return ret;
 	}